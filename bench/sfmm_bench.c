@@ -0,0 +1,576 @@
+/**
+ * sfmm_bench: microbenchmarks for the sfmm allocator.
+ *
+ * Runs a set of synthetic workloads (or replays a recorded trace) against
+ * sf_malloc / sf_realloc / sf_free and reports throughput, per-operation
+ * latency percentiles and the allocator's fragmentation and utilization.
+ *
+ * Every workload draws from its own xorshift generator seeded from -s, so a
+ * given seed always issues exactly the same operations. With --no-timing only
+ * the deterministic columns are printed, which makes the output directly
+ * diffable between two versions of the allocator.
+ *
+ * A trace is either the text format described at workload_replay() or a
+ * binary trace written by sf_trace_start() (see sfmm_ext.h). With -i, replays
+ * also print fragmentation, utilization and throughput every N operations.
+ * --record writes the run's own calls as a binary trace (ALLOC_TRACE builds).
+ * -p picks the placement policy (first, best or address). Under the same seed,
+ * the policy with the highest utilization needed the least heap.
+ *
+ * Usage: sfmm_bench [-s seed] [-n ops] [-w workload] [-t trace] [-i interval]
+ *                   [-p policy] [--record trace] [--no-timing]
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define MAX_SLOTS       65536     /* Live-object table size (also bounds trace slot ids). */
+#define MAX_SAMPLES     (1 << 21) /* Latency samples kept per workload. */
+#define DEFAULT_OPS     200000
+#define DEFAULT_SEED    1
+
+/*
+ * The main heap is limited to a few dozen pages, so every workload keeps its
+ * live set well below that and releases everything before the next one runs.
+ */
+
+static void* slots[MAX_SLOTS];
+static size_t slot_sizes[MAX_SLOTS];
+static uint32_t samples[MAX_SAMPLES];
+
+typedef struct bench_run {
+    const char* name;
+    uint64_t rng;           // xorshift64 state
+    size_t ops;             // operations issued
+    size_t failed;          // operations that returned NULL
+    size_t sample_count;
+    uint64_t total_ns;
+    int timing;
+    size_t interval;        // replay: ops between progress lines, 0 for none
+    size_t interval_ops;    // ops and time at the last progress line
+    uint64_t interval_ns;
+} bench_run;
+
+/* ------------------------------------------------------------------------
+ * Helpers
+ * ----------------------------------------------------------------------*/
+
+static uint64_t next_random(bench_run* run)
+{
+    uint64_t x = run->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    run->rng = x;
+    return x;
+}
+
+/** Uniform size in [lo, hi]. */
+static size_t random_size(bench_run* run, size_t lo, size_t hi)
+{
+    return lo + (size_t)(next_random(run) % (hi - lo + 1));
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record_latency(bench_run* run, uint64_t start_ns)
+{
+    uint64_t elapsed = now_ns() - start_ns;
+    run->total_ns += elapsed;
+    if (run->sample_count < MAX_SAMPLES)
+        samples[run->sample_count++] = elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
+}
+
+/* Each wrapper issues one allocator call, timing it when timing is enabled. */
+
+static void bench_malloc(bench_run* run, size_t slot, size_t size)
+{
+    uint64_t start = run->timing ? now_ns() : 0;
+    void* ptr = sf_malloc(size);
+    if (run->timing)
+        record_latency(run, start);
+
+    run->ops++;
+    if (ptr == NULL) {
+        run->failed++;
+        return;
+    }
+
+    // Touch the block the way a real client would.
+    memset(ptr, (int)slot, size < 64 ? size : 64);
+    slots[slot] = ptr;
+    slot_sizes[slot] = size;
+}
+
+/** Reallocates the block in slot `from` and stores the result in slot `to`. */
+static void bench_realloc_between(bench_run* run, size_t from, size_t to, size_t size)
+{
+    uint64_t start = run->timing ? now_ns() : 0;
+    void* ptr = sf_realloc(slots[from], size);
+    if (run->timing)
+        record_latency(run, start);
+
+    run->ops++;
+    if (ptr == NULL) {
+        // realloc(p, 0) frees p; any other NULL is a failure that leaves p alone.
+        if (size == 0) {
+            slots[from] = NULL;
+            slot_sizes[from] = 0;
+        } else {
+            run->failed++;
+        }
+        return;
+    }
+
+    slots[from] = NULL;
+    slot_sizes[from] = 0;
+    slots[to] = ptr;
+    slot_sizes[to] = size;
+}
+
+static void bench_realloc(bench_run* run, size_t slot, size_t size)
+{
+    bench_realloc_between(run, slot, slot, size);
+}
+
+static void bench_free(bench_run* run, size_t slot)
+{
+    uint64_t start = run->timing ? now_ns() : 0;
+    sf_free(slots[slot]);
+    if (run->timing)
+        record_latency(run, start);
+
+    run->ops++;
+    slots[slot] = NULL;
+    slot_sizes[slot] = 0;
+}
+
+/** Frees every live slot (not counted as workload operations). */
+static void release_all_slots()
+{
+    for (size_t i = 0; i < MAX_SLOTS; i++) {
+        if (slots[i] != NULL) {
+            sf_free(slots[i]);
+            slots[i] = NULL;
+            slot_sizes[i] = 0;
+        }
+    }
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const bench_run* run, double p)
+{
+    if (run->sample_count == 0)
+        return 0;
+    size_t idx = (size_t)(p * (double)(run->sample_count - 1));
+    return samples[idx];
+}
+
+static void print_header(int timing)
+{
+    if (timing)
+        printf("%-16s %9s %8s %12s %8s %8s %8s %8s %9s %9s %9s\n", "workload", "ops", "failed",
+               "ops/sec", "p50(ns)", "p90(ns)", "p99(ns)", "p99.9", "max(ns)", "frag", "util");
+    else
+        printf("%-16s %9s %8s %9s %9s\n", "workload", "ops", "failed", "frag", "util");
+}
+
+/**
+ * Prints one result row. Fragmentation is sampled while the workload's live set
+ * is still allocated; utilization is the allocator's peak-based figure so far.
+ */
+static void report(bench_run* run, double fragmentation)
+{
+    double utilization = sf_utilization();
+
+    if (!run->timing) {
+        printf("%-16s %9zu %8zu %9.6f %9.6f\n", run->name, run->ops, run->failed,
+               fragmentation, utilization);
+        return;
+    }
+
+    qsort(samples, run->sample_count, sizeof(samples[0]), compare_samples);
+    double ops_per_sec = run->total_ns ? (double)run->ops * 1e9 / (double)run->total_ns : 0.0;
+
+    printf("%-16s %9zu %8zu %12.0f %8u %8u %8u %8u %9u %9.6f %9.6f\n", run->name, run->ops,
+           run->failed, ops_per_sec, percentile(run, 0.50), percentile(run, 0.90),
+           percentile(run, 0.99), percentile(run, 0.999),
+           run->sample_count ? samples[run->sample_count - 1] : 0, fragmentation, utilization);
+}
+
+/* ------------------------------------------------------------------------
+ * Workloads
+ * ----------------------------------------------------------------------*/
+
+/** Small-object churn: random malloc/free of 16-200 byte objects over 256 slots. */
+static void workload_small_churn(bench_run* run, size_t num_ops)
+{
+    const size_t live = 256;
+    while (run->ops < num_ops) {
+        size_t slot = next_random(run) % live;
+        if (slots[slot] == NULL)
+            bench_malloc(run, slot, random_size(run, 16, 200));
+        else
+            bench_free(run, slot);
+    }
+}
+
+/** Producer/consumer: bursts of messages queued in FIFO order and consumed in bursts. */
+static void workload_producer_consumer(bench_run* run, size_t num_ops)
+{
+    const size_t capacity = 128;
+    size_t head = 0, tail = 0, queued = 0;
+
+    while (run->ops < num_ops) {
+        size_t burst = random_size(run, 1, 32);
+
+        for (size_t i = 0; i < burst && queued < capacity && run->ops < num_ops; i++) {
+            bench_malloc(run, tail, random_size(run, 32, 512));
+            if (slots[tail] != NULL) {
+                tail = (tail + 1) % capacity;
+                queued++;
+            }
+        }
+
+        burst = random_size(run, 1, 32);
+        for (size_t i = 0; i < burst && queued > 0 && run->ops < num_ops; i++) {
+            bench_free(run, head);
+            head = (head + 1) % capacity;
+            queued--;
+        }
+    }
+}
+
+/** Realloc growth: append-style buffers that grow to a few KB and are then restarted. */
+static void workload_realloc_growth(bench_run* run, size_t num_ops)
+{
+    const size_t buffers = 8;
+    const size_t max_size = 8192;
+
+    while (run->ops < num_ops) {
+        size_t slot = next_random(run) % buffers;
+        if (slots[slot] == NULL) {
+            bench_malloc(run, slot, random_size(run, 16, 64));
+        } else if (slot_sizes[slot] >= max_size) {
+            bench_free(run, slot);
+        } else {
+            size_t grown = slot_sizes[slot] + random_size(run, 16, 256);
+            bench_realloc(run, slot, grown > max_size ? max_size : grown);
+        }
+    }
+}
+
+/** Random mix: mostly small objects, some medium, rare large ones, with reallocs. */
+static void workload_random_mix(bench_run* run, size_t num_ops)
+{
+    const size_t live = 192;
+    while (run->ops < num_ops) {
+        size_t slot = next_random(run) % live;
+        unsigned choice = (unsigned)(next_random(run) % 100);
+
+        if (slots[slot] == NULL) {
+            size_t size;
+            if (choice < 70)
+                size = random_size(run, 1, 256);
+            else if (choice < 97)
+                size = random_size(run, 257, 2048);
+            else
+                size = random_size(run, 2049, 12000);
+            bench_malloc(run, slot, size);
+        } else if (choice < 80) {
+            bench_free(run, slot);
+        } else {
+            bench_realloc(run, slot, random_size(run, 1, 1024));
+        }
+    }
+}
+
+/**
+ * Prints a progress line every run->interval operations of a replay, so
+ * fragmentation can be followed over the course of a trace. Throughput is
+ * over the operations since the previous line.
+ */
+static void report_progress(bench_run* run)
+{
+    if (run->interval == 0 || run->ops - run->interval_ops < run->interval)
+        return;
+
+    printf("# op=%zu frag=%.6f util=%.6f", run->ops, sf_fragmentation(), sf_utilization());
+    if (run->timing) {
+        uint64_t window_ns = run->total_ns - run->interval_ns;
+        double ops_per_sec = window_ns ? (double)(run->ops - run->interval_ops) * 1e9 / (double)window_ns : 0.0;
+        printf(" ops/sec=%.0f", ops_per_sec);
+    }
+    printf("\n");
+
+    run->interval_ops = run->ops;
+    run->interval_ns = run->total_ns;
+}
+
+/**
+ * Replays a binary trace written by sf_trace_start(). Pointer ids are used
+ * directly as slots (slot 0, NULL, is never filled), and operations that failed
+ * when the trace was recorded are skipped.
+ *
+ * @return 0 on success, -1 if the trace is malformed.
+ */
+static int workload_replay_binary(bench_run* run, FILE* trace, const char* path)
+{
+    sf_trace_record record;
+    size_t record_no = 0;
+    while (fread(&record, sizeof(record), 1, trace) == 1) {
+        record_no++;
+        if (record.id >= MAX_SLOTS || record.old_id >= MAX_SLOTS) {
+            fprintf(stderr, "sfmm_bench: %s: record %zu: pointer id out of range\n", path, record_no);
+            return -1;
+        }
+
+        if (record.op == SF_TRACE_MALLOC) {
+            if (record.id == 0)
+                continue;
+            if (slots[record.id] != NULL)
+                bench_free(run, record.id);
+            bench_malloc(run, record.id, record.size);
+        } else if (record.op == SF_TRACE_REALLOC) {
+            // realloc(NULL, n) and realloc(p, 0) are replayed as such.
+            if (record.id == 0 && record.size != 0)
+                continue;
+            if (record.id != record.old_id && slots[record.id] != NULL)
+                bench_free(run, record.id);
+            bench_realloc_between(run, record.old_id, record.id, record.size);
+        } else if (record.op == SF_TRACE_FREE) {
+            if (slots[record.id] != NULL)
+                bench_free(run, record.id);
+        } else {
+            fprintf(stderr, "sfmm_bench: %s: record %zu: unknown operation %u\n", path, record_no,
+                    (unsigned)record.op);
+            return -1;
+        }
+        report_progress(run);
+    }
+
+    return 0;
+}
+
+/**
+ * Replays a recorded trace. Each line is one operation:
+ *   m <slot> <size>   sf_malloc(size) into slot
+ *   r <slot> <size>   sf_realloc(slot, size)
+ *   f <slot>          sf_free(slot)
+ * Blank lines and lines starting with '#' are ignored. Files that start with
+ * SF_TRACE_MAGIC are binary traces instead (see workload_replay_binary).
+ *
+ * @return 0 on success, -1 if the trace cannot be read or is malformed.
+ */
+static int workload_replay(bench_run* run, const char* path)
+{
+    FILE* trace = fopen(path, "rb");
+    if (trace == NULL) {
+        fprintf(stderr, "sfmm_bench: cannot open trace '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char magic[8];
+    if (fread(magic, 1, sizeof(magic), trace) == sizeof(magic) &&
+        memcmp(magic, SF_TRACE_MAGIC, sizeof(magic)) == 0) {
+        int result = workload_replay_binary(run, trace, path);
+        fclose(trace);
+        return result;
+    }
+    rewind(trace);
+
+    char line[128];
+    size_t line_no = 0;
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        line_no++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        char op;
+        size_t slot, size = 0;
+        int fields = sscanf(line, " %c %zu %zu", &op, &slot, &size);
+        if (fields < 2 || slot >= MAX_SLOTS || (op != 'f' && fields < 3)) {
+            fprintf(stderr, "sfmm_bench: %s:%zu: malformed trace line\n", path, line_no);
+            fclose(trace);
+            return -1;
+        }
+
+        if (op == 'm') {
+            // A trace may reuse a slot whose allocation failed or was not freed.
+            if (slots[slot] != NULL)
+                bench_free(run, slot);
+            bench_malloc(run, slot, size);
+        } else if (op == 'r') {
+            bench_realloc(run, slot, size);
+        } else if (op == 'f') {
+            if (slots[slot] != NULL)
+                bench_free(run, slot);
+        } else {
+            fprintf(stderr, "sfmm_bench: %s:%zu: unknown operation '%c'\n", path, line_no, op);
+            fclose(trace);
+            return -1;
+        }
+        report_progress(run);
+    }
+
+    fclose(trace);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------
+ * Driver
+ * ----------------------------------------------------------------------*/
+
+typedef struct bench_workload {
+    const char* name;
+    void (*run)(bench_run* run, size_t num_ops);
+} bench_workload;
+
+static const bench_workload workloads[] = {
+    { "small-churn",       workload_small_churn },
+    { "producer-consumer", workload_producer_consumer },
+    { "realloc-growth",    workload_realloc_growth },
+    { "random-mix",        workload_random_mix },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static bench_run start_run(const char* name, uint64_t seed, size_t index, int timing)
+{
+    bench_run run;
+    memset(&run, 0, sizeof(run));
+    run.name = name;
+    // Distinct, never-zero stream per workload so adding one does not shift the others.
+    run.rng = (seed * 0x9E3779B97F4A7C15ull) ^ (index + 1) * 0xBF58476D1CE4E5B9ull;
+    if (run.rng == 0)
+        run.rng = 1;
+    run.timing = timing;
+    return run;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n ops] [-w workload] [-t trace] [-i interval]\n"
+                    "       [-p first|best|address] [--record trace] [--no-timing]\n", prog);
+    fprintf(stderr, "workloads:");
+    for (size_t i = 0; i < NUM_WORKLOADS; i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char const* argv[])
+{
+    uint64_t seed = DEFAULT_SEED;
+    size_t num_ops = DEFAULT_OPS;
+    const char* only_workload = NULL;
+    const char* trace_path = NULL;
+    const char* record_path = NULL;
+    size_t interval = 0;
+    int timing = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--no-timing") == 0) {
+            timing = 0;
+        } else if (strcmp(arg, "-s") == 0 && value != NULL) {
+            seed = strtoull(value, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "-n") == 0 && value != NULL) {
+            num_ops = strtoull(value, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "-w") == 0 && value != NULL) {
+            only_workload = value;
+            i++;
+        } else if (strcmp(arg, "-t") == 0 && value != NULL) {
+            trace_path = value;
+            i++;
+        } else if (strcmp(arg, "-i") == 0 && value != NULL) {
+            interval = strtoull(value, NULL, 10);
+            i++;
+        } else if (strcmp(arg, "-p") == 0 && value != NULL) {
+            sf_placement_policy_t policy;
+            if (strcmp(value, "first") == 0) {
+                policy = SF_PLACEMENT_FIRST_FIT;
+            } else if (strcmp(value, "best") == 0) {
+                policy = SF_PLACEMENT_BEST_FIT;
+            } else if (strcmp(value, "address") == 0) {
+                policy = SF_PLACEMENT_ADDRESS_ORDERED;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            if (sf_set_placement_policy(policy) != 0) {
+                fprintf(stderr, "sfmm_bench: placement policy '%s' is not available in this build\n", value);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if (strcmp(arg, "--record") == 0 && value != NULL) {
+            record_path = value;
+            i++;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (record_path != NULL && sf_trace_start(record_path) != 0) {
+        fprintf(stderr, "sfmm_bench: cannot record to '%s' (is the allocator built with -DALLOC_TRACE?)\n",
+                record_path);
+        return EXIT_FAILURE;
+    }
+
+    printf("# sfmm_bench seed=%llu ops=%zu\n", (unsigned long long)seed, num_ops);
+    print_header(timing);
+
+    if (trace_path != NULL) {
+        bench_run run = start_run("replay", seed, NUM_WORKLOADS, timing);
+        run.interval = interval;
+        if (workload_replay(&run, trace_path) != 0)
+            return EXIT_FAILURE;
+        report(&run, sf_fragmentation());
+        release_all_slots();
+        return EXIT_SUCCESS;
+    }
+
+    int matched = 0;
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        if (only_workload != NULL && strcmp(only_workload, workloads[i].name) != 0)
+            continue;
+        matched = 1;
+
+        bench_run run = start_run(workloads[i].name, seed, i, timing);
+        workloads[i].run(&run, num_ops);
+        report(&run, sf_fragmentation());
+        release_all_slots();
+    }
+
+    if (!matched) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("# final frag=%.6f util=%.6f\n", sf_fragmentation(), sf_utilization());
+    if (record_path != NULL && sf_trace_stop() != 0) {
+        fprintf(stderr, "sfmm_bench: failed to write trace '%s'\n", record_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
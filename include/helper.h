@@ -8,6 +8,74 @@
 #include "sfmm.h"
 #include <stddef.h>
 
+//
+// HEADER ENCODING
+//
+// Headers and footers are stored XOR'ed with MAGIC. decode_header() and
+// encode_header() are the only places the allocator applies it. By default
+// MAGIC is sf_magic(), an out-of-line call into sfutil that returns a random
+// value, so every header access pays for a call. Building with
+// -DSTATIC_MAGIC=<value> makes MAGIC that constant instead (0 skips the
+// obfuscation entirely), letting the compiler fold the XOR into the access.
+// The heap hands the constant to sf_set_magic() when it is set up, so
+// sf_magic() and sf_show_heap() still decode the heap correctly.
+//
+
+#ifdef STATIC_MAGIC
+#undef MAGIC
+#define MAGIC ((sf_header)(STATIC_MAGIC))
+#endif
+
+static inline sf_header decode_header(sf_header stored) { return stored ^ MAGIC; }
+static inline sf_header encode_header(sf_header value) { return value ^ MAGIC; }
+
+//
+// TWO-LEVEL SEGREGATED FIT (TLSF) CONFIGURATION
+//
+// Building with -DTLSF replaces the NUM_FREE_LISTS power-of-two classes with
+// a two-level layout. Blocks smaller than TLSF_SMALL_BLOCK_SIZE share first
+// level 0, split into linear classes of 2^TLSF_SMALL_CLASS_SHIFT bytes. Larger
+// blocks use first level floor(log2(size)) - TLSF_FL_SHIFT + 1, and each first
+// level is split linearly into TLSF_SL_COUNT second-level classes.
+//
+
+#ifdef TLSF
+#define TLSF_SL_LOG2           3                              /* log2 of second-level classes per level */
+#define TLSF_SL_COUNT          (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT          (TLSF_SL_LOG2 + 5)             /* first level 1 starts at 2^TLSF_FL_SHIFT */
+#define TLSF_SMALL_BLOCK_SIZE  ((size_t)1 << TLSF_FL_SHIFT)   /* 256 bytes */
+#define TLSF_SMALL_CLASS_SHIFT (TLSF_FL_SHIFT - TLSF_SL_LOG2) /* 32-byte classes below 256 */
+#define TLSF_FL_COUNT          21                             /* covers 28-bit block sizes */
+#define TLSF_NUM_CLASSES       (TLSF_FL_COUNT * TLSF_SL_COUNT)
+
+/**
+ * TLSF free list sentinels and second-level occupancy bitmaps, used in place of
+ * sf_free_list_heads when TLSF is enabled.
+ */
+extern sf_block sf_tlsf_free_list_heads[TLSF_NUM_CLASSES];
+extern uint32_t sf_tlsf_sl_bitmap[TLSF_FL_COUNT];
+#endif
+
+//
+// BOUNDARY-TAG ELISION
+//
+// Building with -DFOOTER_ELISION drops the footer from allocated blocks. The
+// PREV_BLOCK_ALLOCATED header bit then records whether the block just before
+// is allocated (quick-list blocks and the prologue count as allocated), and
+// coalescing only reads a predecessor's footer when that bit is clear. Free
+// blocks keep their footers. An allocated block needs only its 8-byte header,
+// so a 24-byte payload fits in a 32-byte block. In the default build
+// PREV_BLOCK_ALLOCATED is 0 and every block keeps both boundary tags.
+//
+
+#ifdef FOOTER_ELISION
+#define PREV_BLOCK_ALLOCATED     0x4
+#define ALLOCATED_BLOCK_OVERHEAD 8                               /* header only */
+#else
+#define PREV_BLOCK_ALLOCATED     0x0
+#define ALLOCATED_BLOCK_OVERHEAD (sizeof(sf_header) + sizeof(sf_footer))
+#endif
+
 //
 // get_free_list_index_for_size(size_t total_block_size)
 //
@@ -27,6 +95,305 @@
  */
 int get_free_list_index_for_size(size_t total_block_size);
 
+//
+// BRANCH AND PREFETCH HINTS
+//
+// SF_LIKELY/SF_UNLIKELY mark the expected side of a branch, so the checks
+// that end in abort() are laid out off the hot path. SF_PREFETCH starts
+// loading a block's first cache line (its header and free-list links) while
+// the current block is still being examined. -DNO_ALLOC_HINTS compiles all
+// three to plain expressions, for comparing builds with bin/sfmm_bench.
+//
+
+#ifndef NO_ALLOC_HINTS
+#define SF_LIKELY(x)   __builtin_expect(!!(x), 1)
+#define SF_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define SF_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define SF_LIKELY(x)   (x)
+#define SF_UNLIKELY(x) (x)
+#define SF_PREFETCH(p) ((void)(p))
+#endif
+
+//
+// THREAD-SAFE MODE CONFIGURATION
+//
+// Building with -DTHREAD_SAFE guards the shared heap with sf_heap_lock and
+// gives every thread a private cache of quick-list-sized blocks. A thread
+// cache class holds at most THREAD_CACHE_MAX blocks; it is refilled with up
+// to THREAD_CACHE_REFILL blocks at a time and flushed by half when full.
+// LOCK_HEAP()/UNLOCK_HEAP() compile to nothing in single-threaded builds.
+//
+// The first THREAD_CACHE_OWNERS threads also claim a remote-free list. A
+// block handed out by such a thread's cache records the owner in its footer
+// (REMOTE_FREE_OWNER_TAG | owner), and a free from any other thread pushes
+// it onto that list without locking; the owner drains the list on its next
+// cache miss.
+//
+// FOOTER_ELISION is rejected in this mode. Its PREV_BLOCK_ALLOCATED bit lives
+// in the successor's header, which the locked paths would have to update
+// while the thread caching that successor rewrites the header unlocked.
+//
+
+#ifdef THREAD_SAFE
+#ifdef FOOTER_ELISION
+#error "-DFOOTER_ELISION cannot be combined with -DTHREAD_SAFE"
+#endif
+#include <pthread.h>
+
+#define THREAD_CACHE_MAX    (2 * QUICK_LIST_MAX) /* Blocks a thread may cache per class. */
+#define THREAD_CACHE_REFILL QUICK_LIST_MAX       /* Blocks fetched per refill. */
+
+#define REMOTE_FREES
+#define THREAD_CACHE_OWNERS   64          /* Threads that can own a remote-free list. */
+#define REMOTE_FREE_OWNER_TAG 0x80000000u /* Marks an owner in an allocated footer's payload field. */
+
+extern pthread_mutex_t sf_heap_lock;
+
+#define LOCK_HEAP()   pthread_mutex_lock(&sf_heap_lock)
+#define UNLOCK_HEAP() pthread_mutex_unlock(&sf_heap_lock)
+#else
+#define LOCK_HEAP()   ((void)0)
+#define UNLOCK_HEAP() ((void)0)
+#endif
+
+//
+// ALLOCATION STATISTICS
+//
+// Building with -DALLOC_STATS counts allocator events into sf_stats (an
+// sf_stats_t, see sfmm_ext.h), which sf_get_stats() copies out. Without it
+// STAT_ADD()/STAT_INC() expand to nothing and their arguments are never
+// evaluated, so collection costs nothing.
+//
+
+#ifdef ALLOC_STATS
+#include "sfmm_ext.h"
+
+extern sf_stats_t sf_stats;
+
+#define STAT_ADD(field, n) (sf_stats.field += (n))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#endif
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+/**
+ * Maps a block size to its sf_stats_t size class (the power-of-two classes of
+ * sf_free_list_heads, whatever free-list layout the build uses).
+ *
+ * @param block_size The block's total size.
+ * @return A class index in [0, NUM_FREE_LISTS).
+ */
+int get_stats_size_class(size_t block_size);
+
+//
+// ALLOCATION TRACING
+//
+// Building with -DALLOC_TRACE lets sf_trace_start() record every sf_malloc,
+// sf_realloc and sf_free (batches included) as an sf_trace_record. Records go
+// into one of two buffers of SF_TRACE_BUFFER_RECORDS records; a full buffer is
+// handed to a writer thread while the other one fills. sf_realloc brackets its
+// nested sf_malloc/sf_free calls with TRACE_SUSPEND()/TRACE_RESUME() so each
+// realloc is a single record. Without the flag the TRACE_* macros expand to
+// nothing.
+//
+
+#ifdef ALLOC_TRACE
+#define SF_TRACE_BUFFER_RECORDS 4096
+
+extern __thread int sf_trace_depth;
+
+#define TRACE_OP(op, result, old, size) trace_allocation(op, result, old, size)
+#define TRACE_SUSPEND() (sf_trace_depth++)
+#define TRACE_RESUME()  (sf_trace_depth--)
+
+/**
+ * Appends one record to the trace if tracing is on and the calling thread is
+ * not inside a suspended region.
+ *
+ * @param op     SF_TRACE_MALLOC, SF_TRACE_REALLOC or SF_TRACE_FREE.
+ * @param result The pointer returned (malloc/realloc) or being freed.
+ * @param old    The pointer passed to sf_realloc, otherwise NULL.
+ * @param size   The requested size (0 for frees).
+ */
+void trace_allocation(int op, void* result, void* old, size_t size);
+#else
+#define TRACE_OP(op, result, old, size) ((void)0)
+#define TRACE_SUSPEND() ((void)0)
+#define TRACE_RESUME()  ((void)0)
+#endif
+
+//
+// HEAP PROFILING
+//
+// Building with -DALLOC_PROFILE lets sf_profile_set_rate(N) sample about one
+// allocation per N requested bytes. Each thread counts down an exponentially
+// distributed number of bytes; the allocation that crosses zero has its
+// backtrace and size recorded under its address until it is freed. Samples
+// with the same backtrace share one record of live and total counts, which is
+// what sf_profile_dump() writes. sf_realloc brackets its nested calls with
+// PROFILE_SUSPEND()/PROFILE_RESUME() and counts as a free plus an allocation.
+//
+// While the rate is 0, PROFILE_MALLOC costs one load and a branch, and so does
+// PROFILE_FREE once no samples are live. Without the flag all of them expand to
+// nothing.
+//
+
+#ifdef ALLOC_PROFILE
+#define SF_PROFILE_MAX_FRAMES 32
+#define SF_PROFILE_STACKS     1024 /* Distinct backtraces; samples with a new one are dropped after that. */
+#define SF_PROFILE_SAMPLES    4096 /* Live samples; further ones are dropped. */
+#define SF_PROFILE_BUCKETS    4096 /* Hash chains for live samples and for backtraces each. */
+
+extern size_t sf_profile_rate;
+extern size_t sf_profile_live_samples;
+extern __thread int sf_profile_depth;
+
+#define PROFILE_MALLOC(payload, size) \
+    (SF_UNLIKELY(__atomic_load_n(&sf_profile_rate, __ATOMIC_RELAXED) != 0) ? profile_allocation(payload, size) : (void)0)
+#define PROFILE_FREE(payload) \
+    (SF_UNLIKELY(__atomic_load_n(&sf_profile_live_samples, __ATOMIC_RELAXED) != 0) ? profile_free(payload) : (void)0)
+#define PROFILE_SUSPEND() (sf_profile_depth++)
+#define PROFILE_RESUME()  (sf_profile_depth--)
+
+/**
+ * Counts an allocation against the calling thread's sampling interval and
+ * records it if the interval runs out. Does nothing inside a suspended region.
+ *
+ * @param payload The pointer returned to the caller (NULL is ignored).
+ * @param size    The requested size.
+ */
+void profile_allocation(void* payload, size_t size);
+
+/**
+ * Drops the sample recorded for payload, if there is one.
+ */
+void profile_free(void* payload);
+
+/**
+ * Drops every live sample, for sf_reset(). Totals per backtrace are kept.
+ */
+void profile_reset();
+#define PROFILE_RESET() profile_reset()
+#else
+#define PROFILE_MALLOC(payload, size) ((void)0)
+#define PROFILE_FREE(payload) ((void)0)
+#define PROFILE_RESET() ((void)0)
+#define PROFILE_SUSPEND() ((void)0)
+#define PROFILE_RESUME()  ((void)0)
+#endif
+
+//
+// ADAPTIVE QUICK LISTS
+//
+// Building with -DADAPTIVE_QUICK_LISTS replaces the fixed QUICK_LIST_MAX with
+// a per-class capacity that starts at QUICK_LIST_MAX. A class that misses
+// after being flushed for overflow doubles its capacity (up to
+// QUICK_LIST_MAX_CAPACITY). Every QUICK_LIST_SWEEP_INTERVAL quick-list
+// operations, classes holding blocks that saw no hits since the previous
+// sweep are flushed and their capacity halved (down to
+// QUICK_LIST_MIN_CAPACITY). A block is not cached if that would put more
+// than QUICK_LIST_CACHE_LIMIT bytes on the quick lists.
+//
+
+#ifdef ADAPTIVE_QUICK_LISTS
+#define QUICK_LIST_MIN_CAPACITY   2
+#define QUICK_LIST_MAX_CAPACITY   32
+#define QUICK_LIST_SWEEP_INTERVAL 1024
+#define QUICK_LIST_CACHE_LIMIT    8192
+#endif
+
+//
+// QUICK-LIST FLUSHING
+//
+// When a free finds its quick list full, the oldest QUICK_LIST_FLUSH_PERCENT
+// percent of the list (at least one block) is evicted. Evicted blocks are
+// sorted by address and adjacent ones are merged into a single free block
+// before it is coalesced with its neighbours and inserted. The default of
+// 100 empties the whole list, as the quick-list rules in sfmm.h require;
+// -DQUICK_LIST_FLUSH_PERCENT=50 evicts only the oldest half.
+//
+
+#ifndef QUICK_LIST_FLUSH_PERCENT
+#define QUICK_LIST_FLUSH_PERCENT 100
+#endif
+
+//
+// DEFERRED COALESCING
+//
+// Building with -DDEFERRED_COALESCING makes frees (including quick-list
+// flushes) skip coalescing: a freed block goes onto its free list as it is,
+// even next to free neighbours. Runs of adjacent free blocks are then merged
+// in one pass over the heap when a search finds no fitting block (so before
+// the heap grows), once DEFERRED_COALESCING_BYTES have been freed since the
+// last pass, and before sf_trim(). Frees get cheaper, at the cost of searches
+// seeing more, smaller blocks between passes.
+//
+
+#ifdef DEFERRED_COALESCING
+#ifndef DEFERRED_COALESCING_BYTES
+#define DEFERRED_COALESCING_BYTES (4 * PAGE_SZ)
+#endif
+#endif
+
+//
+// LARGE-OBJECT MAPPING
+//
+// Building with -DMMAP_THRESHOLD=N serves every sf_malloc of at least N bytes
+// from its own mmap() region instead of the heap. The region starts with an
+// sf_mapped_region row (list links and mapping length) whose last word is the
+// block header, flagged MMAPPED_BLOCK; the payload follows it. sf_free unmaps
+// the region at once and sf_realloc resizes it with mremap(). Mapped blocks
+// count towards sf_fragmentation() and sf_utilization().
+//
+// Adding -DHUGE_PAGES rounds every mapping of at least HUGE_PAGE_SZ bytes up
+// to whole huge pages, places it on a huge-page boundary and advises it with
+// MADV_HUGEPAGE, so transparent huge pages can back all of it. A growing
+// sf_realloc that cannot extend such a mapping in place, or that takes a
+// smaller mapping past HUGE_PAGE_SZ, moves it onto a new aligned range with
+// mremap(), still without copying. The heap itself is
+// unaffected: sf_mem_grow() hands out pages of one fixed region.
+//
+
+#define MMAPPED_BLOCK 0x8
+
+#ifdef HUGE_PAGES
+#define HUGE_PAGE_SZ ((size_t)2 << 20) /* Transparent huge page size on x86-64. */
+#endif
+
+//
+// SLAB ALLOCATOR
+//
+// Building with -DSLAB_ALLOCATOR serves sf_malloc requests of up to
+// SLAB_MAX_SIZE bytes from slab runs instead of 32-byte blocks. A run is a
+// heap block of SLAB_RUN_SIZE bytes whose payload lies a multiple of
+// SLAB_RUN_SIZE past sf_mem_start(), split into equal slots of one class
+// (SLAB_SLOT_SIZE, 2 * SLAB_SLOT_SIZE, ...). Slots have no header or footer:
+// the run starts with an sf_slab_run row holding a free-slot bitmap and each
+// live slot's requested size, and a slot pointer finds its run by rounding
+// its heap offset down to SLAB_RUN_SIZE. The run's own header carries
+// SLAB_RUN_BLOCK and, as its payload, the total requested by its live slots,
+// so runs count towards sf_fragmentation() and sf_utilization() like any
+// other block.
+//
+
+#define SLAB_RUN_BLOCK   0x8              /* Inside the heap; outside it 0x8 is MMAPPED_BLOCK. */
+#define SLAB_RUN_SIZE    PAGE_SZ
+#define SLAB_SLOT_SIZE   16               /* Slot size of class 0; class k holds (k + 1) times it. */
+#define SLAB_CLASS_COUNT 2
+#define SLAB_MAX_SIZE    (SLAB_SLOT_SIZE * SLAB_CLASS_COUNT)
+
+//
+// ARENA CONFIGURATION
+//
+// Arenas take memory from the main heap in chunks of at least
+// ARENA_CHUNK_SIZE bytes. ARENA_CHUNK_OVERHEAD covers each chunk's link
+// row, prologue and epilogue.
+//
+
+#define ARENA_CHUNK_SIZE     (4 * PAGE_SZ)
+#define ARENA_CHUNK_OVERHEAD (8 + 32 + 8)
+
 //
 // initialize_heap_during_first_call_to_sf_malloc()
 //
@@ -87,6 +454,7 @@ size_t calculate_aligned_block_size(size_t requested_payload_size);
 // Searches the segregated free lists for the first block large
 // enough to satisfy 'required_total_block_size'. Returns NULL if
 // no suitable block is found. May influence future heap extension.
+// Empty size classes are skipped using sf_free_list_bitmap.
 //
 
 /**
@@ -160,19 +528,23 @@ void split_free_block_if_necessary(sf_block *free_block, size_t needed_size);
 sf_block *coalesce_adjacent_free_blocks(sf_block *target_block);
 
 //
-// push_block_onto_quick_list(sf_block *small_block)
+// push_block_onto_quick_list(int quick_list_idx, sf_block *small_block, size_t block_size, size_t payload_size)
 //
 // When a small block (<= certain size threshold) is freed, it can be
-// placed on a quick list for faster re-allocation. This function
-// pushes the newly freed block onto the front of that list.
+// placed on a quick list for faster re-allocation. This function marks
+// the block as cached and pushes it onto the front of that list; the
+// caller has already checked that the list has room.
 //
 
 /**
  * Pushes a recently freed small block onto the corresponding quick list.
  *
+ * @param quick_list_idx The index of the quick list to push onto.
  * @param small_block Pointer to the small block being added to the quick list.
+ * @param block_size The block's size, which the quick list's index implies.
+ * @param payload_size The payload kept in the cached block's header.
  */
-void push_block_onto_quick_list(sf_block *small_block);
+void push_block_onto_quick_list(int quick_list_idx, sf_block *small_block, size_t block_size, size_t payload_size);
 
 //
 // flush_quick_list_entirely(int quick_list_idx)
@@ -189,6 +561,85 @@ void push_block_onto_quick_list(sf_block *small_block);
  */
 void flush_quick_list_entirely(int quick_list_idx);
 
+//
+// pop_block_from_quick_list(int quick_list_idx)
+//
+// Removes and returns the block at the head of a quick list so that
+// sf_malloc can hand it straight back to the caller. Blocks on a given
+// quick list all have the same size, so no splitting is ever required.
+//
+
+/**
+ * Pops the head block off the specified quick list.
+ *
+ * @param quick_list_idx The index of the quick list to pop from.
+ * @return The popped block, or NULL if the quick list is empty.
+ */
+sf_block *pop_block_from_quick_list(int quick_list_idx);
+
+//
+// get_payload_size(const sf_block *block)
+//
+// Decodes a block's header and returns the payload size stored in its
+// upper 32 bits (the size the client asked for when it was allocated).
+//
+
+/**
+ * Returns the payload size recorded in a block's header.
+ *
+ * @param block The block to inspect.
+ * @return The payload size from the upper 32 bits of the decoded header.
+ */
+size_t get_payload_size(const sf_block *block);
+
+//
+// get_free_predecessor_size(const sf_block *block)
+//
+// Looks at the block immediately before 'block' in memory. If it is free,
+// its size is read from its footer; otherwise 0 is returned. Under
+// FOOTER_ELISION the PREV_BLOCK_ALLOCATED bit is tested first, because an
+// allocated predecessor has no footer to read.
+//
+
+/**
+ * Returns the size of the free block just before a block.
+ *
+ * @param block The block whose predecessor is examined.
+ * @return The predecessor's size if it is free, 0 if it is allocated.
+ */
+size_t get_free_predecessor_size(const sf_block *block);
+
+//
+// set_prev_allocated_bit(sf_block *block, int prev_allocated)
+//
+// Updates PREV_BLOCK_ALLOCATED in 'block' after its predecessor changed
+// between allocated and free, rewriting the footer too if 'block' is free.
+// Compiles to nothing unless FOOTER_ELISION is defined.
+//
+
+/**
+ * Sets or clears the PREV_BLOCK_ALLOCATED bit of a block.
+ *
+ * @param block The block that follows the one whose state changed.
+ * @param prev_allocated Nonzero if the predecessor is now allocated.
+ */
+void set_prev_allocated_bit(sf_block *block, int prev_allocated);
+
+//
+// write_allocated_footer(sf_block *block, size_t block_size)
+//
+// Copies an allocated block's encoded header into its footer. Under
+// FOOTER_ELISION allocated blocks have no footer and nothing is written.
+//
+
+/**
+ * Writes the footer of an allocated block, unless footers are elided.
+ *
+ * @param block The allocated block.
+ * @param block_size The block's total size.
+ */
+void write_allocated_footer(sf_block *block, size_t block_size);
+
 //
 // extend_heap_by_one_page()
 //
@@ -205,6 +656,24 @@ void flush_quick_list_entirely(int quick_list_idx);
  */
 void *extend_heap_by_one_page();
 
+//
+// extend_heap_by_pages(size_t num_pages)
+//
+// Grows the heap by up to 'num_pages' pages and turns all of them into a
+// single free block, merged with a free block at the old end of the heap.
+// The epilogue is rewritten and the free lists are updated exactly once,
+// however many pages were added. If sf_mem_grow() runs out part way, the
+// pages obtained so far are still kept.
+//
+
+/**
+ * Extends the heap by up to num_pages pages with one coalesce and one insert.
+ *
+ * @param num_pages The number of pages to request from sf_mem_grow().
+ * @return The merged free block at the end of the heap, or NULL if no page could be added (sf_errno set to ENOMEM).
+ */
+void *extend_heap_by_pages(size_t num_pages);
+
 //
 // mark_block_as_allocated(sf_block *allocated_block, size_t final_size, size_t requested_payload_size)
 //
@@ -239,6 +708,15 @@ void mark_block_as_allocated(sf_block *allocated_block, size_t final_size, size_
  */
 static void flush_quick_list(int ql_index);
 
+/**
+ * Moves the `count` oldest blocks of a quick list to the free lists, merging
+ * address-adjacent ones before coalescing and inserting them.
+ *
+ * @param ql_index The index of the quick list.
+ * @param count    How many blocks to evict (clamped to the list's length).
+ */
+static void evict_from_quick_list(int ql_index, int count);
+
 //
 // GLOBAL TRACKING VARIABLES
 //
@@ -255,4 +733,38 @@ static void flush_quick_list(int ql_index);
 extern size_t sf_current_payload; // Tracks current total allocated payload
 extern size_t sf_peak_payload;    // Tracks the peak (max) allocated payload
 
+/**
+ * QUICK LIST FAST-PATH COUNTERS.
+ *
+ * Count quick-list-sized sf_malloc requests that were served from a quick list
+ * (hits) versus those that fell through to the segregated free lists (misses).
+ */
+extern size_t sf_quick_list_hits;   // Requests served by the quick-list fast path
+extern size_t sf_quick_list_misses; // Quick-list-sized requests that fell through
+
+/**
+ * REALLOC COUNTERS.
+ *
+ * Counts growing sf_realloc calls that expanded the block in place instead of
+ * falling back to malloc + memcpy + free.
+ */
+extern size_t sf_realloc_in_place; // Growing reallocs resolved without copying
+
+/**
+ * FRAGMENTATION TOTALS.
+ *
+ * Payload and block bytes of every block currently marked allocated, including
+ * blocks cached on quick lists. sf_fragmentation() returns their ratio.
+ */
+extern size_t sf_allocated_payload;    // Sum of allocated blocks' payload fields
+extern size_t sf_allocated_block_size; // Sum of allocated blocks' sizes
+
+/**
+ * FREE LIST OCCUPANCY BITMAP.
+ *
+ * Bit i is set iff sf_free_list_heads[i] currently holds at least one block.
+ * Under TLSF, bit i is set iff first level i has a non-empty second-level class.
+ */
+extern uint32_t sf_free_list_bitmap;
+
 #endif // HELPER_H
@@ -0,0 +1,300 @@
+/**
+ * Extensions to the sfmm allocator API.
+ *
+ * sfmm.h must stay untouched, so every public entry point that goes beyond
+ * sf_malloc / sf_realloc / sf_free / sf_fragmentation / sf_utilization is
+ * declared here instead.
+ */
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+
+#include "sfmm.h"
+
+/*
+ * Returns every block cached by the calling thread back to the shared heap, including
+ * blocks other threads have freed back to it, and folds the thread's quick-list and
+ * payload counters into the global ones. Threads do this automatically when they
+ * exit; calling it first makes the global counters exact.
+ *
+ * Only has an effect when the allocator is built with -DTHREAD_SAFE.
+ */
+void sf_thread_cache_flush();
+
+/*
+ * Recomputes sf_fragmentation() with a full walk of the main heap. sf_fragmentation()
+ * itself reads running totals in constant time; this slower version is kept as a
+ * consistency check and must return the same value.
+ */
+double sf_fragmentation_walk();
+
+/*
+ * Allocation statistics, filled in by sf_get_stats(). Size classes follow the
+ * power-of-two classes of sf_free_list_heads: class 0 holds 32-byte blocks and
+ * class k holds blocks of (32 * 2^(k-1), 32 * 2^k] bytes, with the last class
+ * taking everything larger. Counts are by block size, not requested size.
+ */
+#define SF_STATS_NUM_CLASSES NUM_FREE_LISTS
+
+typedef struct sf_stats {
+    size_t malloc_count[SF_STATS_NUM_CLASSES]; // Blocks handed out (sf_malloc, arenas, batches)
+    size_t free_count[SF_STATS_NUM_CLASSES];   // Blocks released (sf_free, arenas, batches)
+    size_t quick_list_hits;                    // Requests served from a quick list
+    size_t quick_list_misses;                  // Quick-list-sized requests that fell through
+    size_t quick_list_flushes;                 // Times a full quick list was flushed
+    size_t splits;                             // Free blocks split to serve a request
+    size_t coalesces;                          // Pairs of adjacent free blocks merged
+    size_t heap_grow_calls;                    // Heap extensions (each may add several pages)
+    size_t heap_pages_grown;                   // Pages obtained from sf_mem_grow()
+    size_t realloc_in_place;                   // Growing reallocs that did not move
+    size_t realloc_moved;                      // Reallocs that fell back to malloc + copy + free
+    size_t realloc_tails_cached;               // Shrink tails put straight on a quick list
+    size_t free_bytes[SF_STATS_NUM_CLASSES];   // Bytes currently on the main heap's free lists
+    size_t current_payload;                    // As tracked for sf_utilization()
+    size_t peak_payload;
+} sf_stats_t;
+
+/*
+ * Copies the allocator's statistics into *stats. Collection only happens when the
+ * allocator is built with -DALLOC_STATS; otherwise it costs nothing and *stats is zeroed.
+ *
+ * @return 0 on success, or -1 if stats is NULL or the build has no statistics.
+ */
+int sf_get_stats(sf_stats_t *stats);
+
+/*
+ * Allocates a zero-filled array of count elements of size bytes each. Memory the
+ * allocator knows to be zero already (fresh heap pages, trimmed pages, new mappings)
+ * is not cleared again.
+ *
+ * @return NULL if count * size is 0; otherwise the payload, or NULL with sf_errno
+ * set to ENOMEM (including when count * size overflows).
+ */
+void *sf_calloc(size_t count, size_t size);
+
+/*
+ * Allocates size bytes whose payload address is a multiple of alignment, which must
+ * be a power of two. The leading slack needed to reach an aligned address goes back
+ * to the free lists. The block is freed with sf_free and resized with sf_realloc;
+ * sf_realloc does not preserve the alignment if the block moves.
+ * sf_aligned_alloc() is the same call under its C11 name.
+ *
+ * @return NULL if size is 0; otherwise the payload, or NULL with sf_errno set to
+ * EINVAL (alignment not a power of two) or ENOMEM.
+ */
+void *sf_memalign(size_t alignment, size_t size);
+void *sf_aligned_alloc(size_t alignment, size_t size);
+
+/*
+ * Returns free heap memory to the operating system. The heap itself cannot shrink,
+ * so free pages are decommitted with madvise(MADV_DONTNEED) instead: they stay part
+ * of the heap and are faulted back in, zero-filled, when they are used again.
+ *
+ * sf_trim() decommits the free block at the end of the heap except for its first
+ * keep_bytes, plus every whole page inside the other free blocks, and returns the
+ * number of bytes decommitted. After sf_set_trim_threshold(n), any free that leaves
+ * at least n committed free bytes at the end of the heap trims it automatically;
+ * n = 0 (the default) turns that off.
+ */
+size_t sf_trim(size_t keep_bytes);
+void sf_set_trim_threshold(size_t threshold);
+
+/*
+ * Discards every block at once: the main heap keeps its pages but goes back to a
+ * prologue, one free block and the epilogue, with empty free lists, quick lists and
+ * thread caches, and sf_current_payload drops to 0. Mapped blocks are unmapped, and
+ * arenas, slab runs and profiler samples are gone along with the blocks holding them.
+ * Every pointer the allocator has handed out becomes invalid.
+ *
+ * The cost does not depend on the number of blocks (only on the number of mappings).
+ * No other thread may be using the allocator during the call. Lifetime counters (the
+ * peak payload, quick-list hits/misses, sf_get_stats() events), the placement policy
+ * and the trim threshold are kept; a running trace does not record the reset.
+ */
+void sf_reset();
+
+/*
+ * Free-block placement policies, i.e. which fitting free block an allocation takes:
+ *
+ *   SF_PLACEMENT_FIRST_FIT       the first fitting block of the request's class, most
+ *                                recently freed first (the default)
+ *   SF_PLACEMENT_BEST_FIT        the smallest fitting block; classes of blocks over
+ *                                1024 bytes are indexed by size, so their lists are
+ *                                not walked
+ *   SF_PLACEMENT_ADDRESS_ORDERED the lowest-addressed fitting block of the request's
+ *                                class; frees insert in address order
+ *
+ * Whichever block is chosen, a larger class is only searched when nothing in the
+ * request's own class fits. The policy applies to the main heap and every arena,
+ * and has to be chosen before the first allocation of any kind.
+ *
+ * @return 0 on success, or -1 with sf_errno set to EINVAL if the policy is unknown,
+ * the heap is already in use, or the build uses -DTLSF (which only does first-fit).
+ */
+typedef enum sf_placement_policy {
+    SF_PLACEMENT_FIRST_FIT,
+    SF_PLACEMENT_BEST_FIT,
+    SF_PLACEMENT_ADDRESS_ORDERED
+} sf_placement_policy_t;
+
+int sf_set_placement_policy(sf_placement_policy_t policy);
+
+/*
+ * Allocation tracing. In builds with -DALLOC_TRACE, sf_trace_start() begins
+ * recording every sf_malloc, sf_realloc and sf_free (including the batch calls)
+ * to a file, and sf_trace_stop() writes out what is still buffered and closes
+ * it. Records are buffered in memory and written by a background thread, and
+ * the trace is stopped automatically at exit.
+ *
+ * A trace file is SF_TRACE_MAGIC (8 bytes, no terminator) followed by
+ * sf_trace_record structs in the order the operations happened. Pointers are
+ * identified by their offset into the heap in 16-byte units, which is unique
+ * among live blocks; id 0 stands for NULL. bin/sfmm_bench -t replays a trace.
+ *
+ * Both functions return 0 on success and -1 on failure, and always fail in
+ * builds without -DALLOC_TRACE.
+ */
+#define SF_TRACE_MAGIC "SFTRACE1"
+
+#define SF_TRACE_MALLOC  1
+#define SF_TRACE_REALLOC 2
+#define SF_TRACE_FREE    3
+
+typedef struct sf_trace_record {
+    uint64_t timestamp_ns; // Nanoseconds since sf_trace_start()
+    uint32_t id;           // Pointer returned (malloc/realloc) or freed
+    uint32_t old_id;       // Pointer passed to sf_realloc, otherwise 0
+    uint32_t size;         // Requested size, 0 for frees
+    uint32_t op;           // SF_TRACE_MALLOC, SF_TRACE_REALLOC or SF_TRACE_FREE
+} sf_trace_record;
+
+int sf_trace_start(const char *path);
+int sf_trace_stop();
+
+/*
+ * Sampling heap profiler. In builds with -DALLOC_PROFILE, sf_profile_set_rate(N)
+ * records the backtrace of about one allocation per N requested bytes (sampled
+ * with exponentially distributed gaps, so any allocation may be picked), and a
+ * sample is dropped again when its block is freed. A rate of 0, the default,
+ * stops sampling; samples already taken stay until their blocks are freed.
+ *
+ * sf_profile_dump() writes the samples to `path` as a legacy pprof heap profile:
+ * a "heap profile: ... @ heap_v2/<rate>" line, one line of in-use and total
+ * sampled objects and bytes per backtrace, and the process's memory map after
+ * "MAPPED_LIBRARIES:". `pprof <program> <path>` reads it and scales the samples
+ * up by the rate. Backtraces start inside the allocator.
+ *
+ * Both functions return 0 on success and -1 on failure, and always fail in
+ * builds without -DALLOC_PROFILE.
+ */
+int sf_profile_set_rate(size_t bytes);
+int sf_profile_dump(const char *path);
+
+/*
+ * Heap introspection. sf_heap_walk() calls fn once per block: first every block of
+ * the main heap in address order (an arena chunk shows up as one allocated block),
+ * then every mapped block. A nonzero return from fn stops the walk. The heap lock is
+ * held throughout, so fn must not call into the allocator.
+ *
+ * payload is the requested size of an allocated or mapped block, and the total
+ * requested by the live slots of a slab run; it is 0 for free and cached blocks.
+ * Cached blocks are freed blocks held by a quick list or a thread cache.
+ *
+ * @return 0 once every block has been visited, the first nonzero value returned by
+ * fn, or -1 with sf_errno set to EINVAL if fn is NULL.
+ */
+typedef enum sf_block_state {
+    SF_BLOCK_FREE,
+    SF_BLOCK_ALLOCATED,
+    SF_BLOCK_CACHED,
+    SF_BLOCK_SLAB_RUN,   // -DSLAB_ALLOCATOR only
+    SF_BLOCK_MAPPED      // -DMMAP_THRESHOLD only
+} sf_block_state_t;
+
+typedef struct sf_block_info {
+    void *address;          // Start of the block (its header, or the mapping)
+    size_t size;            // Bytes, header and footer included
+    size_t payload;         // Requested bytes in use
+    sf_block_state_t state;
+} sf_block_info_t;
+
+typedef int (*sf_heap_walk_fn)(const sf_block_info_t *block, void *ctx);
+
+int sf_heap_walk(sf_heap_walk_fn fn, void *ctx);
+
+/*
+ * Writes the same walk to `path` as JSON: an object with "heap_start", "heap_end"
+ * and a "blocks" array of {"address", "size", "state", "payload"} objects, one per
+ * line. Addresses are hex strings; state is "free", "allocated", "cached",
+ * "slab_run" or "mapped". The heap is only locked while the blocks are copied; the
+ * file is written afterwards.
+ *
+ * @return 0 on success, or -1 if the file could not be written (or, with sf_errno
+ * set to ENOMEM, if there was no memory for the copy).
+ */
+int sf_heap_snapshot(const char *path);
+
+/*
+ * Arenas: independent heaps with their own free lists, quick lists, prologue/epilogue
+ * and statistics. Arena memory is taken from the main heap in chunks of at least
+ * ARENA_CHUNK_SIZE bytes. Blocks from an arena must be released with sf_arena_free
+ * (never sf_free), or all at once with sf_arena_destroy.
+ */
+typedef struct sf_arena sf_arena_t;
+
+/*
+ * Creates a new, empty arena.
+ *
+ * @return The arena, or NULL with sf_errno set to ENOMEM.
+ */
+sf_arena_t *sf_arena_create();
+
+/*
+ * Allocates from the given arena, with the same semantics as sf_malloc.
+ *
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes requested.
+ *
+ * @return NULL if size is 0; otherwise a payload pointer, or NULL with sf_errno set
+ * to ENOMEM (or EINVAL if arena is NULL).
+ */
+void *sf_arena_malloc(sf_arena_t *arena, size_t size);
+
+/*
+ * Frees a block previously returned by sf_arena_malloc(arena, ...).
+ * Calls abort() if ptr is not an allocated block of this arena.
+ */
+void sf_arena_free(sf_arena_t *arena, void *ptr);
+
+/*
+ * Destroys an arena, releasing all of its blocks in one call.
+ */
+void sf_arena_destroy(sf_arena_t *arena);
+
+/*
+ * Per-arena equivalents of sf_fragmentation() and sf_utilization().
+ */
+double sf_arena_fragmentation(sf_arena_t *arena);
+double sf_arena_utilization(sf_arena_t *arena);
+
+/*
+ * Allocates n blocks of `size` bytes each in one call, storing their payload
+ * pointers in out[0..n-1]. The blocks are carved contiguously from as few free
+ * regions as possible.
+ *
+ * @param size The number of bytes requested for each block.
+ * @param n The number of blocks to allocate.
+ * @param out Array of at least n entries that receives the pointers.
+ *
+ * @return The number of blocks allocated. If fewer than n, sf_errno is set to ENOMEM.
+ */
+size_t sf_malloc_batch(size_t size, size_t n, void *out[]);
+
+/*
+ * Frees n blocks in one call. Blocks that are adjacent in memory are merged and
+ * coalesced together rather than one at a time. ptrs[] is reordered by address;
+ * NULL entries are ignored. Calls abort() if any pointer is invalid, including a
+ * pointer that appears twice.
+ */
+void sf_free_batch(void *ptrs[], size_t n);
+
+#endif
@@ -13,12 +13,26 @@
  * ==============================================================================
  */
 
+#define _GNU_SOURCE  // For madvise, PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP and clock_gettime
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#ifdef ALLOC_TRACE
+#include <pthread.h>
+#include <time.h>
+#endif
+#ifdef ALLOC_PROFILE
+#include <execinfo.h>
+#include <math.h>
+#include <pthread.h>
+#endif
 #include "debug.h"
 #include "sfmm.h"
 #include "helper.h"
+#include "sfmm_ext.h"
 
 #include <asm-generic/errno-base.h>
 #include <stddef.h>  // For size_t
@@ -36,6 +50,395 @@
 size_t sf_current_payload = 0;
 size_t sf_peak_payload = 0;
 
+/**
+ * ============================================================================
+ * Quick List Fast-Path Counters
+ * ----------------------------------------------------------------------------
+ *  sf_quick_list_hits   : Number of quick-list-sized sf_malloc requests that
+ *                         were served directly from a quick list.
+ *  sf_quick_list_misses : Number of quick-list-sized sf_malloc requests that
+ *                         found their quick list empty and fell through to
+ *                         the segregated free lists.
+ * ============================================================================
+ */
+size_t sf_quick_list_hits = 0;
+size_t sf_quick_list_misses = 0;
+
+/**
+ * ============================================================================
+ * Realloc Counters
+ * ----------------------------------------------------------------------------
+ *  sf_realloc_in_place : Number of growing sf_realloc calls that were resolved
+ *                        within the block's own splinter, by absorbing the
+ *                        next free or quick-list block, and/or with new heap
+ *                        pages, without a malloc + memcpy + free.
+ * ============================================================================
+ */
+size_t sf_realloc_in_place = 0;
+
+/**
+ * ============================================================================
+ * Fragmentation Totals
+ * ----------------------------------------------------------------------------
+ *  sf_allocated_payload    : Sum of the payload fields of every block marked
+ *                            allocated (quick-list blocks included).
+ *  sf_allocated_block_size : Sum of the sizes of those same blocks.
+ *  Kept up to date wherever a block becomes allocated, is freed, or is
+ *  resized, so that sf_fragmentation() is a constant-time ratio.
+ * ============================================================================
+ */
+size_t sf_allocated_payload = 0;
+size_t sf_allocated_block_size = 0;
+
+/**
+ * ============================================================================
+ * Heap Trimming
+ * ----------------------------------------------------------------------------
+ *  sf_trim_threshold   : Committed free bytes at the end of the heap that make
+ *                        a free trim the tail automatically; 0 turns it off.
+ *  sf_tail_decommitted : Start of the decommitted pages at the end of the heap
+ *                        (up to the page holding the tail block's footer), or
+ *                        NULL if none are known to be decommitted.
+ * ============================================================================
+ */
+static size_t sf_trim_threshold = 0;
+static char* sf_tail_decommitted = NULL;
+
+#ifdef SLAB_ALLOCATOR
+/**
+ * ============================================================================
+ * Slab Runs (SLAB_ALLOCATOR builds only)
+ * ----------------------------------------------------------------------------
+ *  sf_slab_run   : Row at the start of each run's payload, followed by its
+ *                  slots. payload_size[] records each live slot's request.
+ *  sf_slab_runs  : Per class, the runs that have at least one free slot.
+ *  sf_slab_generation : Counts sf_reset() calls. It is mixed into every run's
+ *                  signature, so a run left in heap memory by a reset is
+ *                  never mistaken for a live one.
+ * ============================================================================
+ */
+#define SLAB_BITMAP_WORDS (SLAB_RUN_SIZE / SLAB_SLOT_SIZE / 64)
+
+typedef struct sf_slab_run {
+    sf_header signature;               // get_slab_signature(run), encoded like a header.
+    struct sf_slab_run* next;          // Neighbours on the class's list of runs with free slots.
+    struct sf_slab_run* prev;
+    uint16_t slot_size;
+    uint16_t slot_count;
+    uint16_t free_count;
+    uint16_t first_slot;               // Offset of slot 0 from the start of the run.
+    uint64_t free_slots[SLAB_BITMAP_WORDS]; // Bit i is set iff slot i is free.
+    uint8_t payload_size[];            // Requested size of each live slot.
+} sf_slab_run;
+
+static sf_slab_run* sf_slab_runs[SLAB_CLASS_COUNT];
+static uint64_t sf_slab_generation = 0;
+#endif
+
+/**
+ * ============================================================================
+ * Known-Zero Memory
+ * ----------------------------------------------------------------------------
+ *  sf_tail_zeroed       : Start of the zero-filled bytes at the end of the tail
+ *                         free block (up to its footer), or NULL if none are
+ *                         known. Pages fresh from sf_mem_grow() or decommitted
+ *                         by trimming read as zero; allocations move it past
+ *                         whatever they hand out.
+ *  sf_reused_zero_start : Where note_heap_reuse() last found the zero-filled
+ *                         bytes began, so sf_calloc knows what it can skip.
+ * ============================================================================
+ */
+static char* sf_tail_zeroed = NULL;
+static char* sf_reused_zero_start = NULL;
+
+#ifdef MMAP_THRESHOLD
+/**
+ * ============================================================================
+ * Large-Object Mapping (MMAP_THRESHOLD builds only)
+ * ----------------------------------------------------------------------------
+ *  sf_mapped_regions    : Doubly linked list of the live mmap()ed blocks.
+ *  sf_mapped_bytes      : Total length of those mappings.
+ *  sf_mapped_peak_bytes : The maximum value of sf_mapped_bytes, counted as
+ *                         part of the heap by sf_utilization().
+ * ============================================================================
+ */
+typedef struct sf_mapped_region {
+    struct sf_mapped_region* next;
+    struct sf_mapped_region* prev;
+    size_t length;     // Bytes mapped, a multiple of PAGE_SZ.
+    sf_header header;  // Block header, directly before the payload.
+} sf_mapped_region;
+
+static sf_mapped_region* sf_mapped_regions = NULL;
+static size_t sf_mapped_bytes = 0;
+static size_t sf_mapped_peak_bytes = 0;
+#endif
+
+#ifdef ALLOC_STATS
+/**
+ * ============================================================================
+ * Allocation Statistics (ALLOC_STATS builds only)
+ * ----------------------------------------------------------------------------
+ *  sf_stats : Event counters behind sf_get_stats(). Quick-list hits/misses,
+ *             in-place reallocs, payload and free bytes are filled in from
+ *             the allocator's existing state when the stats are read.
+ * ============================================================================
+ */
+sf_stats_t sf_stats;
+#endif
+
+/**
+ * ============================================================================
+ * Free List Occupancy Bitmap
+ * ----------------------------------------------------------------------------
+ *  sf_free_list_bitmap : Bit i is set iff sf_free_list_heads[i] is non-empty.
+ *                        Maintained by insert_block_into_free_list and
+ *                        remove_block_from_free_list so that searches can
+ *                        skip empty size classes with a single find-first-set.
+ * ============================================================================
+ */
+uint32_t sf_free_list_bitmap = 0;
+
+/**
+ * ============================================================================
+ * Two-Level Segregated Fit (optional, -DTLSF)
+ * ----------------------------------------------------------------------------
+ *  When TLSF is defined, the power-of-two classes of sf_free_list_heads are
+ *  replaced by TLSF_NUM_CLASSES finer classes: a power-of-two first level,
+ *  each split linearly into TLSF_SL_COUNT second-level classes. The helper
+ *  API is unchanged; a class index is simply fl * TLSF_SL_COUNT + sl.
+ *
+ *  sf_free_list_bitmap then holds one bit per first level, and
+ *  sf_tlsf_sl_bitmap[fl] one bit per second-level class of that level.
+ * ============================================================================
+ */
+#ifdef TLSF
+sf_block sf_tlsf_free_list_heads[TLSF_NUM_CLASSES];
+uint32_t sf_tlsf_sl_bitmap[TLSF_FL_COUNT];
+
+#define FREE_LIST_COUNT TLSF_NUM_CLASSES
+#define MAIN_FREE_LIST_HEADS sf_tlsf_free_list_heads
+#else
+#define FREE_LIST_COUNT NUM_FREE_LISTS
+#define MAIN_FREE_LIST_HEADS sf_free_list_heads
+#endif
+
+/**
+ * ============================================================================
+ * Placement Policy
+ * ----------------------------------------------------------------------------
+ *  sf_placement_policy : Which fitting free block a search returns; set with
+ *                        sf_set_placement_policy() before the heap exists and
+ *                        shared by the main heap and every arena.
+ *  sf_fit_node         : Under SF_PLACEMENT_BEST_FIT, free blocks of class
+ *                        FIT_TREE_MIN_CLASS and up are also kept in one treap
+ *                        per class, ordered by (size, address), so a best-fit
+ *                        search is a descent instead of a list walk. The node
+ *                        follows the block's list links; a block's treap
+ *                        priority is a hash of its address.
+ *  sf_fit_tree_roots   : The main heap's treaps (arenas have their own).
+ * ============================================================================
+ */
+static sf_placement_policy_t sf_placement_policy = SF_PLACEMENT_FIRST_FIT;
+
+typedef struct sf_fit_node {
+    struct sf_block* left;   // Blocks ordered before this one.
+    struct sf_block* right;  // Blocks ordered after this one.
+    struct sf_block* parent; // NULL at the root.
+} sf_fit_node;
+
+#define FIT_TREE_MIN_CLASS 6 /* Blocks of more than 1024 bytes. */
+#define FIT_NODE(block)    ((sf_fit_node*)((char*)(block) + sizeof(sf_block)))
+
+// Bytes at the start of a free block that the allocator may write: the header,
+// the list links and the fit node. Whatever follows is never touched while free.
+#define FREE_BLOCK_METADATA_SIZE (sizeof(sf_block) + sizeof(sf_fit_node))
+
+static sf_block* sf_fit_tree_roots[FREE_LIST_COUNT];
+
+#ifdef DEFERRED_COALESCING
+/**
+ * ============================================================================
+ * Deferred Coalescing (optional, -DDEFERRED_COALESCING)
+ * ----------------------------------------------------------------------------
+ *  sf_deferred_free_bytes : Bytes freed without coalescing since the last
+ *                           pass of coalesce_deferred_frees() over the
+ *                           active heap (swapped per arena).
+ * ============================================================================
+ */
+static size_t sf_deferred_free_bytes = 0;
+#endif
+
+/**
+ * ============================================================================
+ * Active Heap
+ * ----------------------------------------------------------------------------
+ *  All helpers operate on the "active" heap. Normally that is the main heap
+ *  (sf_free_list_heads / sf_quick_lists on top of sf_mem_start..sf_mem_end).
+ *  While an sf_arena_t call runs, sf_active_arena points at that arena, the
+ *  array pointers below point into it, and its scalar state (bitmap and
+ *  counters) has been swapped into the globals. See enter_arena/leave_arena.
+ * ============================================================================
+ */
+typedef __typeof__(sf_quick_lists[0]) sf_quick_list;
+
+#ifdef ADAPTIVE_QUICK_LISTS
+typedef struct sf_quick_list_tuning {
+    int capacity[NUM_QUICK_LISTS]; // Blocks each quick list may currently hold.
+    int flushed[NUM_QUICK_LISTS];  // Flushed for overflow since the class last missed.
+    int reused[NUM_QUICK_LISTS];   // Had a hit since the last idle sweep.
+    size_t cached_bytes;           // Total size of the blocks on all quick lists.
+    size_t ops_since_sweep;        // Quick-list hits, misses and frees since the last sweep.
+} sf_quick_list_tuning;
+#endif
+
+typedef struct sf_arena {
+    sf_block free_list_heads[FREE_LIST_COUNT];
+    sf_block* fit_tree_roots[FREE_LIST_COUNT];
+    sf_quick_list quick_lists[NUM_QUICK_LISTS];
+#ifdef ADAPTIVE_QUICK_LISTS
+    sf_quick_list_tuning quick_list_tuning;
+#endif
+#ifdef TLSF
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+#endif
+#ifdef DEFERRED_COALESCING
+    size_t deferred_free_bytes; // Swapped with sf_deferred_free_bytes while active.
+#endif
+    uint32_t free_list_bitmap;  // Swapped with sf_free_list_bitmap while active.
+    size_t current_payload;     // Swapped with sf_current_payload while active.
+    size_t peak_payload;        // Swapped with sf_peak_payload while active.
+    size_t quick_list_hits;     // Swapped with sf_quick_list_hits while active.
+    size_t quick_list_misses;   // Swapped with sf_quick_list_misses while active.
+    size_t allocated_payload;   // Swapped with sf_allocated_payload while active.
+    size_t allocated_block_size; // Swapped with sf_allocated_block_size while active.
+    size_t heap_size;           // Total bytes of all chunks owned by the arena.
+    char* chunks;               // First chunk; each chunk's first row links the next.
+} sf_arena;
+
+static sf_arena* sf_active_arena = NULL; // NULL while the main heap is active.
+static sf_arena sf_main_heap_state;      // Main heap scalars while an arena is active.
+
+static sf_block* sf_active_free_list_heads = MAIN_FREE_LIST_HEADS;
+static sf_block** sf_active_fit_tree_roots = sf_fit_tree_roots;
+static sf_quick_list* sf_active_quick_lists = sf_quick_lists;
+#ifdef ADAPTIVE_QUICK_LISTS
+static sf_quick_list_tuning sf_main_quick_list_tuning;
+static sf_quick_list_tuning* sf_active_quick_list_tuning = &sf_main_quick_list_tuning;
+#define QUICK_LIST_TUNING sf_active_quick_list_tuning
+#endif
+#ifdef TLSF
+static uint32_t* sf_active_sl_bitmap = sf_tlsf_sl_bitmap;
+#define FREE_LIST_SL_BITMAP sf_active_sl_bitmap
+#endif
+
+#define FREE_LIST_HEADS sf_active_free_list_heads
+#define FIT_TREE_ROOTS  sf_active_fit_tree_roots
+#define QUICK_LISTS     sf_active_quick_lists
+
+/**
+ * ============================================================================
+ * Thread-Safe Mode (optional, -DTHREAD_SAFE)
+ * ----------------------------------------------------------------------------
+ *  sf_heap_lock    : Recursive mutex guarding the shared heap (free lists,
+ *                    quick lists, heap growth and the global counters).
+ *                    Recursive so that sf_realloc can call sf_malloc/sf_free.
+ *  sf_local_cache  : Each thread's private cache of quick-list-sized blocks,
+ *                    used without the lock. It is refilled from (and flushed
+ *                    to) the shared heap in batches, and its counters are
+ *                    folded into the globals whenever the lock is taken.
+ *  sf_remote_frees : One lock-free list per owning thread of blocks that other
+ *                    threads freed (REMOTE_FREES builds). Pushes are a CAS on
+ *                    the head; the owner takes the whole list with one
+ *                    exchange, so no pop ever races another.
+ *  sf_heap_generation : Counts sf_reset() calls. A cache from an older
+ *                    generation is emptied, without touching the heap, the
+ *                    next time its thread uses it.
+ *
+ *  Note: sf_errno is declared by sfmm.h and stays a single shared variable.
+ * ============================================================================
+ */
+#ifdef THREAD_SAFE
+pthread_mutex_t sf_heap_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+typedef struct sf_thread_cache {
+    struct {
+        int length;             // Number of blocks currently cached.
+        struct sf_block *first; // LIFO list of cached blocks.
+    } lists[NUM_QUICK_LISTS];
+    size_t quick_list_hits;     // Counters not yet folded into the globals.
+    size_t quick_list_misses;
+    ptrdiff_t payload_delta;    // Payload allocated minus freed since the last fold.
+    ptrdiff_t allocated_payload_delta; // Change to sf_allocated_payload since the last fold.
+#ifdef ALLOC_STATS
+    size_t malloc_count[SF_STATS_NUM_CLASSES]; // Fast-path mallocs since the last fold.
+    size_t free_count[SF_STATS_NUM_CLASSES];   // Fast-path frees since the last fold.
+#endif
+    int registered;             // Whether the exit destructor has been armed.
+    unsigned owner_tag;         // 1 + index of the claimed sf_remote_frees slot, or 0.
+    size_t heap_generation;     // Value of sf_heap_generation the cached blocks belong to.
+} sf_thread_cache;
+
+#ifdef REMOTE_FREES
+typedef struct sf_remote_free_list {
+    struct sf_block *head;      // Blocks freed by other threads, linked through links.next.
+    int claimed;                // Whether a live thread owns this list.
+} sf_remote_free_list;
+
+static sf_remote_free_list sf_remote_frees[THREAD_CACHE_OWNERS];
+#endif
+
+static __thread sf_thread_cache sf_local_cache;
+static size_t sf_heap_generation = 0;  // Bumped by sf_reset(), which strands every cached block.
+static pthread_key_t sf_thread_cache_key;
+static pthread_once_t sf_thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+static sf_block* allocate_from_thread_cache(size_t required_block_size, size_t requested_size);
+static int release_to_thread_cache(sf_block* block, size_t block_size, size_t payload_size);
+static void fold_thread_cache_stats(sf_thread_cache* cache);
+static void discard_stale_thread_cache(sf_thread_cache* cache);
+#endif
+
+/* Internal (file-local) helpers, defined further below. */
+static sf_block* allocate_block_from_heap(size_t required_block_size, size_t requested_size);
+static void release_block_to_heap(sf_block* block, size_t block_size, size_t payload_size);
+static void* reallocate_block(void* pp, size_t rsize);
+static int grow_block_in_place(sf_block* block, size_t old_size, size_t new_size, size_t rsize);
+static int cache_realloc_tail(sf_block* tail, size_t tail_size);
+static int remove_block_from_quick_list(sf_block* block, size_t block_size);
+static void walk_allocated_blocks(size_t* total_payload, size_t* total_allocated_block_size);
+#ifdef DEBUG
+static void check_fragmentation_totals();
+#endif
+static sf_block* add_chunk_to_arena(sf_arena* arena, size_t required_block_size);
+static sf_block* grow_heap_to_fit(size_t required_block_size);
+static void decode_block_being_freed(sf_block* block, size_t* block_size, size_t* payload_size);
+static int get_quick_list_capacity(int ql_index);
+static void sort_by_address(void* ptrs[], size_t n);
+static void note_heap_reuse(char* touched_end);
+static void trim_heap_tail_if_needed();
+static sf_block* allocate_aligned_block(char* alignment_base, size_t alignment, size_t required_block_size, size_t requested_size);
+static void insert_freed_block(sf_block* block);
+#ifdef DEFERRED_COALESCING
+static void coalesce_deferred_frees();
+#endif
+#ifdef MMAP_THRESHOLD
+static void* allocate_mapped_block(size_t requested_size);
+static sf_mapped_region* find_mapped_region(void* pp);
+static void release_mapped_block(sf_mapped_region* region);
+static void* reallocate_mapped_block(sf_mapped_region* region, size_t rsize);
+#endif
+#ifdef SLAB_ALLOCATOR
+static void* allocate_from_slab(size_t requested_size);
+static sf_slab_run* find_slab_run(void* pp);
+static void release_to_slab(sf_slab_run* run, void* pp);
+static void* reallocate_slab_slot(sf_slab_run* run, void* pp, size_t rsize);
+#endif
+#ifdef ADAPTIVE_QUICK_LISTS
+static void note_quick_list_miss(int ql_index);
+static void note_quick_list_operation();
+#endif
+
 /**
  * =============================================================================
  * FUNCTION: sf_malloc
@@ -46,11 +449,12 @@ size_t sf_peak_payload = 0;
  *   1) Return NULL immediately if `requested_size == 0`.
  *   2) If the heap is not yet initialized (start == end), initialize it.
  *   3) Compute the required block size, including header & footer, aligned to 16.
- *   4) Search the free lists for a fitting block.
- *   5) If no block is found, extend the heap by one page and try again.
- *   6) If the free block is significantly larger than needed, split it.
- *   7) Remove the chosen block from its free list, mark it allocated.
- *   8) Return a pointer to the user payload area.
+ *   4) If a quick list holds blocks of exactly that size, pop one and return it.
+ *   5) Search the free lists for a fitting block.
+ *   6) If no block is found, grow the heap once by the number of pages needed.
+ *   7) If the free block is significantly larger than needed, split it.
+ *   8) Remove the chosen block from its free list, mark it allocated.
+ *   9) Return a pointer to the user payload area.
  *
  * NOTES:
  *   - On failure to extend the heap, sets sf_errno = ENOMEM.
@@ -66,36 +470,160 @@ void* sf_malloc(size_t requested_size)
     // Return NULL if the request is for zero bytes.
     if (requested_size == 0) return NULL;
 
-    // Check if the heap has not yet been initialized.
-    if (sf_mem_start() == sf_mem_end()) {
-        initialize_heap_during_first_call_to_sf_malloc();
+#ifdef MMAP_THRESHOLD
+    // Large requests get a mapping of their own instead of a heap block.
+    if (requested_size >= MMAP_THRESHOLD) {
+        LOCK_HEAP();
+        void* mapped_payload = allocate_mapped_block(requested_size);
+        UNLOCK_HEAP();
+        TRACE_OP(SF_TRACE_MALLOC, mapped_payload, NULL, requested_size);
+        PROFILE_MALLOC(mapped_payload, requested_size);
+        return mapped_payload;
+    }
+#endif
+
+#ifdef SLAB_ALLOCATOR
+    // Tiny requests share slab runs instead of taking a 32-byte block each.
+    if (requested_size <= SLAB_MAX_SIZE) {
+        LOCK_HEAP();
+        void* slot = allocate_from_slab(requested_size);
+        UNLOCK_HEAP();
+        TRACE_OP(SF_TRACE_MALLOC, slot, NULL, requested_size);
+        PROFILE_MALLOC(slot, requested_size);
+        return slot;
     }
+#endif
 
     // Calculate total block size including header, footer, and alignment.
     size_t required_block_size = calculate_aligned_block_size(requested_size);
 
+#ifdef THREAD_SAFE
+    // Per-thread fast path: serve small requests from this thread's cache without locking.
+    sf_block* thread_cached_block = allocate_from_thread_cache(required_block_size, requested_size);
+    if (thread_cached_block != NULL) {
+        TRACE_OP(SF_TRACE_MALLOC, thread_cached_block->body.payload, NULL, requested_size);
+        PROFILE_MALLOC(thread_cached_block->body.payload, requested_size);
+        return thread_cached_block->body.payload;
+    }
+#endif
+
+    LOCK_HEAP();
+    sf_block* chosen_block = allocate_block_from_heap(required_block_size, requested_size);
+    UNLOCK_HEAP();
+
+    // Return a pointer to the usable payload portion of the allocated block.
+    void* payload = (chosen_block != NULL) ? chosen_block->body.payload : NULL;
+    TRACE_OP(SF_TRACE_MALLOC, payload, NULL, requested_size);
+    PROFILE_MALLOC(payload, requested_size);
+    return payload;
+}
+
+/**
+ * Shared-heap part of sf_malloc (steps 2 and 4-8): initializes the heap if needed,
+ * tries the quick-list fast path, and otherwise searches, grows, splits and marks.
+ * In THREAD_SAFE builds the caller must hold sf_heap_lock.
+ *
+ * @return The allocated block, or NULL with sf_errno = ENOMEM.
+ */
+static sf_block* allocate_block_from_heap(size_t required_block_size, size_t requested_size)
+{
+    // Check if the heap has not yet been initialized (arenas are set up at creation).
+    if (sf_active_arena == NULL && sf_mem_start() == sf_mem_end()) {
+        initialize_heap_during_first_call_to_sf_malloc();
+    }
+
+#ifdef THREAD_SAFE
+    // The thread cache refill has already drained the main heap's quick list.
+    int try_quick_list = (sf_active_arena != NULL);
+#else
+    int try_quick_list = 1;
+#endif
+
+    // Fast path: reuse an exact-size block cached on a quick list.
+    // No split, list walk, or coalesce is needed for these.
+    size_t max_quick_size = 32 + 16 * (NUM_QUICK_LISTS - 1);
+    if (try_quick_list && required_block_size <= max_quick_size) {
+        int ql_index = (required_block_size - 32) / 16;
+        sf_block* cached_block = pop_block_from_quick_list(ql_index);
+
+        if (cached_block != NULL) {
+            sf_quick_list_hits++;
+
+            // Rebuild the header as a plain allocated block (clears IN_QUICK_LIST).
+            uint64_t new_header = ((uint64_t)requested_size << 32) |
+                                  (required_block_size | THIS_BLOCK_ALLOCATED) |
+                                  (decode_header(cached_block->header) & PREV_BLOCK_ALLOCATED);
+            sf_allocated_payload += requested_size - get_payload_size(cached_block);
+            cached_block->header = encode_header(new_header);
+            write_allocated_footer(cached_block, required_block_size);
+
+            // Update usage stats
+            sf_current_payload += requested_size;
+            if (sf_current_payload > sf_peak_payload)
+                sf_peak_payload = sf_current_payload;
+            STAT_INC(malloc_count[get_stats_size_class(required_block_size)]);
+#ifdef ADAPTIVE_QUICK_LISTS
+            QUICK_LIST_TUNING->reused[ql_index] = 1;
+            note_quick_list_operation();
+#endif
+
+            return cached_block;
+        }
+
+        sf_quick_list_misses++;
+#ifdef ADAPTIVE_QUICK_LISTS
+        note_quick_list_miss(ql_index);
+#endif
+    }
+
     // Attempt to find a suitable free block in the free lists.
     sf_block* chosen_block = find_first_free_block_that_fits(required_block_size);
 
-    // If no block is found, extend the heap by one page and try again.
-    while (chosen_block == NULL) {
-        sf_block* new_block = extend_heap_by_one_page();
-        if (new_block == NULL) {
+    // An arena grows by whole chunks sized to fit the request.
+    if (chosen_block == NULL && sf_active_arena != NULL) {
+        chosen_block = add_chunk_to_arena(sf_active_arena, required_block_size);
+        if (chosen_block == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    // If no block is found, grow the heap once by as many pages as the request needs.
+    if (chosen_block == NULL) {
+#ifdef ADAPTIVE_QUICK_LISTS
+        int saved_errno = sf_errno;
+#endif
+        chosen_block = grow_heap_to_fit(required_block_size);
+#ifdef ADAPTIVE_QUICK_LISTS
+        // Out of memory: give back what the quick lists hold before failing.
+        if (chosen_block == NULL && QUICK_LIST_TUNING->cached_bytes > 0) {
+            for (int i = 0; i < NUM_QUICK_LISTS; i++)
+                flush_quick_list(i);
+            chosen_block = find_first_free_block_that_fits(required_block_size);
+            if (chosen_block == NULL)
+                chosen_block = grow_heap_to_fit(required_block_size);
+            if (chosen_block != NULL)
+                sf_errno = saved_errno;
+        }
+#endif
+        if (chosen_block == NULL) {
             sf_errno = ENOMEM;
             return NULL;
         }
-        chosen_block = find_first_free_block_that_fits(required_block_size);
     }
 
+    // Remove the chosen block from its free list while its header still describes it.
+    remove_block_from_free_list(chosen_block);
+
     // If the chosen free block is substantially bigger than needed, split it.
     split_free_block_if_necessary(chosen_block, required_block_size);
 
-    // Remove from free list and mark the block as allocated.
-    remove_block_from_free_list(chosen_block);
-    mark_block_as_allocated(chosen_block, required_block_size, requested_size);
+    // An unsplit block keeps its full size (the leftover would have been a splinter).
+    size_t chosen_block_size = decode_header(chosen_block->header) & 0xFFFFFFFF & ~0xF;
+    mark_block_as_allocated(chosen_block, chosen_block_size, requested_size);
+    STAT_INC(malloc_count[get_stats_size_class(chosen_block_size)]);
 
-    // Return a pointer to the usable payload portion of the allocated block.
-    return chosen_block->body.payload;
+    return chosen_block;
 }
 
 /**
@@ -122,28 +650,94 @@ void sf_free(void* pp) {
     if (pp == NULL)
         return;
 
+#ifdef MMAP_THRESHOLD
+    // A mapped block is unmapped straight away.
+    sf_mapped_region* region = find_mapped_region(pp);
+    if (region != NULL) {
+        TRACE_OP(SF_TRACE_FREE, pp, NULL, 0);
+        PROFILE_FREE(pp);
+        LOCK_HEAP();
+        release_mapped_block(region);
+        UNLOCK_HEAP();
+        return;
+    }
+#endif
+
+#ifdef SLAB_ALLOCATOR
+    sf_slab_run* run = find_slab_run(pp);
+    if (run != NULL) {
+        TRACE_OP(SF_TRACE_FREE, pp, NULL, 0);
+        PROFILE_FREE(pp);
+        LOCK_HEAP();
+        release_to_slab(run, pp);
+        UNLOCK_HEAP();
+        return;
+    }
+#endif
+
     // Convert user pointer to the start of the block (which includes the header).
     sf_block* block = (sf_block*)((char*)pp - 8);
 
     // Decode header to retrieve payload/block size and validate.
+    size_t payload_size, block_size;
+    decode_block_being_freed(block, &block_size, &payload_size);
+
+    if (SF_UNLIKELY((void*)block < sf_mem_start() || (void*)block >= sf_mem_end()))
+        abort();
+
+    // Recorded before the block can be reused, so the trace never shows it live twice.
+    TRACE_OP(SF_TRACE_FREE, pp, NULL, 0);
+    PROFILE_FREE(pp);
+
+#ifdef THREAD_SAFE
+    // Per-thread fast path: small blocks go into this thread's cache without locking.
+    if (release_to_thread_cache(block, block_size, payload_size))
+        return;
+#endif
+
+    LOCK_HEAP();
+
+    // Reduce current payload usage by the block's payload size.
+    sf_current_payload -= payload_size;
+    STAT_INC(free_count[get_stats_size_class(block_size)]);
+
+    release_block_to_heap(block, block_size, payload_size);
+
+    UNLOCK_HEAP();
+}
+
+/**
+ * Decodes the header of a block that is about to be freed and aborts unless it
+ * describes a valid allocated block that is not already sitting in a quick list.
+ */
+static void decode_block_being_freed(sf_block* block, size_t* block_size, size_t* payload_size)
+{
     uint64_t encoded_header = block->header;
-    uint64_t decoded_header = encoded_header ^ MAGIC;
-    size_t payload_size = decoded_header >> 32;
-    size_t block_size = (decoded_header & 0xFFFFFFFF) & ~0xF;
+    uint64_t decoded_header = decode_header(encoded_header);
+    *payload_size = decoded_header >> 32;
+    *block_size = (decoded_header & 0xFFFFFFFF) & ~0xF;
 
     // Validate the block to ensure correctness.
-    if (block_size < 32 || block_size % 16 != 0)
+    if (SF_UNLIKELY(*block_size < 32 || *block_size % 16 != 0))
         abort();
-    if (!(decoded_header & THIS_BLOCK_ALLOCATED))
+    if (SF_UNLIKELY(!(decoded_header & THIS_BLOCK_ALLOCATED)))
         abort();
-    if (decoded_header & IN_QUICK_LIST)
+    if (SF_UNLIKELY(decoded_header & IN_QUICK_LIST))
         abort();
-    if ((void*)block < sf_mem_start() || (void*)block >= sf_mem_end())
-        abort();
-
-    // Reduce current payload usage by the block's payload size.
-    sf_current_payload -= payload_size;
+#ifdef SLAB_ALLOCATOR
+    if (SF_UNLIKELY(decoded_header & SLAB_RUN_BLOCK))
+        abort(); // A run is freed slot by slot, never as a block.
+#endif
+}
 
+/**
+ * Shared-heap part of sf_free (steps 3-4): caches a small block on its quick list
+ * (flushing the list first if it is full), or marks a larger block free and hands
+ * it to insert_freed_block(). Payload accounting is left to the caller.
+ * In THREAD_SAFE builds the caller must hold sf_heap_lock.
+ */
+static void release_block_to_heap(sf_block* block, size_t block_size, size_t payload_size)
+{
     // If block fits in quick list range, place it there.
     size_t max_quick_size = 32 + 16 * (NUM_QUICK_LISTS - 1);
     if (block_size <= max_quick_size) {
@@ -151,30 +745,35 @@ void sf_free(void* pp) {
         if (ql_index < 0 || ql_index >= NUM_QUICK_LISTS)
             abort();
 
-        // If this quick list is at capacity, flush its blocks.
-        if (sf_quick_lists[ql_index].length >= QUICK_LIST_MAX)
-            flush_quick_list(ql_index);
-
-        // Build a new header marking it as allocated & in quick list.
-        uint64_t new_header = ((uint64_t)payload_size << 32) |
-                              (block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST);
-        block->header = new_header ^ MAGIC;
-
-        // Write footer to match.
-        sf_footer* footer = (sf_footer*)((char*)block + block_size - 8);
-        *footer = block->header; // already encoded
+        // If this quick list is at capacity, flush its oldest blocks.
+        if (QUICK_LISTS[ql_index].length >= get_quick_list_capacity(ql_index)) {
+            int evict_count = (QUICK_LISTS[ql_index].length * QUICK_LIST_FLUSH_PERCENT + 99) / 100;
+            evict_from_quick_list(ql_index, evict_count > 0 ? evict_count : 1);
+#ifdef ADAPTIVE_QUICK_LISTS
+            QUICK_LIST_TUNING->flushed[ql_index] = 1;
+#endif
+        }
 
-        // Insert at the head of the quick list.
-        block->body.links.next = sf_quick_lists[ql_index].first;
-        sf_quick_lists[ql_index].first = block;
-        sf_quick_lists[ql_index].length++;
+        int cache_block = 1;
+#ifdef ADAPTIVE_QUICK_LISTS
+        note_quick_list_operation();
+        // Past the global cap the block is freed normally instead of cached.
+        cache_block = (QUICK_LIST_TUNING->cached_bytes + block_size <= QUICK_LIST_CACHE_LIMIT);
+#endif
 
-        return;
+        if (cache_block) {
+            push_block_onto_quick_list(ql_index, block, block_size, payload_size);
+            return;
+        }
     }
 
     // Otherwise, mark the block as truly free, coalesce, and insert into free list.
-    uint64_t new_header = ((uint64_t)payload_size << 32) | block_size;
-    block->header = new_header ^ MAGIC;
+    sf_allocated_payload -= get_payload_size(block);
+    sf_allocated_block_size -= block_size;
+
+    uint64_t new_header = ((uint64_t)payload_size << 32) | block_size |
+                          (decode_header(block->header) & PREV_BLOCK_ALLOCATED);
+    block->header = encode_header(new_header);
 
     sf_footer* footer = (sf_footer*)((char*)block + block_size - 8);
     if ((void*)footer >= sf_mem_start() && (void*)footer < sf_mem_end())
@@ -182,11 +781,8 @@ void sf_free(void* pp) {
     else
         abort();
 
-    sf_block* coalesced = coalesce_adjacent_free_blocks(block);
-    if (coalesced == NULL)
-        abort();
-
-    insert_block_into_free_list(coalesced);
+    insert_freed_block(block);
+    trim_heap_tail_if_needed();
 }
 
 /**
@@ -201,7 +797,9 @@ void sf_free(void* pp) {
  *   3) Validate the pointer's range and state.
  *   4) If new_size equals old_size, just update the payload in the header.
  *   5) If shrinking, attempt splitting; update utilization accordingly.
- *   6) If growing, allocate new block, copy data, and free old block.
+ *   6) If growing, try to absorb the next free block (growing the heap if the
+ *      block sits at the end of it); otherwise allocate new block, copy data,
+ *      and free old block.
  *
  * NOTES:
  *   - On invalid pointer, sets sf_errno=EINVAL, returns NULL.
@@ -210,6 +808,28 @@ void sf_free(void* pp) {
  * =============================================================================
  */
 void* sf_realloc(void* pp, size_t rsize)
+{
+    // The old sample goes first, before another thread can be handed the block;
+    // if the realloc then fails, that live block is simply no longer sampled.
+    PROFILE_FREE(pp);
+    PROFILE_SUSPEND();
+    TRACE_SUSPEND();
+    LOCK_HEAP();
+    void* result = reallocate_block(pp, rsize);
+    UNLOCK_HEAP();
+    TRACE_RESUME();
+    PROFILE_RESUME();
+
+    TRACE_OP(SF_TRACE_REALLOC, result, pp, rsize);
+    PROFILE_MALLOC(result, rsize);
+    return result;
+}
+
+/**
+ * Body of sf_realloc (steps 1-6). In THREAD_SAFE builds the caller holds sf_heap_lock;
+ * the nested sf_malloc/sf_free calls re-acquire it recursively.
+ */
+static void* reallocate_block(void* pp, size_t rsize)
 {
     // If pointer is NULL, act like malloc().
     if (pp == NULL)
@@ -222,8 +842,20 @@ void* sf_realloc(void* pp, size_t rsize)
         return NULL;
     }
 
+#ifdef MMAP_THRESHOLD
+    sf_mapped_region* region = find_mapped_region(pp);
+    if (region != NULL)
+        return reallocate_mapped_block(region, rsize);
+#endif
+
+#ifdef SLAB_ALLOCATOR
+    sf_slab_run* run = find_slab_run(pp);
+    if (run != NULL)
+        return reallocate_slab_slot(run, pp, rsize);
+#endif
+
     // Validate pointer range.
-    if ((char*)pp < (char*)sf_mem_start() + 40 || (char*)pp >= (char*)sf_mem_end())
+    if (SF_UNLIKELY((char*)pp < (char*)sf_mem_start() + 40 || (char*)pp >= (char*)sf_mem_end()))
     {
         sf_errno = EINVAL;
         return NULL;
@@ -232,13 +864,20 @@ void* sf_realloc(void* pp, size_t rsize)
     // Decode current block header to check if it's valid and allocated.
     sf_block* block = (sf_block*)((char*)pp - 8);
     uint64_t encoded_header = block->header;
-    uint64_t decoded_header = encoded_header ^ MAGIC;
+    uint64_t decoded_header = decode_header(encoded_header);
 
-    if (!(decoded_header & THIS_BLOCK_ALLOCATED) || (decoded_header & IN_QUICK_LIST))
+    if (SF_UNLIKELY(!(decoded_header & THIS_BLOCK_ALLOCATED) || (decoded_header & IN_QUICK_LIST)))
+    {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+#ifdef SLAB_ALLOCATOR
+    if (SF_UNLIKELY(decoded_header & SLAB_RUN_BLOCK))
     {
         sf_errno = EINVAL;
         return NULL;
     }
+#endif
 
     // Extract old block size/payload.
     size_t old_size = decoded_header & 0xFFFFFFFF & ~0xF;
@@ -250,10 +889,15 @@ void* sf_realloc(void* pp, size_t rsize)
     // If the new size matches the old block size, only update the user payload field.
     if (new_size == old_size)
     {
-        uint64_t updated_header = ((uint64_t)rsize << 32) | (old_size | THIS_BLOCK_ALLOCATED);
-        block->header = updated_header ^ MAGIC;
+        if (rsize > old_payload)
+            sf_realloc_in_place++; // Grew into the block's own padding or splinter.
+
+        uint64_t updated_header = ((uint64_t)rsize << 32) | (old_size | THIS_BLOCK_ALLOCATED) |
+                                  (decoded_header & PREV_BLOCK_ALLOCATED);
+        block->header = encode_header(updated_header);
 
         // Update utilization tracking.
+        sf_allocated_payload = sf_allocated_payload - old_payload + rsize;
         sf_current_payload = sf_current_payload - old_payload + rsize;
         if (sf_current_payload > sf_peak_payload)
             sf_peak_payload = sf_current_payload;
@@ -268,6 +912,7 @@ void* sf_realloc(void* pp, size_t rsize)
         size_t leftover_size = old_size - new_size;
 
         // Adjust utilization.
+        sf_allocated_payload = sf_allocated_payload - old_payload + rsize;
         sf_current_payload = sf_current_payload - old_payload + rsize;
         if (sf_current_payload > sf_peak_payload)
             sf_peak_payload = sf_current_payload;
@@ -275,17 +920,23 @@ void* sf_realloc(void* pp, size_t rsize)
         // Split if leftover can form a valid free block.
         if (leftover_size >= 32)
         {
+            STAT_INC(splits);
+
             // Update header & footer for the newly resized block
-            uint64_t resized_header = ((uint64_t)rsize << 32) | (new_size | THIS_BLOCK_ALLOCATED);
-            block->header = resized_header ^ MAGIC;
+            uint64_t resized_header = ((uint64_t)rsize << 32) | (new_size | THIS_BLOCK_ALLOCATED) |
+                                      (decoded_header & PREV_BLOCK_ALLOCATED);
+            block->header = encode_header(resized_header);
+            write_allocated_footer(block, new_size);
 
-            sf_footer* resized_footer = (sf_footer*)((char*)block + new_size - 8);
-            *resized_footer = block->header; // already encoded
+            // A small tail can skip the coalesce and wait on its quick list instead.
+            sf_block* leftover_block = (sf_block*)((char*)block + new_size);
+            if (cache_realloc_tail(leftover_block, leftover_size))
+                return pp;
 
             // Create leftover block as free
-            sf_block* leftover_block = (sf_block*)((char*)block + new_size);
-            uint64_t leftover_header = ((uint64_t)0 << 32) | leftover_size;
-            leftover_block->header = leftover_header ^ MAGIC;
+            sf_allocated_block_size -= leftover_size;
+            uint64_t leftover_header = ((uint64_t)0 << 32) | leftover_size | PREV_BLOCK_ALLOCATED;
+            leftover_block->header = encode_header(leftover_header);
 
             sf_footer* leftover_footer = (sf_footer*)((char*)leftover_block + leftover_size - 8);
             *leftover_footer = leftover_block->header; // encoded
@@ -296,15 +947,29 @@ void* sf_realloc(void* pp, size_t rsize)
         }
         else
         {
-            // Otherwise, treat it as a splinter (no split).
-            uint64_t resized_header = ((uint64_t)rsize << 32) | (old_size | THIS_BLOCK_ALLOCATED);
-            block->header = resized_header ^ MAGIC;
+            // Otherwise, treat it as a splinter (no split). The block keeps its size,
+            // so growing back into the splinter later is the same-size case above.
+            uint64_t resized_header = ((uint64_t)rsize << 32) | (old_size | THIS_BLOCK_ALLOCATED) |
+                                      (decoded_header & PREV_BLOCK_ALLOCATED);
+            block->header = encode_header(resized_header);
         }
 
         return pp;
     }
 
-    // If growing, allocate a new block of the requested size, copy old data, then free old block.
+    // If growing, first try to extend the block over its free successor.
+    // A block growing past MMAP_THRESHOLD moves into a mapping instead.
+    int grow_in_heap = 1;
+#ifdef MMAP_THRESHOLD
+    grow_in_heap = (rsize < MMAP_THRESHOLD);
+#endif
+    if (grow_in_heap && grow_block_in_place(block, old_size, new_size, rsize))
+    {
+        sf_realloc_in_place++;
+        return pp;
+    }
+
+    // Otherwise allocate a new block of the requested size, copy old data, then free old block.
     void* new_pp = sf_malloc(rsize);
     if (new_pp == NULL)
     {
@@ -314,119 +979,483 @@ void* sf_realloc(void* pp, size_t rsize)
 
     memcpy(new_pp, pp, old_payload);
     sf_free(pp);
+    STAT_INC(realloc_moved);
 
     return new_pp;
 }
 
 /**
- * =============================================================================
- * FUNCTION: sf_fragmentation
- * -----------------------------------------------------------------------------
- * Computes the current internal fragmentation ratio: total_payload / total_allocated_block_size.
+ * Grows an allocated block to new_size without moving it.
  *
- * STEPS:
- *   1) Walk the heap from prologue to epilogue, summing allocated blocks' payload & sizes.
- *   2) Also consider blocks in quick lists as allocated.
- *   3) Return 0.0 if nothing is allocated.
+ * The block absorbs its successor when that successor is a free block large
+ * enough to cover the difference. If the block is the last one in the heap
+ * (followed by the epilogue, or by a free block that is too small), the heap
+ * is first extended by just enough pages. A leftover of at least 32 bytes is
+ * split off and returned to the free lists.
  *
- * NOTES:
- *   - total_allocated_block_size includes header+footer for each allocated block.
- *   - total_payload is the sum of user-requested sizes stored in the upper 32 bits.
- * =============================================================================
+ * @return 1 if the block now has at least new_size bytes, 0 if the caller must copy.
  */
-double sf_fragmentation()
+static int grow_block_in_place(sf_block* block, size_t old_size, size_t new_size, size_t rsize)
 {
-    size_t total_payload = 0;
-    size_t total_allocated_block_size = 0;
-
-    void* heap_start = sf_mem_start();
-    void* heap_end = sf_mem_end();
-
-    // Start scanning from after the prologue (32 + 8 for prologue + footer).
-    sf_block* current = (sf_block*)((char*)heap_start + 40);
+    sf_block* next_block = (sf_block*)((char*)block + old_size);
+    char* epilogue = (char*)sf_mem_end() - 8;
+
+    size_t next_header = decode_header(next_block->header);
+    int next_is_free = !(next_header & THIS_BLOCK_ALLOCATED);
+    size_t next_size = next_is_free ? (next_header & 0xFFFFFFFF & ~0xF) : 0;
+
+    // A successor cached on a quick list (such as a tail an earlier shrink left there)
+    // is taken back when it covers the difference.
+    int next_was_cached = 0;
+    if (!next_is_free && (next_header & IN_QUICK_LIST)) {
+        size_t cached_size = next_header & 0xFFFFFFFF & ~0xF;
+        if (old_size + cached_size >= new_size && remove_block_from_quick_list(next_block, cached_size)) {
+            sf_allocated_payload -= get_payload_size(next_block);
+            sf_allocated_block_size -= cached_size;
+            next_size = cached_size;
+            next_was_cached = 1;
+        }
+    }
 
-    // Walk through the entire heap looking for allocated blocks.
-    while ((void*)current + 8 < heap_end)
+    // Not enough room yet: only the heap tail can be grown.
+    if (old_size + next_size < new_size)
     {
-        uint64_t raw_header = current->header;
-        uint64_t header = raw_header ^ MAGIC;
+        int at_heap_end = ((char*)next_block == epilogue) ||
+                          (next_is_free && (char*)next_block + next_size == epilogue);
+        if (!at_heap_end)
+            return 0;
+
+        // A failed extension must not leave ENOMEM behind; the copy path may still succeed.
+        int saved_errno = sf_errno;
+        size_t shortfall = new_size - old_size - next_size;
+        sf_block* tail = extend_heap_by_pages((shortfall + PAGE_SZ - 1) / PAGE_SZ);
+        sf_errno = saved_errno;
+        if (tail == NULL)
+            return 0;
+
+        // The new pages were merged with (or became) the successor.
+        next_header = decode_header(next_block->header);
+        next_size = next_header & 0xFFFFFFFF & ~0xF;
+        if (old_size + next_size < new_size)
+            return 0;
+    }
 
-        uint64_t payload = header >> 32;
-        uint32_t lower = (uint32_t)(header & 0xFFFFFFFF);
-        size_t block_size = lower & ~0xF;
-        uint64_t flags = lower & 0xF;
+    // Take the successor out of its free list and absorb it.
+    if (!next_was_cached)
+        remove_block_from_free_list(next_block);
+    size_t combined_size = old_size + next_size;
+    note_heap_reuse((char*)block + new_size + FREE_BLOCK_METADATA_SIZE);
 
-        if (block_size < 32 || block_size % 16 != 0)
-            break; // Malformed block or end of valid region
+    // The remainder stays inside the block if it would be a splinter.
+    size_t final_size = (combined_size - new_size >= 32) ? new_size : combined_size;
 
-        // Sum payload and total allocated block size if block is allocated.
-        if (flags & THIS_BLOCK_ALLOCATED)
-        {
-            total_payload += payload;
-            total_allocated_block_size += block_size;
-        }
+    uint64_t old_header = decode_header(block->header);
+    size_t old_payload = old_header >> 32;
+    uint64_t grown_header = ((uint64_t)rsize << 32) | (final_size | THIS_BLOCK_ALLOCATED) |
+                            (old_header & PREV_BLOCK_ALLOCATED);
+    block->header = encode_header(grown_header);
+    write_allocated_footer(block, final_size);
 
-        // Move to the next block in memory.
-        current = (sf_block*)((char*)current + block_size);
+    if (final_size < combined_size)
+    {
+        STAT_INC(splits);
+        sf_block* leftover_block = (sf_block*)((char*)block + new_size);
+        size_t leftover_size = combined_size - new_size;
+        leftover_block->header = encode_header(leftover_size | PREV_BLOCK_ALLOCATED);
+
+        sf_footer* leftover_footer = (sf_footer*)((char*)leftover_block + leftover_size - 8);
+        *leftover_footer = leftover_block->header; // encoded
+
+        // A free successor had no free neighbour after it; a cached one may have.
+        if (next_was_cached)
+            leftover_block = coalesce_adjacent_free_blocks(leftover_block);
+        insert_block_into_free_list(leftover_block);
     }
-
-    // Also account for blocks in the quick lists as allocated (since they are not free).
-    for (int i = 0; i < NUM_QUICK_LISTS; i++)
+    else
     {
-        sf_block* q = sf_quick_lists[i].first;
-        while (q != NULL)
-        {
-            uint64_t raw_header = q->header;
-            uint64_t header = raw_header ^ MAGIC;
+        set_prev_allocated_bit((sf_block*)((char*)block + final_size), 1);
+    }
 
-            uint64_t payload = header >> 32;
-            uint32_t lower = (uint32_t)(header & 0xFFFFFFFF);
-            size_t block_size = lower & ~0xF;
+    // Adjust utilization.
+    sf_allocated_payload = sf_allocated_payload - old_payload + rsize;
+    sf_allocated_block_size += final_size - old_size;
+    sf_current_payload = sf_current_payload - old_payload + rsize;
+    if (sf_current_payload > sf_peak_payload)
+        sf_peak_payload = sf_current_payload;
 
-            total_payload += payload;
-            total_allocated_block_size += block_size;
+    return 1;
+}
 
-            q = q->body.links.next;
-        }
-    }
+/**
+ * Hands the tail split off by a shrinking sf_realloc straight to its quick list,
+ * skipping the coalesce and free-list insert. Only done when the tail is quick-list
+ * sized, its list has room, and the block after it is allocated: a free successor
+ * is better merged with the tail. grow_block_in_place() can take the tail back.
+ *
+ * @return 1 if the tail was cached; it then stays counted as an allocated block.
+ */
+static int cache_realloc_tail(sf_block* tail, size_t tail_size)
+{
+    size_t max_quick_size = 32 + 16 * (NUM_QUICK_LISTS - 1);
+    if (tail_size > max_quick_size)
+        return 0;
 
-    // If nothing is allocated, fragmentation is 0.
-    if (total_allocated_block_size == 0)
-        return 0.0;
+    int ql_index = (tail_size - 32) / 16;
+    if (QUICK_LISTS[ql_index].length >= get_quick_list_capacity(ql_index))
+        return 0;
+#ifdef ADAPTIVE_QUICK_LISTS
+    if (QUICK_LIST_TUNING->cached_bytes + tail_size > QUICK_LIST_CACHE_LIMIT)
+        return 0;
+#endif
 
-    return (double)total_payload / (double)total_allocated_block_size;
+    sf_block* next_block = (sf_block*)((char*)tail + tail_size);
+    if (!(decode_header(next_block->header) & THIS_BLOCK_ALLOCATED))
+        return 0;
+
+    tail->header = encode_header(tail_size | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED);
+    push_block_onto_quick_list(ql_index, tail, tail_size, 0);
+    STAT_INC(realloc_tails_cached);
+    return 1;
 }
 
 /**
  * =============================================================================
- * FUNCTION: sf_utilization
+ * FUNCTION: sf_calloc
  * -----------------------------------------------------------------------------
- * Returns the peak memory utilization, i.e. (peak_payload / total_heap_size).
+ * Allocates a zero-filled array of `count` elements of `size` bytes each.
  *
  * STEPS:
- *   1) If heap not initialized, return 0.0.
- *   2) Compute the total heap size from start to end.
- *   3) Return peak_payload / heap_size. If heap_size=0, return 0.0.
+ *   1) Fail with ENOMEM if count * size overflows; return NULL if it is 0.
+ *   2) Allocate the block as sf_malloc would, noting where the memory it was
+ *      carved from was already known to be zero-filled.
+ *   3) Clear only the parts of the payload outside that zero-filled range.
+ *
+ * NOTES:
+ *   - Memory at the end of the heap that came straight from sf_mem_grow(), or
+ *     that trimming decommitted, is zero-filled and is not written again, so
+ *     a large calloc from a freshly grown heap costs no write pass.
+ *   - Mapped blocks (MMAP_THRESHOLD builds) are fresh zero pages as well.
  * =============================================================================
  */
-double sf_utilization()
+void* sf_calloc(size_t count, size_t size)
 {
-    void *heap_start = sf_mem_start();
-    void *heap_end = sf_mem_end();
-
-    // If the heap has not been initialized, utilization is 0.
-    if (heap_start == heap_end) {
-        return 0.0;
+    if (size != 0 && count > SIZE_MAX / size) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size_t total_size = count * size;
+    if (total_size == 0)
+        return NULL;
+
+#ifdef MMAP_THRESHOLD
+    if (total_size >= MMAP_THRESHOLD)
+        return sf_malloc(total_size);
+#endif
+
+#ifdef SLAB_ALLOCATOR
+    if (total_size <= SLAB_MAX_SIZE) {
+        void* slot = sf_malloc(total_size);
+        if (slot != NULL)
+            memset(slot, 0, total_size);
+        return slot;
+    }
+#endif
+
+    size_t required_block_size = calculate_aligned_block_size(total_size);
+
+    LOCK_HEAP();
+    sf_reused_zero_start = NULL;
+    sf_block* block = allocate_block_from_heap(required_block_size, total_size);
+    char* zero_start = sf_reused_zero_start;
+    char* zero_end = (char*)sf_mem_end() - 16; // The tail footer is never zero.
+    UNLOCK_HEAP();
+
+    if (block == NULL)
+        return NULL;
+
+    char* payload = block->body.payload;
+    char* payload_end = payload + total_size;
+    if (zero_start == NULL || zero_start >= payload_end) {
+        memset(payload, 0, total_size);
+    } else {
+        if (zero_start > payload)
+            memset(payload, 0, (size_t)(zero_start - payload));
+        if (zero_end < payload_end)
+            memset(zero_end, 0, (size_t)(payload_end - zero_end));
+    }
+
+    TRACE_OP(SF_TRACE_MALLOC, payload, NULL, total_size);
+    PROFILE_MALLOC(payload, total_size);
+    return payload;
+}
+
+/**
+ * =============================================================================
+ * FUNCTION: sf_fragmentation
+ * -----------------------------------------------------------------------------
+ * Computes the current internal fragmentation ratio: total_payload / total_allocated_block_size.
+ *
+ * STEPS:
+ *   1) Read the running totals sf_allocated_payload / sf_allocated_block_size.
+ *   2) Return 0.0 if nothing is allocated.
+ *
+ * NOTES:
+ *   - total_allocated_block_size includes header+footer for each allocated block.
+ *   - total_payload is the sum of user-requested sizes stored in the upper 32 bits.
+ *   - Blocks in quick lists are still marked allocated and are counted once.
+ *   - In DEBUG builds the totals are checked against a full heap walk
+ *     (see sf_fragmentation_walk).
+ *   - In THREAD_SAFE builds, payload changes made inside thread caches are
+ *     folded in when a cache refills, flushes, or its thread exits.
+ * =============================================================================
+ */
+double sf_fragmentation()
+{
+    LOCK_HEAP();
+    size_t total_payload = sf_allocated_payload;
+    size_t total_allocated_block_size = sf_allocated_block_size;
+#ifdef DEBUG
+    check_fragmentation_totals();
+#endif
+    UNLOCK_HEAP();
+
+    // If nothing is allocated, fragmentation is 0.
+    if (total_allocated_block_size == 0)
+        return 0.0;
+
+    return (double)total_payload / (double)total_allocated_block_size;
+}
+
+/**
+ * Recomputes sf_fragmentation() by walking every block of the main heap. This is
+ * O(heap size) and meant for debugging; it must agree with sf_fragmentation().
+ */
+double sf_fragmentation_walk()
+{
+    size_t total_payload = 0;
+    size_t total_allocated_block_size = 0;
+
+    LOCK_HEAP();
+    walk_allocated_blocks(&total_payload, &total_allocated_block_size);
+    UNLOCK_HEAP();
+
+    if (total_allocated_block_size == 0)
+        return 0.0;
+
+    return (double)total_payload / (double)total_allocated_block_size;
+}
+
+/**
+ * Heap walk behind sf_fragmentation_walk: sums the payload and size of every
+ * allocated block (quick-list blocks included) from the prologue to the epilogue,
+ * plus every mapped block in MMAP_THRESHOLD builds.
+ * In THREAD_SAFE builds the caller must hold sf_heap_lock.
+ */
+static void walk_allocated_blocks(size_t* total_payload, size_t* total_allocated_block_size)
+{
+#ifdef MMAP_THRESHOLD
+    // Mapped blocks live outside the heap; they count by their whole mapping.
+    for (sf_mapped_region* region = sf_mapped_regions; region != NULL; region = region->next) {
+        *total_payload += decode_header(region->header) >> 32;
+        *total_allocated_block_size += region->length;
+    }
+#endif
+
+    void* heap_start = sf_mem_start();
+    void* heap_end = sf_mem_end();
+
+    // An uninitialized heap has no blocks.
+    if (heap_start == heap_end)
+        return;
+
+    // Start scanning from after the prologue (32 + 8 for prologue + footer).
+    sf_block* current = (sf_block*)((char*)heap_start + 40);
+
+    // Walk through the entire heap looking for allocated blocks.
+    while ((void*)current + 8 < heap_end)
+    {
+        uint64_t raw_header = current->header;
+        uint64_t header = decode_header(raw_header);
+
+        uint64_t payload = header >> 32;
+        uint32_t lower = (uint32_t)(header & 0xFFFFFFFF);
+        size_t block_size = lower & ~0xF;
+        uint64_t flags = lower & 0xF;
+
+        if (block_size < 32 || block_size % 16 != 0)
+            break; // Malformed block or end of valid region
+
+        // Sum payload and total allocated block size if block is allocated.
+        if (flags & THIS_BLOCK_ALLOCATED)
+        {
+            *total_payload += payload;
+            *total_allocated_block_size += block_size;
+        }
+
+        // Move to the next block in memory.
+        current = (sf_block*)((char*)current + block_size);
+    }
+}
+
+#ifdef DEBUG
+/**
+ * Aborts if the running fragmentation totals disagree with a full heap walk.
+ * Thread caches are folded lazily, so THREAD_SAFE builds skip the payload check.
+ * In THREAD_SAFE builds the caller must hold sf_heap_lock.
+ */
+static void check_fragmentation_totals()
+{
+    size_t walked_payload = 0;
+    size_t walked_block_size = 0;
+    walk_allocated_blocks(&walked_payload, &walked_block_size);
+
+    int payload_matches = (walked_payload == sf_allocated_payload);
+#ifdef THREAD_SAFE
+    payload_matches = 1;
+#endif
+    if (!payload_matches || walked_block_size != sf_allocated_block_size) {
+        error("fragmentation totals out of sync: payload %zu (walk %zu), blocks %zu (walk %zu)",
+              sf_allocated_payload, walked_payload, sf_allocated_block_size, walked_block_size);
+        abort();
+    }
+}
+#endif
+
+/**
+ * =============================================================================
+ * FUNCTION: sf_utilization
+ * -----------------------------------------------------------------------------
+ * Returns the peak memory utilization, i.e. (peak_payload / total_heap_size).
+ *
+ * STEPS:
+ *   1) If heap not initialized, return 0.0.
+ *   2) Compute the total heap size from start to end.
+ *   3) Return peak_payload / heap_size. If heap_size=0, return 0.0.
+ *
+ * NOTES:
+ *   - In MMAP_THRESHOLD builds the heap size also counts the peak total
+ *     length of the mapped blocks, which may exist before the heap does.
+ * =============================================================================
+ */
+double sf_utilization()
+{
+    LOCK_HEAP();
+    void *heap_start = sf_mem_start();
+    void *heap_end = sf_mem_end();
+    size_t peak_payload = sf_peak_payload;
+    size_t mapped_size = 0;
+#ifdef MMAP_THRESHOLD
+    mapped_size = sf_mapped_peak_bytes;
+#endif
+    UNLOCK_HEAP();
+
+    // If the heap has not been initialized (and nothing was mapped), utilization is 0.
+    if (heap_start == heap_end && mapped_size == 0) {
+        return 0.0;
     }
 
     // Calculate total heap size.
-    size_t heap_size = (size_t)((char *)heap_end - (char *)heap_start);
+    size_t heap_size = (size_t)((char *)heap_end - (char *)heap_start) + mapped_size;
     if (heap_size == 0) {
         return 0.0;
     }
 
     // Return ratio of peak payload to total heap size.
-    return (double)sf_peak_payload / (double)heap_size;
+    return (double)peak_payload / (double)heap_size;
+}
+
+/**
+ * =============================================================================
+ * FUNCTION: sf_get_stats
+ * -----------------------------------------------------------------------------
+ * Copies the allocator's statistics into *stats.
+ *
+ * STEPS:
+ *   1) Zero *stats; fail if stats is NULL or the build lacks ALLOC_STATS.
+ *   2) Fold the calling thread's cache counters (THREAD_SAFE builds).
+ *   3) Copy the event counters and fill in the ones the allocator already keeps.
+ *   4) Sum the free bytes in each main-heap free list, bucketed by size class.
+ *
+ * NOTES:
+ *   - Other threads' caches are folded lazily, so their recent fast-path
+ *     mallocs and frees may not be reflected yet.
+ *   - Arena heaps are not included.
+ * =============================================================================
+ */
+int sf_get_stats(sf_stats_t *stats)
+{
+    if (stats == NULL)
+        return -1;
+    memset(stats, 0, sizeof(*stats));
+
+#ifndef ALLOC_STATS
+    return -1;
+#else
+    LOCK_HEAP();
+#ifdef THREAD_SAFE
+    // Deltas recorded before an sf_reset() describe blocks that no longer exist.
+    discard_stale_thread_cache(&sf_local_cache);
+    fold_thread_cache_stats(&sf_local_cache);
+#endif
+    *stats = sf_stats;
+    stats->quick_list_hits = sf_quick_list_hits;
+    stats->quick_list_misses = sf_quick_list_misses;
+    stats->realloc_in_place = sf_realloc_in_place;
+    stats->current_payload = sf_current_payload;
+    stats->peak_payload = sf_peak_payload;
+
+    for (int i = 0; i < FREE_LIST_COUNT; i++)
+    {
+        sf_block* sentinel_node = &MAIN_FREE_LIST_HEADS[i];
+
+        // Free lists are set up with the heap; before that they are empty.
+        if (sentinel_node->body.links.next == NULL)
+            continue;
+
+        for (sf_block* current = sentinel_node->body.links.next; current != sentinel_node;
+             current = current->body.links.next)
+        {
+            size_t block_size = decode_header(current->header) & 0xFFFFFFFF & ~0xF;
+            stats->free_bytes[get_stats_size_class(block_size)] += block_size;
+        }
+    }
+    UNLOCK_HEAP();
+
+    return 0;
+#endif
+}
+
+/**
+ * Chooses which fitting free block allocations take (see sfmm_ext.h). Only
+ * possible before the heap is set up, while every free list is still empty.
+ *
+ * @return 0, or -1 with sf_errno = EINVAL.
+ */
+int sf_set_placement_policy(sf_placement_policy_t policy)
+{
+    if (policy != SF_PLACEMENT_FIRST_FIT && policy != SF_PLACEMENT_BEST_FIT &&
+        policy != SF_PLACEMENT_ADDRESS_ORDERED) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+#ifdef TLSF
+    if (policy != SF_PLACEMENT_FIRST_FIT) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+#endif
+
+    LOCK_HEAP();
+    int heap_in_use = (sf_mem_start() != sf_mem_end());
+    if (!heap_in_use)
+        sf_placement_policy = policy;
+    UNLOCK_HEAP();
+
+    if (heap_in_use) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+    return 0;
 }
 
 /* ========================================================================
@@ -441,25 +1470,154 @@ double sf_utilization()
  * Computes which segregated free list index to use based on block size.
  *
  * @param total_block_size The total size of the block (including header, footer).
- * @return Index into sf_free_list_heads[].
+ * @return Index into sf_free_list_heads[] (sf_tlsf_free_list_heads[] under TLSF).
  */
 int get_free_list_index_for_size(size_t total_block_size)
 {
+#ifdef TLSF
+    // Small blocks all live in first level 0, split into linear classes.
+    if (total_block_size < TLSF_SMALL_BLOCK_SIZE) {
+        return (int)(total_block_size >> TLSF_SMALL_CLASS_SHIFT);
+    }
+
+    // First level is floor(log2(size)); the next TLSF_SL_LOG2 bits pick the second level.
+    int size_log2 = (int)(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(total_block_size);
+    int first_level = size_log2 - TLSF_FL_SHIFT + 1;
+    int second_level = (int)(total_block_size >> (size_log2 - TLSF_SL_LOG2)) & (TLSF_SL_COUNT - 1);
+
+    if (first_level >= TLSF_FL_COUNT)
+        return TLSF_NUM_CLASSES - 1;
+
+    return first_level * TLSF_SL_COUNT + second_level;
+#else
     if (total_block_size <= 32) {
         return 0;
     }
 
-    size_t current_class_size = 32;
-    int current_index = 0;
+    // Class k holds sizes in (32 * 2^(k-1), 32 * 2^k], i.e. k = ceil(log2(size / 32)),
+    // which is the bit width of (size - 1) / 32.
+    size_t scaled_size = (total_block_size - 1) >> 5;
+    int current_index = (int)(sizeof(unsigned long) * 8) - __builtin_clzl(scaled_size);
 
-    // Double the class size until we find the appropriate slot or reach the last list.
-    while (current_class_size < total_block_size && current_index < NUM_FREE_LISTS - 1)
-    {
-        current_class_size <<= 1;
-        current_index++;
-    }
+    // Everything beyond the largest class goes into the last list.
+    if (current_index > NUM_FREE_LISTS - 1)
+        current_index = NUM_FREE_LISTS - 1;
 
     return current_index;
+#endif
+}
+
+/**
+ * Computes the sf_free_list_heads[] class a block size falls in, regardless of
+ * the free list layout in use. This is what sf_stats_t buckets by.
+ *
+ * @param block_size The total size of the block (including header, footer).
+ * @return An index in [0, SF_STATS_NUM_CLASSES).
+ */
+int get_stats_size_class(size_t block_size)
+{
+#ifdef TLSF
+    if (block_size <= 32)
+        return 0;
+
+    // Same power-of-two classes as the default free lists.
+    size_t scaled_size = (block_size - 1) >> 5;
+    int size_class = (int)(sizeof(unsigned long) * 8) - __builtin_clzl(scaled_size);
+    if (size_class > SF_STATS_NUM_CLASSES - 1)
+        size_class = SF_STATS_NUM_CLASSES - 1;
+
+    return size_class;
+#else
+    return get_free_list_index_for_size(block_size);
+#endif
+}
+
+#ifdef TLSF
+/**
+ * Computes the first TLSF class in which *every* block is at least total_block_size,
+ * by rounding the size up to the next class boundary before mapping it.
+ *
+ * @return A class index, or TLSF_NUM_CLASSES if the rounded size is beyond the last class.
+ */
+static int get_free_list_search_index_for_size(size_t total_block_size)
+{
+    size_t class_width;
+    if (total_block_size < TLSF_SMALL_BLOCK_SIZE) {
+        class_width = (size_t)1 << TLSF_SMALL_CLASS_SHIFT;
+    } else {
+        int size_log2 = (int)(sizeof(unsigned long) * 8) - 1 - __builtin_clzl(total_block_size);
+        class_width = (size_t)1 << (size_log2 - TLSF_SL_LOG2);
+    }
+
+    size_t rounded_size = total_block_size + class_width - 1;
+    if (rounded_size >= ((size_t)1 << (TLSF_FL_COUNT + TLSF_FL_SHIFT - 1)))
+        return TLSF_NUM_CLASSES;
+
+    return get_free_list_index_for_size(rounded_size);
+}
+#endif
+
+/**
+ * Records in the occupancy bitmap(s) that a free list has become non-empty.
+ */
+static void set_free_list_nonempty(int index)
+{
+#ifdef TLSF
+    int first_level = index >> TLSF_SL_LOG2;
+    FREE_LIST_SL_BITMAP[first_level] |= 1u << (index & (TLSF_SL_COUNT - 1));
+    sf_free_list_bitmap |= 1u << first_level;
+#else
+    sf_free_list_bitmap |= 1u << index;
+#endif
+}
+
+/**
+ * Records in the occupancy bitmap(s) that a free list has become empty.
+ */
+static void set_free_list_empty(int index)
+{
+#ifdef TLSF
+    int first_level = index >> TLSF_SL_LOG2;
+    FREE_LIST_SL_BITMAP[first_level] &= ~(1u << (index & (TLSF_SL_COUNT - 1)));
+    if (FREE_LIST_SL_BITMAP[first_level] == 0)
+        sf_free_list_bitmap &= ~(1u << first_level);
+#else
+    sf_free_list_bitmap &= ~(1u << index);
+#endif
+}
+
+/**
+ * Finds the lowest-indexed non-empty free list at or above `index` using find-first-set
+ * on the occupancy bitmap(s).
+ *
+ * @return The class index, or -1 if every list from `index` upward is empty.
+ */
+static int find_nonempty_free_list_from(int index)
+{
+    if (index >= FREE_LIST_COUNT)
+        return -1;
+
+#ifdef TLSF
+    int first_level = index >> TLSF_SL_LOG2;
+    uint32_t second_level_map = FREE_LIST_SL_BITMAP[first_level] & (~0u << (index & (TLSF_SL_COUNT - 1)));
+
+    if (second_level_map == 0) {
+        uint32_t first_level_map = sf_free_list_bitmap & (~0u << (first_level + 1));
+        if (first_level_map == 0)
+            return -1;
+
+        first_level = __builtin_ctz(first_level_map);
+        second_level_map = FREE_LIST_SL_BITMAP[first_level];
+    }
+
+    return first_level * TLSF_SL_COUNT + __builtin_ctz(second_level_map);
+#else
+    uint32_t candidate_lists = sf_free_list_bitmap & (~0u << index);
+    if (candidate_lists == 0)
+        return -1;
+
+    return __builtin_ctz(candidate_lists);
+#endif
 }
 
 /**
@@ -478,6 +1636,11 @@ void initialize_heap_during_first_call_to_sf_malloc()
         return;
     }
 
+#ifdef STATIC_MAGIC
+    // Keep sfutil's idea of the magic (sf_magic, sf_show_heap) in step with ours.
+    sf_set_magic(STATIC_MAGIC);
+#endif
+
     // Set all free lists to empty sentinel nodes.
     initialize_all_free_list_sentinels();
     // Reset all quick lists to empty.
@@ -486,15 +1649,19 @@ void initialize_heap_during_first_call_to_sf_malloc()
     // Create a prologue block at the start of the heap.
     sf_block* prologue_block = (sf_block*)((char*)heap_start + 8);
     size_t prologue_header_info = 32 | THIS_BLOCK_ALLOCATED;
-    prologue_block->header = prologue_header_info ^ MAGIC;
+    prologue_block->header = encode_header(prologue_header_info);
+
+    // The prologue footer is what coalescing reads for the first real block.
+    sf_footer* prologue_footer = (sf_footer*)((char*)prologue_block + 32 - 8);
+    *prologue_footer = prologue_block->header;
 
     // Create the initial free block after the prologue.
     size_t initial_free_block_size = PAGE_SZ - 32 - 8;
     sf_block* initial_free_block = (sf_block*)((char*)prologue_block + 32);
 
-    // Encode & store header, then matching footer
-    size_t free_block_header_info = initial_free_block_size;
-    initial_free_block->header = free_block_header_info ^ MAGIC;
+    // Encode & store header, then matching footer (the prologue counts as allocated)
+    size_t free_block_header_info = initial_free_block_size | PREV_BLOCK_ALLOCATED;
+    initial_free_block->header = encode_header(free_block_header_info);
 
     sf_footer* initial_free_footer = (sf_footer*)((char*)initial_free_block + initial_free_block_size - 8);
     *initial_free_footer = initial_free_block->header;
@@ -502,10 +1669,13 @@ void initialize_heap_during_first_call_to_sf_malloc()
     // Create an epilogue block at the end of the page.
     sf_block* epilogue_block = (sf_block*)((char*)sf_mem_end() - 8);
     size_t epilogue_header_info = 8 | THIS_BLOCK_ALLOCATED;
-    epilogue_block->header = epilogue_header_info ^ MAGIC;
+    epilogue_block->header = encode_header(epilogue_header_info);
 
     // Insert the newly created large free block into the free list.
     insert_block_into_free_list(initial_free_block);
+
+    // Everything past the free block's header and links is still zero-filled.
+    sf_tail_zeroed = (char*)initial_free_block + FREE_BLOCK_METADATA_SIZE;
 }
 
 /**
@@ -513,13 +1683,28 @@ void initialize_heap_during_first_call_to_sf_malloc()
  */
 void initialize_all_free_list_sentinels()
 {
-    for (int list_index = 0; list_index < NUM_FREE_LISTS; list_index++)
+    for (int list_index = 0; list_index < FREE_LIST_COUNT; list_index++)
     {
-        sf_block* sentinel_node = &sf_free_list_heads[list_index];
+        sf_block* sentinel_node = &FREE_LIST_HEADS[list_index];
         sentinel_node->body.links.next = sentinel_node;
         sentinel_node->body.links.prev = sentinel_node;
         sentinel_node->header = 0; // no encoding needed for sentinel
     }
+
+    // Every list is empty now.
+    sf_free_list_bitmap = 0;
+#ifdef TLSF
+    for (int first_level = 0; first_level < TLSF_FL_COUNT; first_level++)
+        FREE_LIST_SL_BITMAP[first_level] = 0;
+
+    // sfutil's sf_show_heap() still walks sf_free_list_heads, which TLSF never
+    // fills; they must at least be valid empty lists.
+    for (int list_index = 0; list_index < NUM_FREE_LISTS; list_index++) {
+        sf_free_list_heads[list_index].body.links.next = &sf_free_list_heads[list_index];
+        sf_free_list_heads[list_index].body.links.prev = &sf_free_list_heads[list_index];
+        sf_free_list_heads[list_index].header = 0;
+    }
+#endif
 }
 
 /**
@@ -529,9 +1714,15 @@ void initialize_all_quick_lists()
 {
     for (int i = 0; i < NUM_QUICK_LISTS; i++)
     {
-        sf_quick_lists[i].length = 0;
-        sf_quick_lists[i].first = NULL;
+        QUICK_LISTS[i].length = 0;
+        QUICK_LISTS[i].first = NULL;
     }
+
+#ifdef ADAPTIVE_QUICK_LISTS
+    memset(QUICK_LIST_TUNING, 0, sizeof(*QUICK_LIST_TUNING));
+    for (int i = 0; i < NUM_QUICK_LISTS; i++)
+        QUICK_LIST_TUNING->capacity[i] = QUICK_LIST_MAX;
+#endif
 }
 
 /**
@@ -542,8 +1733,8 @@ void initialize_all_quick_lists()
  */
 size_t calculate_aligned_block_size(size_t requested_payload_size)
 {
-    // Compute size including header, footer, and alignment.
-    size_t size_with_header_and_footer = requested_payload_size + sizeof(sf_header) + sizeof(sf_footer);
+    // Compute size including header, footer (unless elided), and alignment.
+    size_t size_with_header_and_footer = requested_payload_size + ALLOCATED_BLOCK_OVERHEAD;
     size_t size_aligned_to_16 = (size_with_header_and_footer + 15) & ~0xF;
 
     // Ensure minimum block size is 32.
@@ -554,114 +1745,359 @@ size_t calculate_aligned_block_size(size_t requested_payload_size)
 }
 
 /**
- * Scans segregated free lists for a first-fit block >= required_total_block_size.
- * If none is found, returns NULL.
+ * Treap priority of a free block: a multiplicative hash of its address, so that
+ * blocks freed in address order still give a balanced treap.
  */
-sf_block* find_first_free_block_that_fits(size_t required_total_block_size)
+static uint32_t get_fit_priority(sf_block* block)
 {
-    // Determine which list index is appropriate to start searching.
-    int starting_list_index = get_free_list_index_for_size(required_total_block_size);
-
-    // Search from that list through larger lists using first-fit strategy.
-    for (int current_index = starting_list_index; current_index < NUM_FREE_LISTS; current_index++)
-    {
-        sf_block* sentinel_node = &sf_free_list_heads[current_index];
-        sf_block* current_block = sentinel_node->body.links.next;
-
-        while (current_block != sentinel_node)
-        {
-            // decode
-            size_t current_block_size = (current_block->header ^ MAGIC) & ~0xF;
-            if (current_block_size >= required_total_block_size)
-            {
-                return current_block;
-            }
-            current_block = current_block->body.links.next;
-        }
-    }
-    return NULL;
+    return (uint32_t)(((uintptr_t)block >> 4) * 2654435761u);
 }
 
 /**
- * Insert a free block into the appropriate free list, setting up header/footer,
- * then performing LIFO insertion at the head.
+ * Whether a block of block_size orders before other in a fit treap: smaller
+ * blocks first, and equal sizes by address.
  */
-void insert_block_into_free_list(sf_block* free_block)
+static int fit_tree_orders_before(sf_block* block, size_t block_size, sf_block* other)
 {
-    // Decode the block's header to discover the size.
-    size_t header_unmasked = free_block->header ^ MAGIC;
-    size_t block_size = header_unmasked & ~0xF;
+    size_t other_size = decode_header(other->header) & 0xFFFFFFFF & ~0xF;
+    return block_size < other_size || (block_size == other_size && block < other);
+}
 
-    // Re-encode the header as a free block (no flags set).
-    size_t new_header = block_size ^ MAGIC;
-    free_block->header = new_header;
+/** The pointer that holds block in its treap: its parent's child link, or the root. */
+static sf_block** get_fit_tree_link(sf_block* block, sf_block** root)
+{
+    sf_block* parent = FIT_NODE(block)->parent;
+    if (parent == NULL)
+        return root;
 
-    // Write matching footer (same encoded value).
-    sf_footer* footer = (sf_footer*)((char*)free_block + block_size - 8);
-    *footer = free_block->header;
+    return (FIT_NODE(parent)->left == block) ? &FIT_NODE(parent)->left : &FIT_NODE(parent)->right;
+}
 
-    // Identify which free list this block belongs in.
-    int index = get_free_list_index_for_size(block_size);
-    sf_block* sentinel = &sf_free_list_heads[index];
+/** Rotates block above its parent without changing the treap's order. */
+static void rotate_fit_node_up(sf_block* block, sf_block** root)
+{
+    sf_fit_node* node = FIT_NODE(block);
+    sf_block* parent = node->parent;
+    sf_fit_node* parent_node = FIT_NODE(parent);
+    sf_block** parent_link = get_fit_tree_link(parent, root);
+
+    if (parent_node->left == block) {
+        parent_node->left = node->right;
+        if (node->right != NULL)
+            FIT_NODE(node->right)->parent = parent;
+        node->right = parent;
+    } else {
+        parent_node->right = node->left;
+        if (node->left != NULL)
+            FIT_NODE(node->left)->parent = parent;
+        node->left = parent;
+    }
 
-    // LIFO insertion at the head of the chosen free list.
-    free_block->body.links.next = sentinel->body.links.next;
-    free_block->body.links.prev = sentinel;
-    sentinel->body.links.next->body.links.prev = free_block;
-    sentinel->body.links.next = free_block;
+    node->parent = parent_node->parent;
+    parent_node->parent = block;
+    *parent_link = block;
 }
 
 /**
- * If a free block is big enough for the requested block + leftover >= 32,
- * we split the block:
- *   - Carve out a new free block from leftover
- *   - Insert leftover block
- *   - Mark the original portion as allocated with the correct payload in the upper bits
+ * Adds a free block of block_size to the treap of class `index`: a leaf at its
+ * ordered position, rotated up past every parent of lower priority.
  */
-void split_free_block_if_necessary(sf_block* free_block, size_t needed_size)
+static void insert_block_into_fit_tree(sf_block* block, size_t block_size, int index)
 {
-    // Decode size of the free block.
-    size_t free_block_header_unmasked = free_block->header ^ MAGIC;
-    size_t free_block_total_size = free_block_header_unmasked & ~0xF;
+    sf_block** root = &FIT_TREE_ROOTS[index];
+    sf_block** link = root;
+    sf_block* parent = NULL;
+    while (*link != NULL) {
+        parent = *link;
+        link = fit_tree_orders_before(block, block_size, parent) ? &FIT_NODE(parent)->left
+                                                                 : &FIT_NODE(parent)->right;
+    }
 
-    // Calculate leftover if we carve out needed_size from this free block.
-    size_t remaining_block_size = free_block_total_size - needed_size;
+    sf_fit_node* node = FIT_NODE(block);
+    node->left = NULL;
+    node->right = NULL;
+    node->parent = parent;
+    *link = block;
 
-    // If leftover is too small (< 32 bytes), do not split.
-    if (remaining_block_size < 32)
-        return;
+    uint32_t priority = get_fit_priority(block);
+    while (node->parent != NULL && priority > get_fit_priority(node->parent))
+        rotate_fit_node_up(block, root);
+}
 
-    // Create a new free block from leftover space.
-    sf_block* new_free_block = (sf_block*)((char*)free_block + needed_size);
-    uint64_t new_free_header = ((uint64_t)0 << 32) | remaining_block_size;
-    new_free_block->header = new_free_header ^ MAGIC;
+/**
+ * Takes a block out of the treap of class `index` by rotating its higher-priority
+ * child above it until it is a leaf, then unlinking it.
+ */
+static void remove_block_from_fit_tree(sf_block* block, int index)
+{
+    sf_block** root = &FIT_TREE_ROOTS[index];
+    sf_fit_node* node = FIT_NODE(block);
+
+    while (node->left != NULL || node->right != NULL) {
+        sf_block* child = node->left;
+        if (child == NULL || (node->right != NULL && get_fit_priority(node->right) > get_fit_priority(child)))
+            child = node->right;
+        rotate_fit_node_up(child, root);
+    }
 
-    // Write footer for the new free block.
-    sf_footer* new_free_footer = (sf_footer*)((char*)new_free_block + remaining_block_size - 8);
-    *new_free_footer = new_free_block->header; // encoded
+    *get_fit_tree_link(block, root) = NULL;
+}
 
-    // Insert the new free block into the free list.
+/**
+ * Finds the smallest block of at least required_total_block_size in a class.
+ * Classes with a treap are searched in O(log n) and break ties by address;
+ * smaller ones are walked, stopping at an exact fit.
+ *
+ * @return The best-fitting block, or NULL if nothing in the class fits.
+ */
+static sf_block* find_best_fit_in_free_list(int list_index, size_t required_total_block_size)
+{
+    sf_block* best_block = NULL;
+
+    if (list_index >= FIT_TREE_MIN_CLASS) {
+        sf_block* current_block = FIT_TREE_ROOTS[list_index];
+        while (current_block != NULL) {
+            // Either child may be next; fetch both while this node is compared.
+            SF_PREFETCH(FIT_NODE(current_block)->left);
+            SF_PREFETCH(FIT_NODE(current_block)->right);
+
+            size_t current_block_size = decode_header(current_block->header) & 0xFFFFFFFF & ~0xF;
+            if (current_block_size >= required_total_block_size) {
+                best_block = current_block;
+                current_block = FIT_NODE(current_block)->left;
+            } else {
+                current_block = FIT_NODE(current_block)->right;
+            }
+        }
+        return best_block;
+    }
+
+    size_t best_block_size = SIZE_MAX;
+    sf_block* sentinel_node = &FREE_LIST_HEADS[list_index];
+    for (sf_block* current_block = sentinel_node->body.links.next; current_block != sentinel_node;
+         current_block = current_block->body.links.next)
+    {
+        SF_PREFETCH(current_block->body.links.next);
+
+        size_t current_block_size = decode_header(current_block->header) & 0xFFFFFFFF & ~0xF;
+        if (current_block_size < required_total_block_size || current_block_size >= best_block_size)
+            continue;
+
+        best_block = current_block;
+        best_block_size = current_block_size;
+        if (best_block_size == required_total_block_size)
+            break;
+    }
+    return best_block;
+}
+
+/**
+ * Walks a single free list and returns its first block >= required_total_block_size.
+ * Returns NULL without touching the list if the bitmap says it is empty.
+ */
+static sf_block* find_first_fit_in_free_list(int list_index, size_t required_total_block_size)
+{
+    sf_block* sentinel_node = &FREE_LIST_HEADS[list_index];
+    if (sentinel_node->body.links.next == sentinel_node)
+        return NULL;
+
+    sf_block* current_block = sentinel_node->body.links.next;
+    while (current_block != sentinel_node)
+    {
+        // The next node's line is fetched while this block's size is checked.
+        sf_block* next_block = current_block->body.links.next;
+        SF_PREFETCH(next_block);
+
+        // decode
+        size_t current_block_size = decode_header(current_block->header) & ~0xF;
+        if (current_block_size >= required_total_block_size)
+        {
+            return current_block;
+        }
+        current_block = next_block;
+    }
+    return NULL;
+}
+
+/**
+ * Scans segregated free lists for a first-fit block >= required_total_block_size.
+ * If none is found, returns NULL.
+ *
+ * Only the starting class can contain blocks that are too small, so it is the only
+ * list that is walked. Any block in a larger class fits, so the first non-empty
+ * larger class is found via sf_free_list_bitmap and its head block is returned.
+ *
+ * Under SF_PLACEMENT_BEST_FIT the smallest fitting block of the starting class is
+ * returned instead, or failing that the smallest block of the next non-empty class.
+ * Under SF_PLACEMENT_ADDRESS_ORDERED the lists are sorted by address, so the same
+ * first-fit search returns the lowest-addressed fitting block.
+ *
+ * Under TLSF the search is good-fit instead: the request is rounded up to the next
+ * class boundary, so the head of the first non-empty class from there fits in O(1).
+ * The request's own class is only walked as a fallback when nothing larger is free.
+ */
+static sf_block* search_free_lists(size_t required_total_block_size)
+{
+    // Determine which list index is appropriate to start searching.
+    int starting_list_index = get_free_list_index_for_size(required_total_block_size);
+
+#ifdef TLSF
+    int search_index = get_free_list_search_index_for_size(required_total_block_size);
+    int found_index = find_nonempty_free_list_from(search_index);
+    if (found_index >= 0)
+        return FREE_LIST_HEADS[found_index].body.links.next;
+
+    return find_first_fit_in_free_list(starting_list_index, required_total_block_size);
+#else
+    if (sf_placement_policy == SF_PLACEMENT_BEST_FIT) {
+        sf_block* best_block = find_best_fit_in_free_list(starting_list_index, required_total_block_size);
+        if (best_block != NULL)
+            return best_block;
+
+        int next_index = find_nonempty_free_list_from(starting_list_index + 1);
+        if (next_index < 0)
+            return NULL;
+
+        return find_best_fit_in_free_list(next_index, 0);
+    }
+
+    // First-fit within the starting class.
+    sf_block* fitting_block = find_first_fit_in_free_list(starting_list_index, required_total_block_size);
+    if (fitting_block != NULL)
+        return fitting_block;
+
+    // Every block in a larger class is big enough; take the first non-empty one.
+    int next_index = find_nonempty_free_list_from(starting_list_index + 1);
+    if (next_index < 0)
+        return NULL;
+
+    return FREE_LIST_HEADS[next_index].body.links.next;
+#endif
+}
+
+/**
+ * Finds a free block of at least required_total_block_size (see search_free_lists).
+ * Under DEFERRED_COALESCING a failed search runs the pending coalescing pass and
+ * searches again, so the heap only grows when merged blocks do not fit either.
+ *
+ * @return The block, or NULL if none fits.
+ */
+sf_block* find_first_free_block_that_fits(size_t required_total_block_size)
+{
+    sf_block* fitting_block = search_free_lists(required_total_block_size);
+
+#ifdef DEFERRED_COALESCING
+    if (fitting_block == NULL && sf_deferred_free_bytes > 0) {
+        coalesce_deferred_frees();
+        fitting_block = search_free_lists(required_total_block_size);
+    }
+#endif
+
+    return fitting_block;
+}
+
+/**
+ * Insert a free block into the appropriate free list, setting up header/footer,
+ * then performing LIFO insertion at the head (in address order under
+ * SF_PLACEMENT_ADDRESS_ORDERED, plus the class's treap under SF_PLACEMENT_BEST_FIT).
+ */
+void insert_block_into_free_list(sf_block* free_block)
+{
+    // Decode the block's header to discover the size.
+    size_t header_unmasked = decode_header(free_block->header);
+    size_t block_size = header_unmasked & ~0xF;
+
+    // Re-encode the header as a free block (no flags set apart from PREV_BLOCK_ALLOCATED).
+    size_t new_header = encode_header(block_size | (header_unmasked & PREV_BLOCK_ALLOCATED));
+    free_block->header = new_header;
+
+    // Write matching footer (same encoded value).
+    sf_footer* footer = (sf_footer*)((char*)free_block + block_size - 8);
+    *footer = free_block->header;
+
+    // Identify which free list this block belongs in.
+    int index = get_free_list_index_for_size(block_size);
+    sf_block* sentinel = &FREE_LIST_HEADS[index];
+
+    // LIFO insertion at the head of the chosen free list, or after the last lower address.
+    sf_block* predecessor = sentinel;
+    if (sf_placement_policy == SF_PLACEMENT_ADDRESS_ORDERED) {
+        while (predecessor->body.links.next != sentinel && predecessor->body.links.next < free_block)
+            predecessor = predecessor->body.links.next;
+    }
+    free_block->body.links.next = predecessor->body.links.next;
+    free_block->body.links.prev = predecessor;
+    predecessor->body.links.next->body.links.prev = free_block;
+    predecessor->body.links.next = free_block;
+
+    if (sf_placement_policy == SF_PLACEMENT_BEST_FIT && index >= FIT_TREE_MIN_CLASS)
+        insert_block_into_fit_tree(free_block, block_size, index);
+
+    // This class is now known to be non-empty.
+    set_free_list_nonempty(index);
+}
+
+/**
+ * If a free block is big enough for the requested block + leftover >= 32,
+ * we split the block:
+ *   - Carve out a new free block from leftover
+ *   - Insert leftover block
+ *   - Mark the original portion as allocated with the correct payload in the upper bits
+ */
+void split_free_block_if_necessary(sf_block* free_block, size_t needed_size)
+{
+    // Decode size of the free block.
+    size_t free_block_header_unmasked = decode_header(free_block->header);
+    size_t free_block_total_size = free_block_header_unmasked & ~0xF;
+
+    // Calculate leftover if we carve out needed_size from this free block.
+    size_t remaining_block_size = free_block_total_size - needed_size;
+
+    // If leftover is too small (< 32 bytes), do not split.
+    if (remaining_block_size < 32)
+        return;
+    STAT_INC(splits);
+
+    // Create a new free block from leftover space.
+    sf_block* new_free_block = (sf_block*)((char*)free_block + needed_size);
+    uint64_t new_free_header = ((uint64_t)0 << 32) | remaining_block_size | PREV_BLOCK_ALLOCATED;
+    new_free_block->header = encode_header(new_free_header);
+
+    // Write footer for the new free block.
+    sf_footer* new_free_footer = (sf_footer*)((char*)new_free_block + remaining_block_size - 8);
+    *new_free_footer = new_free_block->header; // encoded
+
+    // Insert the new free block into the free list.
     insert_block_into_free_list(new_free_block);
 
     // Mark the original portion as allocated, storing payload in top 32 bits
-    size_t payload_size = needed_size - 16;
-    uint64_t alloc_header = ((uint64_t)payload_size << 32) | (needed_size | THIS_BLOCK_ALLOCATED);
-    free_block->header = alloc_header ^ MAGIC;
+    size_t payload_size = needed_size - ALLOCATED_BLOCK_OVERHEAD;
+    uint64_t alloc_header = ((uint64_t)payload_size << 32) | (needed_size | THIS_BLOCK_ALLOCATED) |
+                            (free_block_header_unmasked & PREV_BLOCK_ALLOCATED);
+    free_block->header = encode_header(alloc_header);
 
     // Write the footer for the allocated portion
-    sf_footer* alloc_footer = (sf_footer*)((char*)free_block + needed_size - 8);
-    *alloc_footer = free_block->header; // encoded
+    write_allocated_footer(free_block, needed_size);
 }
 
 /**
  * Unlinks a free block from its circular list. If block wasn't in a list or pointers
  * are invalid, we call abort(). This is needed before allocating or coalescing.
+ * Under SF_PLACEMENT_BEST_FIT the block's header must still hold its free size,
+ * which says whether it is also in a treap.
  */
 void remove_block_from_free_list(sf_block* block_to_remove)
 {
     if (block_to_remove == NULL)
         abort();
 
+    if (sf_placement_policy == SF_PLACEMENT_BEST_FIT) {
+        size_t block_size = decode_header(block_to_remove->header) & 0xFFFFFFFF & ~0xF;
+        int index = get_free_list_index_for_size(block_size);
+        if (index >= FIT_TREE_MIN_CLASS)
+            remove_block_from_fit_tree(block_to_remove, index);
+    }
+
     sf_block* previous_block = block_to_remove->body.links.prev;
     sf_block* next_block = block_to_remove->body.links.next;
 
@@ -678,6 +2114,16 @@ void remove_block_from_free_list(sf_block* block_to_remove)
     {
         next_block->body.links.prev = previous_block;
     }
+
+    // If only the sentinel is left, the class became empty: clear its bitmap bit.
+    // The sentinel's position is used rather than the block's header, because callers
+    // such as sf_malloc may already have rewritten the header (e.g. after a split).
+    if (previous_block == next_block &&
+        previous_block >= &FREE_LIST_HEADS[0] &&
+        previous_block < &FREE_LIST_HEADS[FREE_LIST_COUNT])
+    {
+        set_free_list_empty((int)(previous_block - &FREE_LIST_HEADS[0]));
+    }
 }
 
 /**
@@ -688,28 +2134,30 @@ void remove_block_from_free_list(sf_block* block_to_remove)
 void mark_block_as_allocated(sf_block* allocated_block, size_t final_size, size_t requested_payload_size)
 {
     // Decode header to preserve IN_QUICK_LIST if set
-    uint64_t unmasked_header = allocated_block->header ^ MAGIC;
+    uint64_t unmasked_header = decode_header(allocated_block->header);
     uint32_t lower = (uint32_t)(unmasked_header & 0xFFFFFFFF);
     uint32_t flags = lower & 0xF; // preserve flag bits (including IN_QUICK_LIST)
 
     // Rebuild & encode
     uint64_t new_header = ((uint64_t)requested_payload_size << 32) |
-                          (final_size | (flags & IN_QUICK_LIST) | THIS_BLOCK_ALLOCATED);
-    allocated_block->header = new_header ^ MAGIC;
+                          (final_size | (flags & (IN_QUICK_LIST | PREV_BLOCK_ALLOCATED)) | THIS_BLOCK_ALLOCATED);
+    allocated_block->header = encode_header(new_header);
 
-    // Write a matching footer (allocated design requires footers)
-    sf_footer* footer = (sf_footer*)((char*)allocated_block + final_size - 8);
-    *footer = allocated_block->header;
+    // Write a matching footer (allocated design requires footers unless they are elided)
+    write_allocated_footer(allocated_block, final_size);
 
-    // Clear IN_QUICK_LIST in next block if it exists
+    // Record in the next block that its predecessor is allocated. Its IN_QUICK_LIST bit
+    // is left alone: a cached successor keeps it, and a thread cache may own that header.
     sf_block* next_block = (sf_block*)((char*)allocated_block + final_size);
-    if ((void*)next_block < sf_mem_end()) {
-        uint64_t next_unmasked = next_block->header ^ MAGIC;
-        next_unmasked &= ~IN_QUICK_LIST;
-        next_block->header = next_unmasked ^ MAGIC;
-    }
+    if ((void*)next_block < sf_mem_end())
+        set_prev_allocated_bit(next_block, 1);
 
-    // Update usage stats
+    // The block and the header of any leftover behind it are in use again.
+    note_heap_reuse((char*)allocated_block + final_size + FREE_BLOCK_METADATA_SIZE);
+
+    // Update usage stats (the block came off a free list, so it counts from scratch)
+    sf_allocated_payload += requested_payload_size;
+    sf_allocated_block_size += final_size;
     sf_current_payload += requested_payload_size;
     if (sf_current_payload > sf_peak_payload)
         sf_peak_payload = sf_current_payload;
@@ -723,55 +2171,122 @@ void mark_block_as_allocated(sf_block* allocated_block, size_t final_size, size_
  */
 void* extend_heap_by_one_page()
 {
-    void* new_page_start = sf_mem_grow();
-    if (new_page_start == NULL)
+    return extend_heap_by_pages(1);
+}
+
+void* extend_heap_by_pages(size_t num_pages)
+{
+    // sf_mem_grow() hands out one page per call, but the new pages are
+    // contiguous, so they are merged into a single free block afterwards.
+    char* old_heap_end = sf_mem_end();
+    size_t pages_added = 0;
+    while (pages_added < num_pages && sf_mem_grow() != NULL)
+        pages_added++;
+
+    if (pages_added == 0)
     {
         sf_errno = ENOMEM;
         return NULL;
     }
+    STAT_INC(heap_grow_calls);
+    STAT_ADD(heap_pages_grown, pages_added);
 
-    // The new free block starts at the beginning of the newly added page minus 8,
+    // The new free block starts 8 bytes before the old heap end,
     // effectively overlapping the old epilogue.
-    sf_block* new_free_block = (sf_block*)((char*)new_page_start - 8);
-    size_t new_block_size = PAGE_SZ;
+    sf_block* new_free_block = (sf_block*)(old_heap_end - 8);
+    size_t new_block_size = pages_added * PAGE_SZ;
 
-    // Check if the block just before this new page is free, then merge if possible.
-    sf_block* prev_block = (sf_block*)((char*)new_free_block - 8);
-    size_t prev_block_size = 0;
+    // Check if the block just before the new pages is free, then merge if possible.
+    // The old epilogue's header still describes that predecessor.
+    sf_block* prev_block = NULL;
+    size_t prev_block_size = get_free_predecessor_size(new_free_block);
+    size_t prev_alloc_flag = PREV_BLOCK_ALLOCATED;
 
-    size_t prev_header_unmasked = prev_block->header ^ MAGIC;
-    if (!(prev_header_unmasked & THIS_BLOCK_ALLOCATED))
+    if (prev_block_size != 0)
     {
         // If the previous block is free, remove it & combine sizes
-        prev_block_size = prev_header_unmasked & ~0xF;
         prev_block = (sf_block*)((char*)new_free_block - prev_block_size);
+        prev_alloc_flag = decode_header(prev_block->header) & PREV_BLOCK_ALLOCATED;
         new_block_size += prev_block_size;
         remove_block_from_free_list(prev_block);
-    }
-    else
-    {
-        // Otherwise, no merge
-        prev_block = NULL;
+        STAT_INC(coalesces);
     }
 
     // final_free_block references the entire free region
     sf_block* final_free_block = (prev_block != NULL) ? prev_block : new_free_block;
-    final_free_block->header = (new_block_size) ^ MAGIC;
+    final_free_block->header = encode_header(new_block_size | prev_alloc_flag);
 
     // Write footer for that large new free block
     sf_footer* footer = (sf_footer*)((char*)final_free_block + new_block_size - 8);
     *footer = final_free_block->header; // encoded
 
-    // Create a new epilogue at the end of the extended heap.
+    // Create a new epilogue at the end of the extended heap (its predecessor is free).
     sf_block* new_epilogue = (sf_block*)((char*)sf_mem_end() - 8);
     size_t epilogue_val = (8 | THIS_BLOCK_ALLOCATED);
-    new_epilogue->header = epilogue_val ^ MAGIC;
+    new_epilogue->header = encode_header(epilogue_val);
+
+    // The page that held the old epilogue is now inside the tail free block.
+    sf_tail_decommitted = NULL;
+
+    // The new pages are zero-filled past the new block's metadata. A zero-filled
+    // run in the old tail continues over them once the old footer and epilogue
+    // it absorbed are cleared.
+    if (prev_block == NULL)
+        sf_tail_zeroed = (char*)new_free_block + FREE_BLOCK_METADATA_SIZE;
+    else if (sf_tail_zeroed != NULL)
+        memset(old_heap_end - 16, 0, 16);
+    else if ((char*)prev_block + FREE_BLOCK_METADATA_SIZE > old_heap_end)
+        sf_tail_zeroed = (char*)prev_block + FREE_BLOCK_METADATA_SIZE;
+    else
+        sf_tail_zeroed = old_heap_end;
 
     // Insert the merged free block into the free list
     insert_block_into_free_list(final_free_block);
     return final_free_block;
 }
 
+/**
+ * Grows the main heap just enough to hold a block of required_block_size.
+ *
+ * A free block at the end of the heap merges with the new pages, so only the
+ * remainder is requested. Under HEAP_GROWTH_GEOMETRIC the heap grows by at
+ * least its current size; pages beyond the minimum are best-effort.
+ *
+ * @return The merged free block if it fits the request, NULL otherwise.
+ */
+static sf_block* grow_heap_to_fit(size_t required_block_size)
+{
+    char* heap_end = sf_mem_end();
+
+    // The epilogue's predecessor is the last block in the heap.
+    size_t tail_free_size = get_free_predecessor_size((sf_block*)(heap_end - 8));
+
+    size_t shortfall = (required_block_size > tail_free_size) ? required_block_size - tail_free_size : 0;
+    size_t min_pages = (shortfall + PAGE_SZ - 1) / PAGE_SZ;
+    if (min_pages == 0)
+        min_pages = 1;
+
+    size_t num_pages = min_pages;
+    int saved_errno = sf_errno;
+#ifdef HEAP_GROWTH_GEOMETRIC
+    size_t heap_pages = (size_t)(heap_end - (char*)sf_mem_start()) / PAGE_SZ;
+    if (num_pages < heap_pages)
+        num_pages = heap_pages;
+#endif
+
+    sf_block* grown_block = extend_heap_by_pages(num_pages);
+    if (grown_block == NULL)
+        return NULL;
+
+    size_t grown_size = decode_header(grown_block->header) & 0xFFFFFFFF & ~0xF;
+    if (grown_size < required_block_size)
+        return NULL;
+
+    // Extra geometric pages were optional; only the minimum had to succeed.
+    sf_errno = saved_errno;
+    return grown_block;
+}
+
 /**
  * Coalesces adjacent free blocks around target_free_block if possible.
  * This merges free blocks in memory order to create a larger free block.
@@ -781,103 +2296,2940 @@ void* extend_heap_by_one_page()
  */
 sf_block* coalesce_adjacent_free_blocks(sf_block* target_free_block)
 {
-    if (target_free_block == NULL)
+    if (SF_UNLIKELY(target_free_block == NULL))
         abort();
 
     // Decode header to get original size
-    uint64_t decoded_header = target_free_block->header ^ MAGIC;
+    uint64_t decoded_header = decode_header(target_free_block->header);
     uint32_t lower_bits = (uint32_t)(decoded_header & 0xFFFFFFFF);
     size_t original_size = lower_bits & ~0xF;
 
-    if (original_size < 32 || original_size % 16 != 0)
+    if (SF_UNLIKELY(original_size < 32 || original_size % 16 != 0))
         abort();
 
+    // The successor's header does not depend on the predecessor, so its miss
+    // overlaps the predecessor's footer read and list removal.
+    SF_PREFETCH((char*)target_free_block + original_size);
+
     sf_block* base_block = target_free_block;
     size_t total_size = original_size;
 
+    size_t prev_alloc_flag = lower_bits & PREV_BLOCK_ALLOCATED;
+
     // Attempt to coalesce with a free predecessor block
     if ((char *)base_block > (char *)sf_mem_start() + 32) {
-        sf_footer* prev_footer = (sf_footer *)((char*)base_block - 8);
-        if ((void*)prev_footer >= sf_mem_start()) {
-            uint64_t prev_footer_val = *prev_footer ^ MAGIC;
-            uint32_t prev_lower = (uint32_t)(prev_footer_val & 0xFFFFFFFF);
-            size_t prev_size = prev_lower & ~0xF;
-
-            if (prev_size >= 32 && prev_size % 16 == 0 && !(prev_lower & THIS_BLOCK_ALLOCATED)) {
-                sf_block* prev_block = (sf_block*)((char*)base_block - prev_size);
-                remove_block_from_free_list(prev_block);
-                base_block = prev_block;
-                total_size += prev_size;
-            }
+        size_t prev_size = get_free_predecessor_size(base_block);
+
+        if (prev_size >= 32 && prev_size % 16 == 0) {
+            sf_block* prev_block = (sf_block*)((char*)base_block - prev_size);
+            remove_block_from_free_list(prev_block);
+            prev_alloc_flag = decode_header(prev_block->header) & PREV_BLOCK_ALLOCATED;
+            base_block = prev_block;
+            total_size += prev_size;
+            STAT_INC(coalesces);
         }
     }
 
     // Attempt to coalesce with a free successor block
     sf_block* next_block = (sf_block*)((char*)base_block + total_size);
     if ((void*)next_block + 8 <= sf_mem_end()) {
-        uint64_t next_decoded_header = next_block->header ^ MAGIC;
+        uint64_t next_decoded_header = decode_header(next_block->header);
         uint32_t next_lower = (uint32_t)(next_decoded_header & 0xFFFFFFFF);
         size_t next_size = next_lower & ~0xF;
 
         if (next_size >= 32 && next_size % 16 == 0 && !(next_lower & THIS_BLOCK_ALLOCATED)) {
             remove_block_from_free_list(next_block);
             total_size += next_size;
+            STAT_INC(coalesces);
         }
     }
 
     // Encode new header and write it
-    uint64_t new_header = ((uint64_t)0 << 32) | total_size;
-    base_block->header = new_header ^ MAGIC;
+    uint64_t new_header = ((uint64_t)0 << 32) | total_size | prev_alloc_flag;
+    base_block->header = encode_header(new_header);
 
     // Write matching footer
     sf_footer* footer_loc = (sf_footer*)((char*)base_block + total_size - 8);
-    if ((void*)footer_loc < sf_mem_end()) {
+    if (SF_LIKELY((void*)footer_loc < sf_mem_end())) {
         *footer_loc = base_block->header; // encoded
     } else {
         abort();
     }
 
+    // The block after the coalesced region now follows a free block.
+    set_prev_allocated_bit((sf_block*)((char*)base_block + total_size), 0);
+
     return base_block;
 }
 
 /**
- * If a quick list is at capacity, flushes all blocks from it into the main free list.
- * Each block is first unmarked from ALLOC & QUICK bits, then coalesced and inserted.
+ * Inserts a block that has just been marked free into the free lists, after
+ * coalescing it with its neighbours. Under DEFERRED_COALESCING it is inserted
+ * as it is instead, and a coalescing pass runs once enough bytes have been
+ * freed that way.
+ */
+static void insert_freed_block(sf_block* block)
+{
+#ifdef DEFERRED_COALESCING
+    // Drop the payload kept in the header, as coalescing would have.
+    uint64_t header = decode_header(block->header);
+    size_t block_size = header & 0xFFFFFFFF & ~0xF;
+    block->header = encode_header(block_size | (header & PREV_BLOCK_ALLOCATED));
+    set_prev_allocated_bit((sf_block*)((char*)block + block_size), 0);
+    insert_block_into_free_list(block);
+
+    sf_deferred_free_bytes += block_size;
+    if (sf_deferred_free_bytes >= DEFERRED_COALESCING_BYTES)
+        coalesce_deferred_frees();
+#else
+    sf_block* coalesced = coalesce_adjacent_free_blocks(block);
+    if (coalesced == NULL)
+        abort();
+
+    insert_block_into_free_list(coalesced);
+#endif
+}
+
+/**
+ * Flushes all blocks from a quick list into the main free list.
  */
 static void flush_quick_list(int ql_index)
 {
-    while (sf_quick_lists[ql_index].length > 0) {
-        sf_block* block = sf_quick_lists[ql_index].first;
-        sf_quick_lists[ql_index].first = block->body.links.next;
-        sf_quick_lists[ql_index].length--;
+    evict_from_quick_list(ql_index, QUICK_LISTS[ql_index].length);
+}
 
-        // Decode existing header
-        size_t encoded_header = block->header;
-        size_t decoded_header = encoded_header ^ MAGIC;
+/**
+ * Evicts the `count` oldest blocks of a quick list (the tail of the LIFO list).
+ * They are sorted by address so that each run of adjacent blocks becomes one free
+ * block, which is then coalesced with its neighbours and inserted once. Blocks are
+ * handled QUICK_LIST_EVICT_BATCH at a time to bound the stack used for sorting.
+ */
+#define QUICK_LIST_EVICT_BATCH 32
 
-        // Convert it to a free block header (clear ALLOC & QUICK bits)
-        size_t block_size = decoded_header & ~0xF;
-        size_t free_header = block_size ^ MAGIC;
-        block->header = free_header;
+static void evict_from_quick_list(int ql_index, int count)
+{
+    if (count > QUICK_LISTS[ql_index].length)
+        count = QUICK_LISTS[ql_index].length;
+    if (count <= 0)
+        return;
+    STAT_INC(quick_list_flushes);
+
+    // Detach the tail: the first (length - count) blocks stay cached.
+    int keep = QUICK_LISTS[ql_index].length - count;
+    sf_block* evicted;
+    if (keep == 0) {
+        evicted = QUICK_LISTS[ql_index].first;
+        QUICK_LISTS[ql_index].first = NULL;
+    } else {
+        sf_block* last_kept = QUICK_LISTS[ql_index].first;
+        for (int i = 1; i < keep; i++)
+            last_kept = last_kept->body.links.next;
+        evicted = last_kept->body.links.next;
+        last_kept->body.links.next = NULL;
+    }
+    QUICK_LISTS[ql_index].length = keep;
+
+    size_t block_size = 32 + 16 * (size_t)ql_index;
+    while (evicted != NULL) {
+        void* blocks[QUICK_LIST_EVICT_BATCH];
+        size_t n = 0;
+        while (evicted != NULL && n < QUICK_LIST_EVICT_BATCH) {
+            blocks[n++] = evicted;
+            evicted = evicted->body.links.next;
+        }
+        sort_by_address(blocks, n);
+
+        for (size_t i = 0; i < n; ) {
+            sf_block* run_start = blocks[i];
+            size_t run_size = 0;
+
+            // Extend the run while the next block starts where this one ends.
+            do {
+                sf_allocated_payload -= get_payload_size(blocks[i]);
+                run_size += block_size;
+                i++;
+            } while (i < n && (char*)blocks[i] == (char*)run_start + run_size);
+
+            sf_allocated_block_size -= run_size;
+#ifdef ADAPTIVE_QUICK_LISTS
+            QUICK_LIST_TUNING->cached_bytes -= run_size;
+#endif
+            STAT_ADD(coalesces, run_size / block_size - 1);
+
+            // Clear ALLOC & QUICK bits and the payload; keep the predecessor's state.
+            uint64_t free_header = run_size | (decode_header(run_start->header) & PREV_BLOCK_ALLOCATED);
+            run_start->header = encode_header(free_header);
+            sf_footer* footer = (sf_footer*)((char*)run_start + run_size - 8);
+            if ((void*)footer < sf_mem_start() || (void*)footer >= sf_mem_end())
+                abort();
+            *footer = run_start->header;
+
+            // Coalesce with the surrounding free blocks (unless deferred) and insert.
+            insert_freed_block(run_start);
+        }
+    }
+}
 
-        // Write the matching footer
-        sf_footer* footer = (sf_footer*)((char*)block + block_size - 8);
-        if ((void*)footer >= sf_mem_start() && (void*)footer < sf_mem_end())
-            *footer = block->header; // already encoded
-        else
-            abort();
+/**
+ * Pops the most recently cached block off a quick list (LIFO).
+ * The block keeps its encoded header; the caller decides how to re-mark it.
+ *
+ * @param quick_list_idx Index into sf_quick_lists[].
+ * @return The popped block, or NULL if the quick list is empty.
+ */
+sf_block* pop_block_from_quick_list(int quick_list_idx)
+{
+    if (quick_list_idx < 0 || quick_list_idx >= NUM_QUICK_LISTS)
+        return NULL;
+
+    sf_block* block = QUICK_LISTS[quick_list_idx].first;
+    if (block == NULL)
+        return NULL;
+
+    QUICK_LISTS[quick_list_idx].first = block->body.links.next;
+    QUICK_LISTS[quick_list_idx].length--;
+#ifdef ADAPTIVE_QUICK_LISTS
+    QUICK_LIST_TUNING->cached_bytes -= 32 + 16 * (size_t)quick_list_idx;
+#endif
+    return block;
+}
+
+/**
+ * Unlinks a specific block from the active heap's quick list for its size. Blocks
+ * held by a thread cache are never on these lists, so they are not found.
+ *
+ * @return 1 if the block was found and removed, 0 otherwise.
+ */
+static int remove_block_from_quick_list(sf_block* block, size_t block_size)
+{
+    int ql_index = (block_size - 32) / 16;
+    if (ql_index < 0 || ql_index >= NUM_QUICK_LISTS)
+        return 0;
+
+    for (sf_block** link = &QUICK_LISTS[ql_index].first; *link != NULL; link = &(*link)->body.links.next) {
+        if (*link == block) {
+            *link = block->body.links.next;
+            QUICK_LISTS[ql_index].length--;
+#ifdef ADAPTIVE_QUICK_LISTS
+            QUICK_LIST_TUNING->cached_bytes -= block_size;
+#endif
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Marks a block as allocated & in quick list (still counted as allocated, with
+ * payload_size as its payload) and pushes it onto the head of the list (LIFO).
+ * The caller has checked that the list has room.
+ */
+void push_block_onto_quick_list(int quick_list_idx, sf_block* block, size_t block_size, size_t payload_size)
+{
+    sf_allocated_payload += payload_size - get_payload_size(block);
+    uint64_t new_header = ((uint64_t)payload_size << 32) |
+                          (block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST) |
+                          (decode_header(block->header) & PREV_BLOCK_ALLOCATED);
+    block->header = encode_header(new_header);
+
+    // Write footer to match.
+    write_allocated_footer(block, block_size);
+
+    block->body.links.next = QUICK_LISTS[quick_list_idx].first;
+    QUICK_LISTS[quick_list_idx].first = block;
+    QUICK_LISTS[quick_list_idx].length++;
+#ifdef ADAPTIVE_QUICK_LISTS
+    QUICK_LIST_TUNING->cached_bytes += block_size;
+#endif
+}
+
+/**
+ * Returns how many blocks a quick list of the active heap may hold: QUICK_LIST_MAX,
+ * or the class's current capacity with ADAPTIVE_QUICK_LISTS.
+ */
+static int get_quick_list_capacity(int ql_index)
+{
+#ifdef ADAPTIVE_QUICK_LISTS
+    return QUICK_LIST_TUNING->capacity[ql_index];
+#else
+    (void)ql_index;
+    return QUICK_LIST_MAX;
+#endif
+}
+
+#ifdef ADAPTIVE_QUICK_LISTS
+/**
+ * Called when a quick-list-sized malloc finds its list empty. If the list was
+ * flushed for overflow since its last miss, the flushed blocks were wanted after
+ * all, so the class may cache twice as many.
+ */
+static void note_quick_list_miss(int ql_index)
+{
+    if (QUICK_LIST_TUNING->flushed[ql_index]) {
+        int capacity = 2 * QUICK_LIST_TUNING->capacity[ql_index];
+        QUICK_LIST_TUNING->capacity[ql_index] =
+            capacity < QUICK_LIST_MAX_CAPACITY ? capacity : QUICK_LIST_MAX_CAPACITY;
+        QUICK_LIST_TUNING->flushed[ql_index] = 0;
+    }
+    note_quick_list_operation();
+}
 
-        // Coalesce adjacent free blocks, insert into free list
-        block = coalesce_adjacent_free_blocks(block);
-        insert_block_into_free_list(block);
+/**
+ * Counts a quick-list hit, miss or free. Every QUICK_LIST_SWEEP_INTERVAL of them,
+ * classes whose cached blocks saw no hits since the previous sweep are flushed and
+ * their capacity halved.
+ */
+static void note_quick_list_operation()
+{
+    if (++QUICK_LIST_TUNING->ops_since_sweep < QUICK_LIST_SWEEP_INTERVAL)
+        return;
+    QUICK_LIST_TUNING->ops_since_sweep = 0;
+
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        if (QUICK_LISTS[i].length > 0 && !QUICK_LIST_TUNING->reused[i]) {
+            flush_quick_list(i);
+            int capacity = QUICK_LIST_TUNING->capacity[i] / 2;
+            QUICK_LIST_TUNING->capacity[i] =
+                capacity > QUICK_LIST_MIN_CAPACITY ? capacity : QUICK_LIST_MIN_CAPACITY;
+            QUICK_LIST_TUNING->flushed[i] = 0;
+        }
+        QUICK_LIST_TUNING->reused[i] = 0;
     }
 }
+#endif
 
 /**
  * Retrieves the payload size (user-requested) from the top 32 bits of a block's header.
  */
 size_t get_payload_size(const sf_block* block)
 {
-    uint64_t header = block->header ^ MAGIC;
+    uint64_t header = decode_header(block->header);
     return header >> 32;
 }
+
+/**
+ * Returns the size of the block just before `block` if that block is free, or 0.
+ * With FOOTER_ELISION the predecessor's footer only exists when it is free, so
+ * PREV_BLOCK_ALLOCATED is checked before the footer is read.
+ */
+size_t get_free_predecessor_size(const sf_block* block)
+{
+#ifdef FOOTER_ELISION
+    if (decode_header(block->header) & PREV_BLOCK_ALLOCATED)
+        return 0;
+#endif
+    uint64_t prev_footer = decode_header(*(const sf_footer*)((const char*)block - 8));
+    if (prev_footer & THIS_BLOCK_ALLOCATED)
+        return 0;
+    return prev_footer & 0xFFFFFFFF & ~0xF;
+}
+
+/**
+ * Records in `block`'s header whether the block before it is allocated. A free
+ * block's footer is kept identical to its header. No-op without FOOTER_ELISION.
+ */
+void set_prev_allocated_bit(sf_block* block, int prev_allocated)
+{
+#ifdef FOOTER_ELISION
+    uint64_t header = decode_header(block->header);
+    header = prev_allocated ? (header | PREV_BLOCK_ALLOCATED) : (header & ~(uint64_t)PREV_BLOCK_ALLOCATED);
+    block->header = encode_header(header);
+
+    if (!(header & THIS_BLOCK_ALLOCATED)) {
+        size_t block_size = header & 0xFFFFFFFF & ~0xF;
+        *(sf_footer*)((char*)block + block_size - 8) = block->header;
+    }
+#else
+    (void)block;
+    (void)prev_allocated;
+#endif
+}
+
+/**
+ * Copies an allocated block's header into its footer. With FOOTER_ELISION the
+ * footer row belongs to the payload instead, so nothing is written.
+ */
+void write_allocated_footer(sf_block* block, size_t block_size)
+{
+#ifndef FOOTER_ELISION
+    sf_footer* footer = (sf_footer*)((char*)block + block_size - 8);
+    *footer = block->header; // already encoded
+#else
+    (void)block;
+    (void)block_size;
+#endif
+}
+
+/* ========================================================================
+ * ARENAS
+ * ========================================================================
+ * An arena is an independent heap with its own free lists, quick lists,
+ * counters and stats. Its memory comes from the main heap in chunks (each
+ * chunk is one large allocated block there). Every chunk is laid out like
+ * the main heap, with an unused first row, a prologue, blocks and an
+ * epilogue, so the shared helpers never coalesce across chunk boundaries.
+ * The unused first row links the chunk to the next chunk of the arena.
+ *
+ * To run the shared helpers against an arena, enter_arena() points the
+ * active list arrays at the arena and swaps its scalars into the globals;
+ * leave_arena() undoes that.
+ * ======================================================================*/
+
+static void enter_arena(sf_arena* arena)
+{
+    sf_main_heap_state.free_list_bitmap = sf_free_list_bitmap;
+    sf_main_heap_state.current_payload = sf_current_payload;
+    sf_main_heap_state.peak_payload = sf_peak_payload;
+    sf_main_heap_state.quick_list_hits = sf_quick_list_hits;
+    sf_main_heap_state.quick_list_misses = sf_quick_list_misses;
+    sf_main_heap_state.allocated_payload = sf_allocated_payload;
+    sf_main_heap_state.allocated_block_size = sf_allocated_block_size;
+
+    sf_free_list_bitmap = arena->free_list_bitmap;
+    sf_current_payload = arena->current_payload;
+    sf_peak_payload = arena->peak_payload;
+    sf_quick_list_hits = arena->quick_list_hits;
+    sf_quick_list_misses = arena->quick_list_misses;
+    sf_allocated_payload = arena->allocated_payload;
+    sf_allocated_block_size = arena->allocated_block_size;
+#ifdef DEFERRED_COALESCING
+    sf_main_heap_state.deferred_free_bytes = sf_deferred_free_bytes;
+    sf_deferred_free_bytes = arena->deferred_free_bytes;
+#endif
+
+    sf_active_free_list_heads = arena->free_list_heads;
+    sf_active_fit_tree_roots = arena->fit_tree_roots;
+    sf_active_quick_lists = arena->quick_lists;
+#ifdef ADAPTIVE_QUICK_LISTS
+    sf_active_quick_list_tuning = &arena->quick_list_tuning;
+#endif
+#ifdef TLSF
+    sf_active_sl_bitmap = arena->sl_bitmap;
+#endif
+    sf_active_arena = arena;
+}
+
+static void leave_arena(sf_arena* arena)
+{
+    arena->free_list_bitmap = sf_free_list_bitmap;
+    arena->current_payload = sf_current_payload;
+    arena->peak_payload = sf_peak_payload;
+    arena->quick_list_hits = sf_quick_list_hits;
+    arena->quick_list_misses = sf_quick_list_misses;
+    arena->allocated_payload = sf_allocated_payload;
+    arena->allocated_block_size = sf_allocated_block_size;
+
+    sf_free_list_bitmap = sf_main_heap_state.free_list_bitmap;
+    sf_current_payload = sf_main_heap_state.current_payload;
+    sf_peak_payload = sf_main_heap_state.peak_payload;
+    sf_quick_list_hits = sf_main_heap_state.quick_list_hits;
+    sf_quick_list_misses = sf_main_heap_state.quick_list_misses;
+    sf_allocated_payload = sf_main_heap_state.allocated_payload;
+    sf_allocated_block_size = sf_main_heap_state.allocated_block_size;
+#ifdef DEFERRED_COALESCING
+    arena->deferred_free_bytes = sf_deferred_free_bytes;
+    sf_deferred_free_bytes = sf_main_heap_state.deferred_free_bytes;
+#endif
+
+    sf_active_free_list_heads = MAIN_FREE_LIST_HEADS;
+    sf_active_fit_tree_roots = sf_fit_tree_roots;
+    sf_active_quick_lists = sf_quick_lists;
+#ifdef ADAPTIVE_QUICK_LISTS
+    sf_active_quick_list_tuning = &sf_main_quick_list_tuning;
+#endif
+#ifdef TLSF
+    sf_active_sl_bitmap = sf_tlsf_sl_bitmap;
+#endif
+    sf_active_arena = NULL;
+}
+
+/**
+ * Returns the size of a chunk, i.e. the payload size of its block in the main heap.
+ */
+static size_t get_arena_chunk_size(char* chunk)
+{
+    return get_payload_size((sf_block*)(chunk - 8));
+}
+
+/**
+ * Allocates a new chunk for `arena` from the main heap, big enough to hold a block of
+ * required_block_size, formats it (link row, prologue, one free block, epilogue) and
+ * inserts its free block into the arena's free lists. The arena must be active.
+ *
+ * @return The chunk's free block, or NULL if the main heap is out of memory.
+ */
+static sf_block* add_chunk_to_arena(sf_arena* arena, size_t required_block_size)
+{
+    size_t chunk_size = ARENA_CHUNK_SIZE;
+    if (required_block_size + ARENA_CHUNK_OVERHEAD > chunk_size)
+        chunk_size = (required_block_size + ARENA_CHUNK_OVERHEAD + 15) & ~(size_t)0xF;
+
+    // The chunk itself is an ordinary block in the main heap. It is taken from the
+    // heap directly: sf_malloc() could map it, and a chunk must lie inside the heap.
+    leave_arena(arena);
+    sf_block* chunk_block = allocate_block_from_heap(calculate_aligned_block_size(chunk_size), chunk_size);
+    enter_arena(arena);
+    if (chunk_block == NULL)
+        return NULL;
+    char* chunk = chunk_block->body.payload;
+
+    // Link row: chain the chunk in front of the arena's other chunks.
+    *(char**)chunk = arena->chunks;
+    arena->chunks = chunk;
+    arena->heap_size += chunk_size;
+
+    // Prologue (header + footer), exactly as at the start of the main heap.
+    sf_block* prologue_block = (sf_block*)(chunk + 8);
+    prologue_block->header = encode_header(32 | THIS_BLOCK_ALLOCATED);
+    *(sf_footer*)((char*)prologue_block + 32 - 8) = prologue_block->header;
+
+    // Epilogue in the last row of the chunk.
+    sf_block* epilogue_block = (sf_block*)(chunk + chunk_size - 8);
+    epilogue_block->header = encode_header(8 | THIS_BLOCK_ALLOCATED);
+
+    // Everything in between is one free block.
+    sf_block* free_block = (sf_block*)((char*)prologue_block + 32);
+    free_block->header = encode_header((chunk_size - ARENA_CHUNK_OVERHEAD) | PREV_BLOCK_ALLOCATED);
+    insert_block_into_free_list(free_block);
+    return free_block;
+}
+
+/**
+ * Returns whether a block lies inside one of the arena's chunks.
+ */
+static int arena_owns_block(sf_arena* arena, sf_block* block)
+{
+    for (char* chunk = arena->chunks; chunk != NULL; chunk = *(char**)chunk) {
+        if ((char*)block >= chunk + 40 && (char*)block < chunk + get_arena_chunk_size(chunk) - 8)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Creates an empty arena with one chunk of ARENA_CHUNK_SIZE bytes.
+ *
+ * @return The new arena, or NULL with sf_errno = ENOMEM.
+ */
+sf_arena_t* sf_arena_create()
+{
+    LOCK_HEAP();
+
+    sf_arena* arena = sf_malloc(sizeof(sf_arena));
+    if (arena == NULL) {
+        UNLOCK_HEAP();
+        return NULL;
+    }
+    memset(arena, 0, sizeof(sf_arena));
+
+    enter_arena(arena);
+    initialize_all_free_list_sentinels();
+    initialize_all_quick_lists();
+    sf_block* first_block = add_chunk_to_arena(arena, 0);
+    leave_arena(arena);
+
+    if (first_block == NULL) {
+        sf_free(arena);
+        sf_errno = ENOMEM;
+        arena = NULL;
+    }
+
+    UNLOCK_HEAP();
+    return arena;
+}
+
+/**
+ * sf_malloc within an arena: same policy (quick lists, first fit, splitting), but
+ * served only from the arena's chunks, adding a chunk when nothing fits.
+ */
+void* sf_arena_malloc(sf_arena_t* arena, size_t size)
+{
+    if (arena == NULL) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if (size == 0)
+        return NULL;
+
+    size_t required_block_size = calculate_aligned_block_size(size);
+
+    LOCK_HEAP();
+    enter_arena(arena);
+    sf_block* block = allocate_block_from_heap(required_block_size, size);
+    leave_arena(arena);
+    UNLOCK_HEAP();
+
+    return (block != NULL) ? block->body.payload : NULL;
+}
+
+/**
+ * sf_free within an arena. Aborts if the pointer is not an allocated block of `arena`.
+ */
+void sf_arena_free(sf_arena_t* arena, void* pp)
+{
+    if (pp == NULL)
+        return;
+    if (arena == NULL)
+        abort();
+
+    sf_block* block = (sf_block*)((char*)pp - 8);
+
+    LOCK_HEAP();
+    if (!arena_owns_block(arena, block))
+        abort();
+
+    size_t payload_size, block_size;
+    decode_block_being_freed(block, &block_size, &payload_size);
+
+    enter_arena(arena);
+    sf_current_payload -= payload_size;
+    STAT_INC(free_count[get_stats_size_class(block_size)]);
+    release_block_to_heap(block, block_size, payload_size);
+    leave_arena(arena);
+    UNLOCK_HEAP();
+}
+
+/**
+ * Releases an arena and every block in it at once by returning its chunks (and the
+ * arena itself) to the main heap. Pointers into the arena become invalid.
+ */
+void sf_arena_destroy(sf_arena_t* arena)
+{
+    if (arena == NULL)
+        return;
+
+    LOCK_HEAP();
+    char* chunk = arena->chunks;
+    while (chunk != NULL) {
+        char* next_chunk = *(char**)chunk;
+        sf_free(chunk);
+        chunk = next_chunk;
+    }
+    sf_free(arena);
+    UNLOCK_HEAP();
+}
+
+/**
+ * sf_fragmentation for an arena: payload / block size over the arena's allocated
+ * blocks (including blocks cached on its quick lists), or 0.0 if there are none.
+ * Read from the arena's running totals, like sf_fragmentation().
+ */
+double sf_arena_fragmentation(sf_arena_t* arena)
+{
+    if (arena == NULL)
+        return 0.0;
+
+    LOCK_HEAP();
+    size_t total_payload = arena->allocated_payload;
+    size_t total_allocated_block_size = arena->allocated_block_size;
+    UNLOCK_HEAP();
+
+    if (total_allocated_block_size == 0)
+        return 0.0;
+
+    return (double)total_payload / (double)total_allocated_block_size;
+}
+
+/**
+ * sf_utilization for an arena: its peak payload divided by the total size of its chunks.
+ */
+double sf_arena_utilization(sf_arena_t* arena)
+{
+    if (arena == NULL)
+        return 0.0;
+
+    LOCK_HEAP();
+    size_t peak_payload = arena->peak_payload;
+    size_t heap_size = arena->heap_size;
+    UNLOCK_HEAP();
+
+    if (heap_size == 0)
+        return 0.0;
+
+    return (double)peak_payload / (double)heap_size;
+}
+
+/* ========================================================================
+ * BATCH ALLOCATION
+ * ========================================================================
+ * sf_malloc_batch carves many same-sized blocks out of one free region in a
+ * single pass: one search, one free-list removal, one leftover insert and
+ * one stats update per region instead of per block. sf_free_batch sorts the
+ * blocks by address so that runs of adjacent blocks are merged into a single
+ * free region, which is then coalesced and inserted once.
+ * ======================================================================*/
+
+/**
+ * Lays out `count` allocated blocks of block_size back to back at the start of
+ * the free block `region` (already removed from its free list). A remainder of
+ * at least 32 bytes becomes a new free block; a smaller one is absorbed by the
+ * last allocated block.
+ */
+static void carve_blocks_from_region(sf_block* region, size_t region_size, size_t block_size,
+                                     size_t requested_size, size_t count, void* out[])
+{
+    size_t leftover_size = region_size - count * block_size;
+    size_t prev_alloc_flag = decode_header(region->header) & PREV_BLOCK_ALLOCATED;
+    char* current = (char*)region;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t this_size = block_size;
+        if (i == count - 1 && leftover_size < 32)
+            this_size += leftover_size;
+
+        sf_block* block = (sf_block*)current;
+        uint64_t header = ((uint64_t)requested_size << 32) | this_size | THIS_BLOCK_ALLOCATED | prev_alloc_flag;
+        block->header = encode_header(header);
+        write_allocated_footer(block, this_size);
+
+        out[i] = block->body.payload;
+        sf_allocated_block_size += this_size;
+        STAT_INC(malloc_count[get_stats_size_class(this_size)]);
+        prev_alloc_flag = PREV_BLOCK_ALLOCATED;
+        current += this_size;
+    }
+
+    note_heap_reuse(current + FREE_BLOCK_METADATA_SIZE);
+    if (leftover_size >= 32) {
+        STAT_INC(splits);
+        sf_block* leftover_block = (sf_block*)current;
+        leftover_block->header = encode_header(leftover_size | PREV_BLOCK_ALLOCATED);
+        insert_block_into_free_list(leftover_block);
+    } else {
+        set_prev_allocated_bit((sf_block*)current, 1);
+    }
+}
+
+/**
+ * Allocates n blocks with a payload of `size` bytes each and stores their payload
+ * pointers in out[0..n-1]. Blocks are carved contiguously from as few free regions
+ * as possible; the heap is grown once for whatever the free lists cannot supply.
+ *
+ * @return The number of blocks allocated. If it is less than n, sf_errno is set to
+ *         ENOMEM and out[] holds the blocks that were allocated.
+ */
+size_t sf_malloc_batch(size_t size, size_t n, void* out[])
+{
+    if (size == 0 || n == 0 || out == NULL)
+        return 0;
+
+    // A block size field holds at most 28 bits, which also keeps the loop from overflowing.
+    if (size > UINT32_MAX || calculate_aligned_block_size(size) >= ((size_t)1 << 28)) {
+        sf_errno = ENOMEM;
+        return 0;
+    }
+    size_t block_size = calculate_aligned_block_size(size);
+    size_t allocated = 0;
+
+    LOCK_HEAP();
+    if (sf_mem_start() == sf_mem_end())
+        initialize_heap_during_first_call_to_sf_malloc();
+
+    while (allocated < n) {
+        size_t remaining = n - allocated;
+        size_t max_per_region = ((size_t)1 << 28) / block_size;
+        size_t wanted_size = (remaining < max_per_region ? remaining : max_per_region) * block_size;
+
+        // Prefer one region that holds the whole remainder, growing the heap for it;
+        // otherwise take whatever single block fits and carve as many as possible.
+        sf_block* region = find_first_free_block_that_fits(wanted_size);
+        if (region == NULL) {
+            int saved_errno = sf_errno;
+            region = grow_heap_to_fit(wanted_size);
+            sf_errno = saved_errno;
+        }
+        if (region == NULL)
+            region = find_first_free_block_that_fits(block_size);
+        if (region == NULL) {
+            sf_errno = ENOMEM;
+            break;
+        }
+
+        size_t region_size = decode_header(region->header) & 0xFFFFFFFF & ~0xF;
+        size_t count = region_size / block_size;
+        if (count > n - allocated)
+            count = n - allocated;
+        if (count == 0) {
+            sf_errno = ENOMEM;
+            break;
+        }
+
+        remove_block_from_free_list(region);
+        carve_blocks_from_region(region, region_size, block_size, size, count, out + allocated);
+        allocated += count;
+    }
+
+    // Usage stats are updated once for the whole batch.
+    sf_current_payload += allocated * size;
+    sf_allocated_payload += allocated * size;
+    if (sf_current_payload > sf_peak_payload)
+        sf_peak_payload = sf_current_payload;
+    UNLOCK_HEAP();
+
+#if defined(ALLOC_TRACE) || defined(ALLOC_PROFILE)
+    for (size_t i = 0; i < allocated; i++) {
+        TRACE_OP(SF_TRACE_MALLOC, out[i], NULL, size);
+        PROFILE_MALLOC(out[i], size);
+    }
+#endif
+    return allocated;
+}
+
+/**
+ * Restores the max-heap property below `root` for the first `end` pointers.
+ */
+static void sift_down_by_address(void* ptrs[], size_t root, size_t end)
+{
+    for (size_t child; (child = 2 * root + 1) < end; root = child) {
+        if (child + 1 < end && (char*)ptrs[child + 1] > (char*)ptrs[child])
+            child++;
+        if ((char*)ptrs[root] >= (char*)ptrs[child])
+            return;
+
+        void* tmp = ptrs[root];
+        ptrs[root] = ptrs[child];
+        ptrs[child] = tmp;
+    }
+}
+
+/**
+ * Sorts pointers by ascending address with an in-place heapsort, so that no
+ * memory is allocated and the stack depth stays constant.
+ */
+static void sort_by_address(void* ptrs[], size_t n)
+{
+    for (size_t i = n / 2; i-- > 0; )
+        sift_down_by_address(ptrs, i, n);
+
+    for (size_t end = n; end-- > 1; ) {
+        void* tmp = ptrs[0];
+        ptrs[0] = ptrs[end];
+        ptrs[end] = tmp;
+        sift_down_by_address(ptrs, 0, end);
+    }
+}
+
+/**
+ * Frees n blocks at once. NULL entries are skipped and ptrs[] is reordered by
+ * address. Each maximal run of adjacent blocks becomes a single free region that
+ * is coalesced with its neighbours and inserted into the free lists once; a block
+ * with no batch neighbours is released exactly as sf_free would (small ones go to
+ * their quick list). Calls abort() on an invalid or repeated pointer.
+ */
+void sf_free_batch(void* ptrs[], size_t n)
+{
+    if (ptrs == NULL || n == 0)
+        return;
+
+#ifdef MMAP_THRESHOLD
+    // Mapped blocks have no heap neighbours; unmap them and drop them from the batch.
+    for (size_t i = 0; i < n; i++) {
+        sf_mapped_region* region = find_mapped_region(ptrs[i]);
+        if (region != NULL) {
+            TRACE_OP(SF_TRACE_FREE, ptrs[i], NULL, 0);
+            PROFILE_FREE(ptrs[i]);
+            LOCK_HEAP();
+            release_mapped_block(region);
+            UNLOCK_HEAP();
+            ptrs[i] = NULL;
+        }
+    }
+#endif
+
+#ifdef SLAB_ALLOCATOR
+    // Slots are not heap blocks; return them to their runs first.
+    for (size_t i = 0; i < n; i++) {
+        sf_slab_run* run = find_slab_run(ptrs[i]);
+        if (run != NULL) {
+            TRACE_OP(SF_TRACE_FREE, ptrs[i], NULL, 0);
+            PROFILE_FREE(ptrs[i]);
+            LOCK_HEAP();
+            release_to_slab(run, ptrs[i]);
+            UNLOCK_HEAP();
+            ptrs[i] = NULL;
+        }
+    }
+#endif
+
+    sort_by_address(ptrs, n);
+
+    // Validate everything before touching the heap, so a bad pointer leaves it intact.
+    // The lock is taken first so no other thread can change the headers in between.
+    LOCK_HEAP();
+    size_t first = 0;
+    while (first < n && ptrs[first] == NULL)
+        first++;
+    for (size_t i = first; i < n; i++) {
+        sf_block* block = (sf_block*)((char*)ptrs[i] - 8);
+        size_t payload_size, block_size;
+        decode_block_being_freed(block, &block_size, &payload_size);
+
+        if ((void*)block < sf_mem_start() || (void*)block >= sf_mem_end())
+            abort();
+        if (i > first && ptrs[i] == ptrs[i - 1])
+            abort(); // freed twice in the same batch
+    }
+
+#if defined(ALLOC_TRACE) || defined(ALLOC_PROFILE)
+    for (size_t i = first; i < n; i++) {
+        TRACE_OP(SF_TRACE_FREE, ptrs[i], NULL, 0);
+        PROFILE_FREE(ptrs[i]);
+    }
+#endif
+
+    size_t max_quick_size = 32 + 16 * (NUM_QUICK_LISTS - 1);
+
+    for (size_t i = first; i < n; ) {
+        sf_block* run_start = (sf_block*)((char*)ptrs[i] - 8);
+        size_t run_size = 0;
+        size_t run_payload = 0;
+        size_t run_length = 0;
+
+        // Extend the run while the next pointer's block starts where this one ends.
+        do {
+            uint64_t header = decode_header(((sf_block*)((char*)ptrs[i] - 8))->header);
+            STAT_INC(free_count[get_stats_size_class(header & 0xFFFFFFFF & ~0xF)]);
+            run_size += header & 0xFFFFFFFF & ~0xF;
+            run_payload += header >> 32;
+            run_length++;
+            i++;
+        } while (i < n && (char*)ptrs[i] - 8 == (char*)run_start + run_size);
+
+        sf_current_payload -= run_payload;
+
+        if (run_length == 1 && run_size <= max_quick_size) {
+            release_block_to_heap(run_start, run_size, run_payload);
+            continue;
+        }
+
+        // One free region for the whole run, then a single coalesce and insert.
+        sf_allocated_payload -= run_payload;
+        sf_allocated_block_size -= run_size;
+        STAT_ADD(coalesces, run_length - 1);
+        uint64_t header = run_size | (decode_header(run_start->header) & PREV_BLOCK_ALLOCATED);
+        run_start->header = encode_header(header);
+        *(sf_footer*)((char*)run_start + run_size - 8) = run_start->header;
+
+        sf_block* coalesced = coalesce_adjacent_free_blocks(run_start);
+        insert_block_into_free_list(coalesced);
+    }
+    UNLOCK_HEAP();
+}
+
+#ifdef DEFERRED_COALESCING
+/* ========================================================================
+ * DEFERRED COALESCING
+ * ========================================================================
+ * Frees leave blocks uncoalesced (see helper.h); these passes merge every
+ * run of adjacent free blocks at once. A pass walks the blocks of the
+ * active heap, the main heap or each chunk of the active arena, so it
+ * costs one header read per block however few blocks were freed.
+ * ======================================================================*/
+
+/**
+ * Merges each run of adjacent free blocks between first_block and the epilogue
+ * into one free block, as immediate coalescing would have left them.
+ */
+static void coalesce_free_runs(char* first_block, char* epilogue)
+{
+    char* current = first_block;
+    while (current < epilogue) {
+        sf_block* run_start = (sf_block*)current;
+        uint64_t header = decode_header(run_start->header);
+        size_t block_size = header & 0xFFFFFFFF & ~0xF;
+        char* run_end = current + block_size;
+
+        if (!(header & THIS_BLOCK_ALLOCATED)) {
+            // Unlink the free blocks that follow while their headers are intact.
+            while (run_end < epilogue) {
+                sf_block* next_block = (sf_block*)run_end;
+                uint64_t next_header = decode_header(next_block->header);
+                if (next_header & THIS_BLOCK_ALLOCATED)
+                    break;
+
+                if (run_end == current + block_size)
+                    remove_block_from_free_list(run_start);
+                remove_block_from_free_list(next_block);
+                run_end += next_header & 0xFFFFFFFF & ~0xF;
+                STAT_INC(coalesces);
+            }
+
+            if (run_end != current + block_size) {
+                size_t run_size = (size_t)(run_end - current);
+                run_start->header = encode_header(run_size | (header & PREV_BLOCK_ALLOCATED));
+                *(sf_footer*)(run_end - 8) = run_start->header;
+                insert_block_into_free_list(run_start);
+            }
+        }
+        current = run_end;
+    }
+}
+
+/**
+ * Runs a coalescing pass over the active heap if anything was freed since the last.
+ */
+static void coalesce_deferred_frees()
+{
+    if (sf_deferred_free_bytes == 0)
+        return;
+    sf_deferred_free_bytes = 0;
+
+    if (sf_active_arena != NULL) {
+        for (char* chunk = sf_active_arena->chunks; chunk != NULL; chunk = *(char**)chunk)
+            coalesce_free_runs(chunk + 40, chunk + get_arena_chunk_size(chunk) - 8);
+    } else if (sf_mem_start() != sf_mem_end()) {
+        coalesce_free_runs((char*)sf_mem_start() + 40, (char*)sf_mem_end() - 8);
+    }
+}
+#endif
+
+/* ========================================================================
+ * ALIGNED ALLOCATION
+ * ========================================================================
+ * sf_memalign takes a free block large enough to hold the request at any
+ * offset, then cuts it in three: leading slack up to the first suitably
+ * aligned payload (returned to the free lists), the allocated block, and a
+ * trailing remainder that split_free_block_if_necessary hands back as usual.
+ * Slack is either 0 or at least 32 bytes, so it always forms a valid free block.
+ * ======================================================================*/
+
+/**
+ * Computes how many bytes must precede the payload of a block placed inside the
+ * free block at block_address so that the payload lies a multiple of alignment
+ * past alignment_base (NULL for plain address alignment).
+ *
+ * @return 0, or a multiple of 16 that is at least 32.
+ */
+static size_t get_alignment_slack(char* block_address, char* alignment_base, size_t alignment)
+{
+    uintptr_t payload = (uintptr_t)block_address + 8 - (uintptr_t)alignment_base;
+    size_t slack = ((payload + alignment - 1) & ~(uintptr_t)(alignment - 1)) - payload;
+
+    // Too little room for a free block in front: use the next aligned address.
+    if (slack > 0 && slack < 32)
+        slack += alignment;
+
+    return slack;
+}
+
+/**
+ * Allocates `size` bytes whose payload address is a multiple of `alignment`.
+ *
+ * STEPS:
+ *   1) Alignments of 16 or less are what sf_malloc already guarantees.
+ *   2) Find (or grow the heap for) a free block with room for the request at
+ *      its worst-case offset: alignment + 16 bytes past its start.
+ *   3) Split off the leading slack as a free block and insert it.
+ *   4) Split the rest as sf_malloc would, and mark the aligned part allocated.
+ *
+ * NOTES:
+ *   - Aligned blocks always come from the heap, even in MMAP_THRESHOLD builds,
+ *     and are released with sf_free / resized with sf_realloc like any other.
+ *
+ * @return The aligned payload, or NULL with sf_errno = EINVAL if alignment is not
+ *         a power of two, or ENOMEM if the heap cannot grow.
+ */
+void* sf_memalign(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if (size == 0)
+        return NULL;
+    if (alignment <= 16)
+        return sf_malloc(size);
+
+    // Block sizes are 28 bits wide; anything that cannot fit one is out of memory.
+    size_t required_block_size = calculate_aligned_block_size(size);
+    if (size > UINT32_MAX || alignment >= ((size_t)1 << 28) ||
+        required_block_size + alignment + 16 >= ((size_t)1 << 28)) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    LOCK_HEAP();
+    sf_block* aligned_block = allocate_aligned_block(NULL, alignment, required_block_size, size);
+    UNLOCK_HEAP();
+    if (aligned_block == NULL)
+        return NULL;
+
+    TRACE_OP(SF_TRACE_MALLOC, aligned_block->body.payload, NULL, size);
+    PROFILE_MALLOC(aligned_block->body.payload, size);
+    return aligned_block->body.payload;
+}
+
+/**
+ * Shared-heap part of sf_memalign (steps 2-4), for a block of required_block_size
+ * whose payload lies a multiple of alignment (a power of two above 16) past
+ * alignment_base, which must itself be 16-byte aligned. The block
+ * records requested_size as its payload. Sizes must already be range-checked.
+ * In THREAD_SAFE builds the caller must hold sf_heap_lock.
+ *
+ * @return The allocated block, or NULL with sf_errno = ENOMEM.
+ */
+static sf_block* allocate_aligned_block(char* alignment_base, size_t alignment, size_t required_block_size, size_t requested_size)
+{
+    size_t search_size = required_block_size + alignment + 16;
+
+    if (sf_mem_start() == sf_mem_end())
+        initialize_heap_during_first_call_to_sf_malloc();
+
+    sf_block* chosen_block = find_first_free_block_that_fits(search_size);
+
+    // The block at the end of the heap starts at a known address, so it only needs
+    // room for its actual slack, and the heap only has to grow by that much.
+    if (chosen_block == NULL) {
+        char* epilogue = (char*)sf_mem_end() - 8;
+        size_t tail_size = get_free_predecessor_size((sf_block*)epilogue);
+        sf_block* tail_block = (sf_block*)(epilogue - tail_size);
+        size_t needed_size = get_alignment_slack((char*)tail_block, alignment_base, alignment) + required_block_size;
+
+        if (tail_size >= needed_size)
+            chosen_block = tail_block;
+        else
+            chosen_block = grow_heap_to_fit(needed_size);
+    }
+    if (chosen_block == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    remove_block_from_free_list(chosen_block);
+
+    uint64_t chosen_header = decode_header(chosen_block->header);
+    size_t chosen_size = chosen_header & 0xFFFFFFFF & ~0xF;
+    size_t slack = get_alignment_slack((char*)chosen_block, alignment_base, alignment);
+
+    // The leading slack keeps the chosen block's predecessor; the aligned block follows a free one.
+    sf_block* aligned_block = chosen_block;
+    if (slack > 0) {
+        STAT_INC(splits);
+        chosen_block->header = encode_header(slack | (chosen_header & PREV_BLOCK_ALLOCATED));
+        *(sf_footer*)((char*)chosen_block + slack - 8) = chosen_block->header;
+        insert_block_into_free_list(chosen_block);
+
+        aligned_block = (sf_block*)((char*)chosen_block + slack);
+        aligned_block->header = encode_header(chosen_size - slack);
+        *(sf_footer*)((char*)aligned_block + chosen_size - slack - 8) = aligned_block->header;
+    }
+
+    split_free_block_if_necessary(aligned_block, required_block_size);
+    size_t aligned_block_size = decode_header(aligned_block->header) & 0xFFFFFFFF & ~0xF;
+    mark_block_as_allocated(aligned_block, aligned_block_size, requested_size);
+    STAT_INC(malloc_count[get_stats_size_class(aligned_block_size)]);
+
+    return aligned_block;
+}
+
+/**
+ * C11-style aligned_alloc: sf_memalign with the same arguments. Unlike C11, size
+ * need not be a multiple of alignment.
+ */
+void* sf_aligned_alloc(size_t alignment, size_t size)
+{
+    return sf_memalign(alignment, size);
+}
+
+#ifdef SLAB_ALLOCATOR
+/* ========================================================================
+ * SLAB ALLOCATOR
+ * ========================================================================
+ * Tiny requests are packed into slab runs (see helper.h). Each class keeps
+ * a list of its runs that still have free slots; a full run leaves the list
+ * and rejoins it when a slot is freed. A run that becomes empty goes back to
+ * the heap unless it is its class's only run with free slots, which is kept
+ * so that a class hovering around one run does not map and unmap it over
+ * and over. Runs come from allocate_aligned_block, so they are carved from
+ * the free lists like any other block. All functions below expect the
+ * caller to hold sf_heap_lock, except find_slab_run.
+ * ======================================================================*/
+
+/** Class of a request of 1..SLAB_MAX_SIZE bytes. */
+static int get_slab_class(size_t size)
+{
+    return (int)((size - 1) / SLAB_SLOT_SIZE);
+}
+
+/** Offset of the first slot in a run of slot_count slots: after the header and size table. */
+static size_t get_slab_first_slot_offset(size_t slot_count)
+{
+    return (sizeof(sf_slab_run) + slot_count + 15) & ~(size_t)15;
+}
+
+/** The signature a live run at this address carries: its address, salted with the reset generation. */
+static sf_header get_slab_signature(sf_slab_run* run)
+{
+    return encode_header((sf_header)(uintptr_t)run ^ (sf_slab_generation * 0x9E3779B97F4A7C15ull));
+}
+
+/** Adds a run to the front of its class's list of runs with free slots. */
+static void link_slab_run(sf_slab_run* run)
+{
+    sf_slab_run** head = &sf_slab_runs[get_slab_class(run->slot_size)];
+    run->prev = NULL;
+    run->next = *head;
+    if (*head != NULL)
+        (*head)->prev = run;
+    *head = run;
+}
+
+/** Removes a run from its class's list of runs with free slots. */
+static void unlink_slab_run(sf_slab_run* run)
+{
+    if (run->prev != NULL)
+        run->prev->next = run->next;
+    else
+        sf_slab_runs[get_slab_class(run->slot_size)] = run->next;
+    if (run->next != NULL)
+        run->next->prev = run->prev;
+    run->next = run->prev = NULL;
+}
+
+/**
+ * Moves the requested bytes of a run's live slots from `removed` to `added`,
+ * in the run's header payload and in the totals behind sf_fragmentation and
+ * sf_utilization.
+ */
+static void update_slab_payload(sf_slab_run* run, size_t removed, size_t added)
+{
+    sf_block* run_block = (sf_block*)((char*)run - 8);
+    uint64_t header = decode_header(run_block->header);
+    uint64_t payload = (header >> 32) - removed + added;
+    run_block->header = encode_header((payload << 32) | (header & 0xFFFFFFFF));
+
+    sf_allocated_payload = sf_allocated_payload - removed + added;
+    sf_current_payload = sf_current_payload - removed + added;
+    if (sf_current_payload > sf_peak_payload)
+        sf_peak_payload = sf_current_payload;
+}
+
+/**
+ * Carves a new run for slab_class out of the heap and puts it on the class's list.
+ *
+ * @return The run, or NULL with sf_errno = ENOMEM.
+ */
+static sf_slab_run* create_slab_run(int slab_class)
+{
+    // Runs are aligned relative to the heap start, whose pages are where the heap
+    // grows: a run created at the tail then fills exactly the pages added for it.
+    sf_block* run_block = allocate_aligned_block(sf_mem_start(), SLAB_RUN_SIZE, SLAB_RUN_SIZE, 0);
+    if (run_block == NULL)
+        return NULL;
+
+    // The block's size may include an unsplit splinter; keep its own size.
+    uint64_t header = decode_header(run_block->header);
+    run_block->header = encode_header(header | SLAB_RUN_BLOCK);
+    write_allocated_footer(run_block, header & 0xFFFFFFFF & ~0xF);
+
+    sf_slab_run* run = (sf_slab_run*)run_block->body.payload;
+    size_t slot_size = (size_t)(slab_class + 1) * SLAB_SLOT_SIZE;
+    size_t run_capacity = SLAB_RUN_SIZE - ALLOCATED_BLOCK_OVERHEAD;
+    size_t slot_count = (run_capacity - sizeof(sf_slab_run)) / (slot_size + 1);
+    while (get_slab_first_slot_offset(slot_count) + slot_count * slot_size > run_capacity)
+        slot_count--;
+
+    run->signature = get_slab_signature(run);
+    run->slot_size = (uint16_t)slot_size;
+    run->slot_count = (uint16_t)slot_count;
+    run->free_count = (uint16_t)slot_count;
+    run->first_slot = (uint16_t)get_slab_first_slot_offset(slot_count);
+    for (size_t w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        size_t bits = (slot_count > w * 64) ? slot_count - w * 64 : 0;
+        run->free_slots[w] = (bits >= 64) ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1);
+    }
+
+    link_slab_run(run);
+    return run;
+}
+
+/** Returns an empty run's block to the heap. */
+static void release_slab_run(sf_slab_run* run)
+{
+    unlink_slab_run(run);
+    run->signature = 0; // The memory may later hold another block's payload.
+
+    sf_block* run_block = (sf_block*)((char*)run - 8);
+    uint64_t header = decode_header(run_block->header) & ~(uint64_t)SLAB_RUN_BLOCK;
+    run_block->header = encode_header(header);
+    release_block_to_heap(run_block, header & 0xFFFFFFFF & ~0xF, 0);
+}
+
+/**
+ * Takes a free slot for a request of 1..SLAB_MAX_SIZE bytes from the first run
+ * of its class with room, creating a run if there is none.
+ *
+ * @return The slot, or NULL with sf_errno = ENOMEM.
+ */
+static void* allocate_from_slab(size_t requested_size)
+{
+    int slab_class = get_slab_class(requested_size);
+    sf_slab_run* run = sf_slab_runs[slab_class];
+    if (run == NULL)
+        run = create_slab_run(slab_class);
+    if (run == NULL)
+        return NULL;
+
+    size_t w = 0;
+    while (run->free_slots[w] == 0)
+        w++;
+    size_t slot = w * 64 + (size_t)__builtin_ctzll(run->free_slots[w]);
+    run->free_slots[w] &= run->free_slots[w] - 1;
+
+    if (--run->free_count == 0)
+        unlink_slab_run(run);
+
+    run->payload_size[slot] = (uint8_t)requested_size;
+    update_slab_payload(run, 0, requested_size);
+    STAT_INC(malloc_count[get_stats_size_class(run->slot_size)]);
+
+    return (char*)run + run->first_slot + slot * run->slot_size;
+}
+
+/**
+ * Recognizes a slot pointer by rounding it down to its run and checking the run's
+ * signature and block header. Does not validate the slot itself.
+ *
+ * @return The pointer's run, or NULL if pp is not inside a slab run.
+ */
+static sf_slab_run* find_slab_run(void* pp)
+{
+    char* heap_start = sf_mem_start();
+    if ((char*)pp < heap_start + 40 || (char*)pp >= (char*)sf_mem_end())
+        return NULL;
+
+    size_t heap_offset = (size_t)((char*)pp - heap_start);
+    sf_slab_run* run = (sf_slab_run*)(heap_start + (heap_offset & ~(size_t)(SLAB_RUN_SIZE - 1)));
+    if ((char*)run - 8 < heap_start + 40 || (char*)(run + 1) > (char*)pp)
+        return NULL;
+    if (run->signature != get_slab_signature(run))
+        return NULL;
+
+    uint64_t run_header = decode_header(((sf_block*)((char*)run - 8))->header);
+    if ((run_header & (SLAB_RUN_BLOCK | THIS_BLOCK_ALLOCATED)) != (SLAB_RUN_BLOCK | THIS_BLOCK_ALLOCATED))
+        return NULL;
+
+    return run;
+}
+
+/**
+ * Computes the index of the live slot pp in run. Calls abort() if pp is not the
+ * start of a slot, or names a slot that is already free.
+ */
+static size_t get_slab_slot(sf_slab_run* run, void* pp)
+{
+    size_t offset = (size_t)((char*)pp - (char*)run);
+    if (offset < run->first_slot || (offset - run->first_slot) % run->slot_size != 0)
+        abort();
+
+    size_t slot = (offset - run->first_slot) / run->slot_size;
+    if (slot >= run->slot_count || (run->free_slots[slot / 64] & ((uint64_t)1 << (slot % 64))))
+        abort();
+
+    return slot;
+}
+
+/** sf_free for a slot: marks it free and releases the run once it is empty. */
+static void release_to_slab(sf_slab_run* run, void* pp)
+{
+    size_t slot = get_slab_slot(run, pp);
+    run->free_slots[slot / 64] |= (uint64_t)1 << (slot % 64);
+    update_slab_payload(run, run->payload_size[slot], 0);
+    STAT_INC(free_count[get_stats_size_class(run->slot_size)]);
+
+    if (run->free_count++ == 0)
+        link_slab_run(run);
+
+    // Keep the class's last run with free slots around for the next request.
+    if (run->free_count == run->slot_count && (run->prev != NULL || run->next != NULL))
+        release_slab_run(run);
+}
+
+/**
+ * sf_realloc for a slot. A new size in the same class only updates the recorded
+ * size; anything else moves the data to a new allocation and frees the slot.
+ *
+ * @return The (possibly moved) payload, or NULL with sf_errno = ENOMEM.
+ */
+static void* reallocate_slab_slot(sf_slab_run* run, void* pp, size_t rsize)
+{
+    size_t slot = get_slab_slot(run, pp);
+    size_t old_payload = run->payload_size[slot];
+
+    if (rsize <= SLAB_MAX_SIZE && (size_t)(get_slab_class(rsize) + 1) * SLAB_SLOT_SIZE == run->slot_size) {
+        run->payload_size[slot] = (uint8_t)rsize;
+        update_slab_payload(run, old_payload, rsize);
+        return pp;
+    }
+
+    void* new_pp = sf_malloc(rsize);
+    if (new_pp == NULL) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(new_pp, pp, old_payload < rsize ? old_payload : rsize);
+    release_to_slab(run, pp);
+    STAT_INC(realloc_moved);
+
+    return new_pp;
+}
+#endif
+
+#ifdef MMAP_THRESHOLD
+/* ========================================================================
+ * LARGE-OBJECT MAPPING
+ * ========================================================================
+ * Requests of at least MMAP_THRESHOLD bytes bypass the heap: each gets a
+ * private mmap() region, so it can never fragment the heap or pin it at its
+ * peak size. The region begins with an sf_mapped_region row whose header
+ * word sits directly before the 16-byte aligned payload, just like a heap
+ * block's. The header carries MMAPPED_BLOCK and no block size (a mapping can
+ * exceed the 28-bit size field); the mapping length is kept in the row.
+ * All functions below expect the caller to hold sf_heap_lock, except
+ * find_mapped_region.
+ * ======================================================================*/
+
+/** Adds a mapping's bytes to the totals behind sf_fragmentation and sf_utilization. */
+static void account_mapped_block(sf_mapped_region* region, size_t payload_size)
+{
+    sf_mapped_bytes += region->length;
+    if (sf_mapped_bytes > sf_mapped_peak_bytes)
+        sf_mapped_peak_bytes = sf_mapped_bytes;
+
+    sf_allocated_payload += payload_size;
+    sf_allocated_block_size += region->length;
+
+    sf_current_payload += payload_size;
+    if (sf_current_payload > sf_peak_payload)
+        sf_peak_payload = sf_current_payload;
+}
+
+/** Reverses account_mapped_block. */
+static void unaccount_mapped_block(sf_mapped_region* region)
+{
+    size_t payload_size = decode_header(region->header) >> 32;
+
+    sf_mapped_bytes -= region->length;
+    sf_allocated_payload -= payload_size;
+    sf_allocated_block_size -= region->length;
+    sf_current_payload -= payload_size;
+}
+
+/**
+ * Computes the mapping length for a payload of requested_size bytes.
+ *
+ * @return A multiple of PAGE_SZ, or 0 if the payload does not fit the header's
+ *         32-bit payload field.
+ */
+static size_t get_mapped_length(size_t requested_size)
+{
+    if (requested_size > UINT32_MAX)
+        return 0;
+    size_t length = (sizeof(sf_mapped_region) + requested_size + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+#ifdef HUGE_PAGES
+    // A partial huge page at the end would be backed by small pages.
+    if (length >= HUGE_PAGE_SZ)
+        length = (length + HUGE_PAGE_SZ - 1) & ~(HUGE_PAGE_SZ - 1);
+#endif
+    return length;
+}
+
+/**
+ * Maps length bytes of fresh anonymous memory. With HUGE_PAGES, a mapping of at
+ * least HUGE_PAGE_SZ is over-mapped by one huge page, trimmed to start on a huge-page
+ * boundary, and advised MADV_HUGEPAGE (advice the kernel rejects is ignored).
+ *
+ * @return The mapping, or MAP_FAILED.
+ */
+static void* map_region(size_t length)
+{
+#ifdef HUGE_PAGES
+    if (length >= HUGE_PAGE_SZ) {
+        char* raw = mmap(NULL, length + HUGE_PAGE_SZ, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return MAP_FAILED;
+
+        char* aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_SZ - 1) & ~(uintptr_t)(HUGE_PAGE_SZ - 1));
+        if (aligned > raw)
+            munmap(raw, aligned - raw);
+        if (raw + HUGE_PAGE_SZ > aligned)
+            munmap(aligned + length, raw + HUGE_PAGE_SZ - aligned);
+
+        madvise(aligned, length, MADV_HUGEPAGE);
+        return aligned;
+    }
+#endif
+    return mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+/**
+ * Resizes a mapping without copying its pages. With HUGE_PAGES, a result of at least
+ * HUGE_PAGE_SZ is resized in place only if the mapping already starts on a huge-page
+ * boundary; otherwise, or if that fails, it is moved onto a new range from
+ * map_region(), so it ends up aligned and advised.
+ *
+ * @return The (possibly moved) mapping, or MAP_FAILED with the old one intact.
+ */
+static void* remap_region(void* region, size_t old_length, size_t new_length)
+{
+#ifdef HUGE_PAGES
+    if (new_length >= HUGE_PAGE_SZ) {
+        // A mapping that started below HUGE_PAGE_SZ is rarely aligned; growing it in
+        // place would keep it that way.
+        void* resized = MAP_FAILED;
+        if (((uintptr_t)region & (HUGE_PAGE_SZ - 1)) == 0)
+            resized = mremap(region, old_length, new_length, 0);
+        if (resized == MAP_FAILED) {
+            void* target = map_region(new_length);
+            if (target == MAP_FAILED)
+                return MAP_FAILED;
+            resized = mremap(region, old_length, new_length, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+            if (resized == MAP_FAILED) {
+                munmap(target, new_length);
+                return MAP_FAILED;
+            }
+        }
+        // Pages moved from a small mapping keep that mapping's (lack of) advice.
+        madvise(resized, new_length, MADV_HUGEPAGE);
+        return resized;
+    }
+#endif
+    return mremap(region, old_length, new_length, MREMAP_MAYMOVE);
+}
+
+/**
+ * Maps a dedicated region for a payload of requested_size bytes.
+ *
+ * @return The payload, or NULL with sf_errno = ENOMEM.
+ */
+static void* allocate_mapped_block(size_t requested_size)
+{
+    size_t length = get_mapped_length(requested_size);
+    if (length == 0) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_mapped_region* region = map_region(length);
+    if (region == MAP_FAILED) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    region->length = length;
+    region->header = encode_header(((uint64_t)requested_size << 32) | MMAPPED_BLOCK | THIS_BLOCK_ALLOCATED);
+
+    region->prev = NULL;
+    region->next = sf_mapped_regions;
+    if (sf_mapped_regions != NULL)
+        sf_mapped_regions->prev = region;
+    sf_mapped_regions = region;
+
+    account_mapped_block(region, requested_size);
+    STAT_INC(malloc_count[get_stats_size_class(length)]);
+
+    return region + 1;
+}
+
+/**
+ * Recognizes a payload pointer returned by allocate_mapped_block. Pointers into
+ * the heap, and anything whose header and list links do not describe a live
+ * mapping, are rejected.
+ *
+ * @return The pointer's region, or NULL if pp is not a mapped block.
+ */
+static sf_mapped_region* find_mapped_region(void* pp)
+{
+    if (pp == NULL || ((uintptr_t)pp & (PAGE_SZ - 1)) != sizeof(sf_mapped_region))
+        return NULL;
+    if (pp >= sf_mem_start() && pp < sf_mem_end())
+        return NULL;
+
+    sf_mapped_region* region = (sf_mapped_region*)pp - 1;
+    uint64_t header = decode_header(region->header);
+    if ((header & 0xFFFFFFFF) != (MMAPPED_BLOCK | THIS_BLOCK_ALLOCATED))
+        return NULL;
+
+    LOCK_HEAP();
+    int linked = (region->prev != NULL) ? (region->prev->next == region)
+                                        : (sf_mapped_regions == region);
+    UNLOCK_HEAP();
+
+    return linked ? region : NULL;
+}
+
+/** Unlinks a mapped block and unmaps it. */
+static void release_mapped_block(sf_mapped_region* region)
+{
+    if (region->prev != NULL)
+        region->prev->next = region->next;
+    else
+        sf_mapped_regions = region->next;
+    if (region->next != NULL)
+        region->next->prev = region->prev;
+
+    STAT_INC(free_count[get_stats_size_class(region->length)]);
+    unaccount_mapped_block(region);
+    munmap(region, region->length);
+}
+
+/**
+ * sf_realloc for a mapped block. A new size that still reaches MMAP_THRESHOLD
+ * is handled with mremap(), which may move the mapping but never copies the
+ * payload; a smaller one moves the data into a heap block and unmaps the region.
+ *
+ * @return The (possibly moved) payload, or NULL with sf_errno = ENOMEM.
+ */
+static void* reallocate_mapped_block(sf_mapped_region* region, size_t rsize)
+{
+    size_t old_payload = decode_header(region->header) >> 32;
+
+    if (rsize < MMAP_THRESHOLD) {
+        void* new_pp = sf_malloc(rsize);
+        if (new_pp == NULL) {
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(new_pp, region + 1, old_payload < rsize ? old_payload : rsize);
+        release_mapped_block(region);
+        STAT_INC(realloc_moved);
+        return new_pp;
+    }
+
+    size_t new_length = get_mapped_length(rsize);
+    if (new_length == 0) {
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    unaccount_mapped_block(region);
+
+    sf_mapped_region* moved = region;
+    if (new_length != region->length) {
+        moved = remap_region(region, region->length, new_length);
+        if (moved == MAP_FAILED) {
+            account_mapped_block(region, old_payload);
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    // The row moved with the mapping; point its neighbours at the new address.
+    if (moved != region) {
+        if (moved->prev != NULL)
+            moved->prev->next = moved;
+        else
+            sf_mapped_regions = moved;
+        if (moved->next != NULL)
+            moved->next->prev = moved;
+    }
+
+    moved->length = new_length;
+    moved->header = encode_header(((uint64_t)rsize << 32) | MMAPPED_BLOCK | THIS_BLOCK_ALLOCATED);
+    account_mapped_block(moved, rsize);
+
+    return moved + 1;
+}
+#endif
+
+/* ========================================================================
+ * HEAP TRIMMING
+ * ========================================================================
+ * sf_mem_grow() cannot be undone, so the heap never shrinks. Free memory is
+ * instead handed back with madvise(MADV_DONTNEED): whole pages inside a free
+ * block (clear of its metadata and footer) are decommitted, stay
+ * reserved, and fault back in zero-filled when the block is used again.
+ * The tail free block is tracked with sf_tail_decommitted so neither
+ * sf_trim() nor automatic trimming decommits the same pages twice.
+ * ======================================================================*/
+
+static char* round_up_to_page(char* address)
+{
+    return (char*)(((uintptr_t)address + PAGE_SZ - 1) & ~(uintptr_t)(PAGE_SZ - 1));
+}
+
+static char* round_down_to_page(char* address)
+{
+    return (char*)((uintptr_t)address & ~(uintptr_t)(PAGE_SZ - 1));
+}
+
+/**
+ * Decommits the whole pages in [start, end).
+ *
+ * @return The number of bytes decommitted.
+ */
+static size_t decommit_pages(char* start, char* end)
+{
+    start = round_up_to_page(start);
+    end = round_down_to_page(end);
+    if (start >= end)
+        return 0;
+
+    if (madvise(start, (size_t)(end - start), MADV_DONTNEED) != 0)
+        return 0;
+    return (size_t)(end - start);
+}
+
+/**
+ * Records that the heap up to touched_end is in use again, so the zero-filled
+ * bytes and the decommitted pages at the tail now start after it.
+ */
+static void note_heap_reuse(char* touched_end)
+{
+    if (sf_tail_zeroed != NULL && touched_end > sf_tail_zeroed) {
+        sf_reused_zero_start = sf_tail_zeroed;
+        sf_tail_zeroed = (touched_end < (char*)sf_mem_end() - 16) ? touched_end : NULL;
+    }
+
+    if (sf_tail_decommitted == NULL || touched_end <= sf_tail_decommitted)
+        return;
+
+    char* tail_footer_page = round_down_to_page((char*)sf_mem_end() - 16);
+    sf_tail_decommitted = round_up_to_page(touched_end);
+    if (sf_tail_decommitted >= tail_footer_page)
+        sf_tail_decommitted = NULL;
+}
+
+/**
+ * Decommits the pages of the main heap's tail free block, keeping its first
+ * keep_bytes committed. Pages already decommitted are skipped.
+ *
+ * @return The number of bytes decommitted.
+ */
+static size_t trim_heap_tail(size_t keep_bytes)
+{
+    char* epilogue = (char*)sf_mem_end() - 8;
+    size_t tail_size = get_free_predecessor_size((sf_block*)epilogue);
+    if (tail_size == 0 || keep_bytes >= tail_size)
+        return 0;
+
+    char* tail = epilogue - tail_size;
+    char* start = tail + (keep_bytes > FREE_BLOCK_METADATA_SIZE ? keep_bytes : FREE_BLOCK_METADATA_SIZE);
+    char* end = (sf_tail_decommitted != NULL) ? sf_tail_decommitted : epilogue - 8;
+
+    size_t released = decommit_pages(start, end);
+    if (released > 0 || sf_tail_decommitted != NULL) {
+        char* first_page = round_up_to_page(start);
+        if (sf_tail_decommitted == NULL || first_page < sf_tail_decommitted)
+            sf_tail_decommitted = first_page;
+    }
+
+    // Decommitted pages read back as zeros. Clearing the rest of the footer's
+    // page as well makes everything from the first of them to the footer zero.
+    if (released > 0) {
+        char* footer = epilogue - 8;
+        char* footer_page = round_down_to_page(footer);
+        memset(footer_page, 0, (size_t)(footer - footer_page));
+        if (sf_tail_zeroed == NULL || sf_tail_decommitted < sf_tail_zeroed)
+            sf_tail_zeroed = sf_tail_decommitted;
+    }
+    return released;
+}
+
+/**
+ * Automatic trimming, run after a free: trims the tail once it holds at least
+ * sf_trim_threshold committed free bytes. Only the main heap is trimmed.
+ */
+static void trim_heap_tail_if_needed()
+{
+    if (sf_trim_threshold == 0 || sf_active_arena != NULL)
+        return;
+
+    char* epilogue = (char*)sf_mem_end() - 8;
+    size_t tail_size = get_free_predecessor_size((sf_block*)epilogue);
+    if (tail_size == 0)
+        return;
+
+    char* committed_end = (sf_tail_decommitted != NULL) ? sf_tail_decommitted : epilogue;
+    if ((size_t)(committed_end - (epilogue - tail_size)) >= sf_trim_threshold)
+        trim_heap_tail(0);
+}
+
+/**
+ * Decommits free memory in the main heap: every page of the tail free block
+ * past its first keep_bytes, and every whole page inside the other free blocks.
+ *
+ * @return The number of bytes decommitted.
+ */
+size_t sf_trim(size_t keep_bytes)
+{
+    size_t released = 0;
+
+    LOCK_HEAP();
+    if (sf_mem_start() == sf_mem_end()) {
+        UNLOCK_HEAP();
+        return 0;
+    }
+
+#ifdef DEFERRED_COALESCING
+    coalesce_deferred_frees();
+#endif
+
+    char* epilogue = (char*)sf_mem_end() - 8;
+    sf_block* tail = (sf_block*)(epilogue - get_free_predecessor_size((sf_block*)epilogue));
+    released += trim_heap_tail(keep_bytes);
+
+    for (int i = 0; i < FREE_LIST_COUNT; i++)
+    {
+        sf_block* sentinel_node = &MAIN_FREE_LIST_HEADS[i];
+        for (sf_block* current = sentinel_node->body.links.next; current != sentinel_node;
+             current = current->body.links.next)
+        {
+            if (current == tail)
+                continue;
+            size_t block_size = decode_header(current->header) & 0xFFFFFFFF & ~0xF;
+            released += decommit_pages((char*)current + FREE_BLOCK_METADATA_SIZE, (char*)current + block_size - 8);
+        }
+    }
+    UNLOCK_HEAP();
+
+    return released;
+}
+
+/**
+ * Sets the automatic trimming threshold (0 turns automatic trimming off).
+ */
+void sf_set_trim_threshold(size_t threshold)
+{
+    LOCK_HEAP();
+    sf_trim_threshold = threshold;
+    UNLOCK_HEAP();
+}
+
+/* ========================================================================
+ * HEAP RESET
+ * ========================================================================
+ * sf_reset() rewrites the main heap's layout instead of freeing its blocks:
+ * the lists are emptied, and everything between the prologue and the
+ * epilogue becomes one free block. Only the side structures that point into
+ * the heap need clearing. Other threads' caches cannot be reached from here,
+ * so sf_heap_generation tells each one to drop its blocks on its next use.
+ * ======================================================================*/
+
+/**
+ * Discards every allocated block, mapping and cached block at once; see sfmm_ext.h.
+ */
+void sf_reset()
+{
+    LOCK_HEAP();
+
+#ifdef MMAP_THRESHOLD
+    while (sf_mapped_regions != NULL)
+        release_mapped_block(sf_mapped_regions);
+#endif
+#ifdef SLAB_ALLOCATOR
+    // Runs are not visited; changing the generation invalidates all their signatures.
+    memset(sf_slab_runs, 0, sizeof(sf_slab_runs));
+    sf_slab_generation++;
+#endif
+#ifdef THREAD_SAFE
+    __atomic_store_n(&sf_heap_generation, sf_heap_generation + 1, __ATOMIC_RELEASE);
+#ifdef REMOTE_FREES
+    for (int i = 0; i < THREAD_CACHE_OWNERS; i++)
+        __atomic_store_n(&sf_remote_frees[i].head, NULL, __ATOMIC_RELAXED);
+#endif
+#endif
+#ifdef DEFERRED_COALESCING
+    sf_deferred_free_bytes = 0;
+#endif
+
+    sf_current_payload = 0;
+    sf_allocated_payload = 0;
+    sf_allocated_block_size = 0;
+
+    if (sf_mem_start() != sf_mem_end()) {
+        initialize_all_free_list_sentinels();
+        initialize_all_quick_lists();
+        memset(sf_fit_tree_roots, 0, sizeof(sf_fit_tree_roots));
+
+        // The prologue stays; the block after it reaches the epilogue, which now follows a free block.
+        char* epilogue = (char*)sf_mem_end() - 8;
+        sf_block* free_block = (sf_block*)((char*)sf_mem_start() + 40);
+        size_t free_block_size = (size_t)(epilogue - (char*)free_block);
+        free_block->header = encode_header(free_block_size | PREV_BLOCK_ALLOCATED);
+        *(sf_footer*)(epilogue - 8) = free_block->header;
+        ((sf_block*)epilogue)->header = encode_header(8 | THIS_BLOCK_ALLOCATED);
+        insert_block_into_free_list(free_block);
+
+        // Only the decommitted tail pages are still known to be zero.
+        sf_tail_zeroed = sf_tail_decommitted;
+        sf_reused_zero_start = NULL;
+        trim_heap_tail_if_needed();
+    }
+    UNLOCK_HEAP();
+
+    PROFILE_RESET();
+}
+
+/* ========================================================================
+ * ALLOCATION TRACING
+ * ========================================================================
+ * In ALLOC_TRACE builds every traced call appends an sf_trace_record to the
+ * buffer being filled. When it is full it becomes the pending buffer, which a
+ * writer thread appends to the trace file while callers fill the other one;
+ * callers only wait if both buffers are full. sf_trace_stop() hands over the
+ * partly filled buffer last and joins the writer.
+ * ======================================================================*/
+
+#ifdef ALLOC_TRACE
+__thread int sf_trace_depth = 0;
+
+static pthread_mutex_t sf_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sf_trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sf_trace_writer;
+static FILE* sf_trace_file = NULL;
+static int sf_trace_active = 0;        // Also read without the lock as a fast-path check.
+static int sf_trace_stopping = 0;      // Tells the writer to exit once nothing is pending.
+static int sf_trace_write_failed = 0;
+static int sf_trace_exit_registered = 0;
+static uint64_t sf_trace_start_ns = 0;
+
+static sf_trace_record sf_trace_buffers[2][SF_TRACE_BUFFER_RECORDS];
+static int sf_trace_current = 0;       // Buffer being filled; the other one is the pending one.
+static size_t sf_trace_fill = 0;       // Records in the buffer being filled.
+static size_t sf_trace_pending = 0;    // Records in the pending buffer, 0 if there is none.
+
+static uint64_t trace_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/** Pointer ids are heap offsets in 16-byte units; payloads are 16-byte aligned. */
+static uint32_t trace_pointer_id(void* pp)
+{
+    if (pp == NULL)
+        return 0;
+    return (uint32_t)(((char*)pp - (char*)sf_mem_start()) >> 4);
+}
+
+/** Makes the filled buffer the pending one. Caller holds sf_trace_lock and no buffer is pending. */
+static void hand_trace_buffer_to_writer()
+{
+    sf_trace_pending = sf_trace_fill;
+    sf_trace_current ^= 1;
+    sf_trace_fill = 0;
+    pthread_cond_broadcast(&sf_trace_cond);
+}
+
+static void* trace_writer_main(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&sf_trace_lock);
+    for (;;) {
+        while (sf_trace_pending == 0 && !sf_trace_stopping)
+            pthread_cond_wait(&sf_trace_cond, &sf_trace_lock);
+        if (sf_trace_pending == 0)
+            break;
+
+        // The pending buffer is not touched by callers, so it is written unlocked.
+        sf_trace_record* records = sf_trace_buffers[sf_trace_current ^ 1];
+        size_t count = sf_trace_pending;
+        pthread_mutex_unlock(&sf_trace_lock);
+        size_t written = fwrite(records, sizeof(*records), count, sf_trace_file);
+        pthread_mutex_lock(&sf_trace_lock);
+
+        if (written != count)
+            sf_trace_write_failed = 1;
+        sf_trace_pending = 0;
+        pthread_cond_broadcast(&sf_trace_cond);
+    }
+    pthread_mutex_unlock(&sf_trace_lock);
+
+    return NULL;
+}
+
+void trace_allocation(int op, void* result, void* old, size_t size)
+{
+    if (sf_trace_depth > 0 || !__atomic_load_n(&sf_trace_active, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&sf_trace_lock);
+    if (sf_trace_active) {
+        // Timestamps are taken under the lock so they increase through the file.
+        sf_trace_record* record = &sf_trace_buffers[sf_trace_current][sf_trace_fill++];
+        record->timestamp_ns = trace_now_ns() - sf_trace_start_ns;
+        record->id = trace_pointer_id(result);
+        record->old_id = trace_pointer_id(old);
+        record->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+        record->op = (uint32_t)op;
+
+        if (sf_trace_fill == SF_TRACE_BUFFER_RECORDS) {
+            while (sf_trace_pending != 0)
+                pthread_cond_wait(&sf_trace_cond, &sf_trace_lock);
+            hand_trace_buffer_to_writer();
+        }
+    }
+    pthread_mutex_unlock(&sf_trace_lock);
+}
+
+static void stop_trace_at_exit()
+{
+    sf_trace_stop();
+}
+#endif
+
+/**
+ * Starts recording allocator calls to the file at `path`, replacing it.
+ *
+ * @return 0 on success; -1 if tracing is already on, the file cannot be
+ *         written, or the build lacks ALLOC_TRACE.
+ */
+int sf_trace_start(const char* path)
+{
+#ifdef ALLOC_TRACE
+    if (path == NULL)
+        return -1;
+
+    // A trace that is still being stopped also keeps sf_trace_file set.
+    pthread_mutex_lock(&sf_trace_lock);
+    if (sf_trace_active || sf_trace_file != NULL) {
+        pthread_mutex_unlock(&sf_trace_lock);
+        return -1;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL || fwrite(SF_TRACE_MAGIC, 1, 8, file) != 8) {
+        if (file != NULL)
+            fclose(file);
+        pthread_mutex_unlock(&sf_trace_lock);
+        return -1;
+    }
+
+    sf_trace_file = file;
+    sf_trace_current = 0;
+    sf_trace_fill = 0;
+    sf_trace_pending = 0;
+    sf_trace_write_failed = 0;
+    sf_trace_start_ns = trace_now_ns();
+
+    if (pthread_create(&sf_trace_writer, NULL, trace_writer_main, NULL) != 0) {
+        fclose(file);
+        sf_trace_file = NULL;
+        pthread_mutex_unlock(&sf_trace_lock);
+        return -1;
+    }
+    if (!sf_trace_exit_registered)
+        sf_trace_exit_registered = (atexit(stop_trace_at_exit) == 0);
+
+    __atomic_store_n(&sf_trace_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sf_trace_lock);
+    return 0;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+/**
+ * Stops recording, writes out every buffered record and closes the trace file.
+ *
+ * @return 0 on success; -1 if tracing was not on, a write failed, or the
+ *         build lacks ALLOC_TRACE.
+ */
+int sf_trace_stop()
+{
+#ifdef ALLOC_TRACE
+    pthread_mutex_lock(&sf_trace_lock);
+    if (!sf_trace_active) {
+        pthread_mutex_unlock(&sf_trace_lock);
+        return -1;
+    }
+    __atomic_store_n(&sf_trace_active, 0, __ATOMIC_RELEASE);
+
+    // Queue the partly filled buffer behind the one being written, then let the writer finish.
+    while (sf_trace_pending != 0)
+        pthread_cond_wait(&sf_trace_cond, &sf_trace_lock);
+    if (sf_trace_fill > 0)
+        hand_trace_buffer_to_writer();
+    sf_trace_stopping = 1;
+    pthread_cond_broadcast(&sf_trace_cond);
+    pthread_mutex_unlock(&sf_trace_lock);
+
+    pthread_join(sf_trace_writer, NULL);
+
+    pthread_mutex_lock(&sf_trace_lock);
+    int failed = sf_trace_write_failed;
+    if (fclose(sf_trace_file) != 0)
+        failed = 1;
+    sf_trace_file = NULL;
+    sf_trace_stopping = 0;
+    pthread_mutex_unlock(&sf_trace_lock);
+
+    return failed ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+/* ========================================================================
+ * HEAP PROFILING
+ * ========================================================================
+ * In ALLOC_PROFILE builds each thread subtracts requested sizes from a
+ * countdown drawn from an exponential distribution with mean sf_profile_rate;
+ * the allocation that takes it below zero becomes a sample. Samples live in a
+ * fixed pool, chained by payload address from sf_profile_sample_buckets, and
+ * point at a per-backtrace sf_profile_stack holding live and total counts.
+ * Chain heads hold an index plus one so the zeroed tables start out empty. A
+ * free only takes sf_profile_lock when its bucket is non-empty; since samples
+ * are published before the block is handed back, that check cannot miss one.
+ * ======================================================================*/
+
+#ifdef ALLOC_PROFILE
+size_t sf_profile_rate = 0;
+size_t sf_profile_live_samples = 0;
+__thread int sf_profile_depth = 0;
+
+typedef struct sf_profile_stack {
+    void* frames[SF_PROFILE_MAX_FRAMES];
+    int depth;
+    int next;               // Next stack in the same hash chain, plus one.
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+} sf_profile_stack;
+
+typedef struct sf_profile_sample {
+    void* payload;
+    size_t size;
+    int stack;
+    int next;               // Next sample in the same bucket or the free pool, plus one.
+} sf_profile_sample;
+
+static pthread_mutex_t sf_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t sf_profile_generation = 0;   // Bumped by sf_profile_set_rate so countdowns are redrawn.
+static size_t sf_profile_period = 1;       // Last nonzero rate, for the dump header.
+
+static sf_profile_stack sf_profile_stacks[SF_PROFILE_STACKS];
+static int sf_profile_stack_count = 0;
+static int sf_profile_stack_buckets[SF_PROFILE_BUCKETS];
+
+static sf_profile_sample sf_profile_samples[SF_PROFILE_SAMPLES];
+static int sf_profile_sample_count = 0;    // Pool slots ever used.
+static int sf_profile_free_samples = 0;    // Released pool slots, plus one.
+static int sf_profile_sample_buckets[SF_PROFILE_BUCKETS];
+
+static __thread ptrdiff_t sf_profile_countdown = 0;
+static __thread size_t sf_profile_thread_generation = 0;
+static __thread uint64_t sf_profile_random = 0;
+
+static size_t get_profile_bucket(void* payload)
+{
+    return (size_t)((((uintptr_t)payload >> 4) * 0x9E3779B97F4A7C15ull) >> 32) % SF_PROFILE_BUCKETS;
+}
+
+/** Draws the number of bytes to allocate before the next sample. */
+static ptrdiff_t draw_profile_countdown(size_t rate)
+{
+    if (sf_profile_random == 0)
+        sf_profile_random = ((uint64_t)(uintptr_t)&sf_profile_random * 0x9E3779B97F4A7C15ull) | 1;
+    sf_profile_random ^= sf_profile_random << 13;
+    sf_profile_random ^= sf_profile_random >> 7;
+    sf_profile_random ^= sf_profile_random << 17;
+
+    // u is uniform in (0, 1], so -log(u) is exponential with mean 1.
+    double u = ((sf_profile_random >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double bytes = -log(u) * (double)rate;
+    return bytes >= (double)(PTRDIFF_MAX / 2) ? PTRDIFF_MAX / 2 : (ptrdiff_t)bytes;
+}
+
+/** Finds or adds the stack for a backtrace. Caller holds sf_profile_lock. @return Its index, or -1 if the table is full. */
+static int find_profile_stack(void** frames, int depth)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ull;
+    size_t bucket = (size_t)(hash % SF_PROFILE_BUCKETS);
+
+    for (int s = sf_profile_stack_buckets[bucket]; s != 0; s = sf_profile_stacks[s - 1].next) {
+        sf_profile_stack* stack = &sf_profile_stacks[s - 1];
+        if (stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void*)) == 0)
+            return s - 1;
+    }
+
+    if (sf_profile_stack_count == SF_PROFILE_STACKS)
+        return -1;
+    int index = sf_profile_stack_count++;
+    sf_profile_stack* stack = &sf_profile_stacks[index];
+    memcpy(stack->frames, frames, depth * sizeof(void*));
+    stack->depth = depth;
+    stack->next = sf_profile_stack_buckets[bucket];
+    sf_profile_stack_buckets[bucket] = index + 1;
+    return index;
+}
+
+void profile_allocation(void* payload, size_t size)
+{
+    if (payload == NULL || sf_profile_depth > 0)
+        return;
+
+    size_t rate = __atomic_load_n(&sf_profile_rate, __ATOMIC_RELAXED);
+    size_t generation = __atomic_load_n(&sf_profile_generation, __ATOMIC_RELAXED);
+    if (sf_profile_thread_generation != generation) {
+        sf_profile_thread_generation = generation;
+        sf_profile_countdown = draw_profile_countdown(rate);
+    }
+    sf_profile_countdown -= (ptrdiff_t)size;
+    if (sf_profile_countdown >= 0 || rate == 0)
+        return;
+    sf_profile_countdown = draw_profile_countdown(rate);
+
+    // Unwound outside the lock; backtrace() itself only ever uses the system malloc.
+    void* frames[SF_PROFILE_MAX_FRAMES];
+    int depth = backtrace(frames, SF_PROFILE_MAX_FRAMES);
+
+    pthread_mutex_lock(&sf_profile_lock);
+    int stack_index = find_profile_stack(frames, depth);
+    int slot = sf_profile_free_samples;
+    if (slot != 0)
+        sf_profile_free_samples = sf_profile_samples[slot - 1].next;
+    else if (sf_profile_sample_count < SF_PROFILE_SAMPLES)
+        slot = ++sf_profile_sample_count;
+
+    if (stack_index >= 0 && slot != 0) {
+        sf_profile_stack* stack = &sf_profile_stacks[stack_index];
+        stack->live_count++;
+        stack->live_bytes += size;
+        stack->total_count++;
+        stack->total_bytes += size;
+
+        size_t bucket = get_profile_bucket(payload);
+        sf_profile_sample* sample = &sf_profile_samples[slot - 1];
+        sample->payload = payload;
+        sample->size = size;
+        sample->stack = stack_index;
+        sample->next = sf_profile_sample_buckets[bucket];
+        __atomic_store_n(&sf_profile_sample_buckets[bucket], slot, __ATOMIC_RELEASE);
+        __atomic_store_n(&sf_profile_live_samples, sf_profile_live_samples + 1, __ATOMIC_RELAXED);
+    } else if (slot != 0) {
+        sf_profile_samples[slot - 1].next = sf_profile_free_samples;
+        sf_profile_free_samples = slot;
+    }
+    pthread_mutex_unlock(&sf_profile_lock);
+}
+
+void profile_free(void* payload)
+{
+    if (payload == NULL || sf_profile_depth > 0)
+        return;
+
+    size_t bucket = get_profile_bucket(payload);
+    if (__atomic_load_n(&sf_profile_sample_buckets[bucket], __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    pthread_mutex_lock(&sf_profile_lock);
+    int* link = &sf_profile_sample_buckets[bucket];
+    while (*link != 0 && sf_profile_samples[*link - 1].payload != payload)
+        link = &sf_profile_samples[*link - 1].next;
+
+    if (*link != 0) {
+        int slot = *link;
+        sf_profile_sample* sample = &sf_profile_samples[slot - 1];
+        sf_profile_stack* stack = &sf_profile_stacks[sample->stack];
+        stack->live_count--;
+        stack->live_bytes -= sample->size;
+
+        __atomic_store_n(link, sample->next, __ATOMIC_RELAXED);
+        sample->next = sf_profile_free_samples;
+        sf_profile_free_samples = slot;
+        __atomic_store_n(&sf_profile_live_samples, sf_profile_live_samples - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&sf_profile_lock);
+}
+
+void profile_reset()
+{
+    pthread_mutex_lock(&sf_profile_lock);
+    for (int i = 0; i < sf_profile_stack_count; i++) {
+        sf_profile_stacks[i].live_count = 0;
+        sf_profile_stacks[i].live_bytes = 0;
+    }
+    memset(sf_profile_sample_buckets, 0, sizeof(sf_profile_sample_buckets));
+    sf_profile_sample_count = 0;
+    sf_profile_free_samples = 0;
+    __atomic_store_n(&sf_profile_live_samples, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sf_profile_lock);
+}
+
+/** Appends /proc/self/maps, which pprof uses to symbolize the addresses. */
+static void write_profile_mappings(FILE* file)
+{
+    fprintf(file, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL)
+        return;
+    char buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+        fwrite(buffer, 1, length, file);
+    fclose(maps);
+}
+#endif
+
+/**
+ * Samples about one allocation per `bytes` requested bytes from now on; 0 stops sampling.
+ *
+ * @return 0 on success, or -1 if the build lacks ALLOC_PROFILE.
+ */
+int sf_profile_set_rate(size_t bytes)
+{
+#ifdef ALLOC_PROFILE
+    pthread_mutex_lock(&sf_profile_lock);
+    if (bytes != 0)
+        sf_profile_period = bytes;
+    __atomic_store_n(&sf_profile_generation, sf_profile_generation + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&sf_profile_rate, bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sf_profile_lock);
+    return 0;
+#else
+    (void)bytes;
+    return -1;
+#endif
+}
+
+/**
+ * Writes the aggregated samples to `path` as a pprof heap profile; see sfmm_ext.h.
+ *
+ * @return 0 on success; -1 if the file cannot be written, there was no memory for
+ *         the copy (sf_errno = ENOMEM), or the build lacks ALLOC_PROFILE.
+ */
+int sf_profile_dump(const char* path)
+{
+#ifdef ALLOC_PROFILE
+    if (path == NULL)
+        return -1;
+
+    // Copy the stacks out so frees are not held up while the file is written.
+    pthread_mutex_lock(&sf_profile_lock);
+    size_t count = (size_t)sf_profile_stack_count;
+    size_t period = sf_profile_period;
+    size_t mapping_size = count * sizeof(sf_profile_stack) + 1;
+    sf_profile_stack* stacks = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stacks == MAP_FAILED) {
+        pthread_mutex_unlock(&sf_profile_lock);
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    memcpy(stacks, sf_profile_stacks, count * sizeof(sf_profile_stack));
+    pthread_mutex_unlock(&sf_profile_lock);
+
+    size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        live_count += stacks[i].live_count;
+        live_bytes += stacks[i].live_bytes;
+        total_count += stacks[i].total_count;
+        total_bytes += stacks[i].total_bytes;
+    }
+
+    int failed = 1;
+    FILE* file = fopen(path, "w");
+    if (file != NULL) {
+        fprintf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                live_count, live_bytes, total_count, total_bytes, period);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(file, "%zu: %zu [%zu: %zu] @", stacks[i].live_count, stacks[i].live_bytes,
+                    stacks[i].total_count, stacks[i].total_bytes);
+            for (int f = 0; f < stacks[i].depth; f++)
+                fprintf(file, " %p", stacks[i].frames[f]);
+            fprintf(file, "\n");
+        }
+        write_profile_mappings(file);
+        failed = ferror(file);
+        if (fclose(file) != 0)
+            failed = 1;
+    }
+
+    munmap(stacks, mapping_size);
+    return failed ? -1 : 0;
+#else
+    (void)path;
+    return -1;
+#endif
+}
+
+/* ========================================================================
+ * HEAP INTROSPECTION
+ * ========================================================================
+ * sf_heap_walk() reports every block of the main heap in address order, then
+ * every mapped block, with the heap lock held throughout. sf_heap_snapshot()
+ * only holds the lock while it copies the walk into a private mapping of
+ * fixed-size records; the JSON is formatted and written after the lock is
+ * released, so a running process is paused for one walk and no longer.
+ * ======================================================================*/
+
+/**
+ * Classifies a heap block from its decoded header.
+ */
+static sf_block_state_t get_block_state(uint64_t header)
+{
+    if (!(header & THIS_BLOCK_ALLOCATED))
+        return SF_BLOCK_FREE;
+    if (header & IN_QUICK_LIST)
+        return SF_BLOCK_CACHED;
+#ifdef SLAB_ALLOCATOR
+    if (header & SLAB_RUN_BLOCK)
+        return SF_BLOCK_SLAB_RUN;
+#endif
+    return SF_BLOCK_ALLOCATED;
+}
+
+/**
+ * Body of sf_heap_walk. In THREAD_SAFE builds the caller must hold sf_heap_lock.
+ *
+ * @return 0, or the first nonzero value returned by fn.
+ */
+static int walk_heap_blocks(sf_heap_walk_fn fn, void* ctx)
+{
+    char* heap_start = sf_mem_start();
+    char* heap_end = sf_mem_end();
+
+    // The walk stops at the epilogue; an uninitialized heap has no blocks.
+    for (char* current = heap_start + 40; heap_start != heap_end && current + 8 < heap_end; ) {
+        uint64_t header = decode_header(((sf_block*)current)->header);
+        size_t block_size = header & 0xFFFFFFFF & ~0xF;
+        if (block_size < 32 || block_size % 16 != 0)
+            break; // Malformed block; nothing after it can be trusted.
+
+        sf_block_state_t state = get_block_state(header);
+        sf_block_info_t info = {
+            .address = current,
+            .size = block_size,
+            .payload = (state == SF_BLOCK_ALLOCATED || state == SF_BLOCK_SLAB_RUN) ? header >> 32 : 0,
+            .state = state,
+        };
+        int result = fn(&info, ctx);
+        if (result != 0)
+            return result;
+
+        current += block_size;
+    }
+
+#ifdef MMAP_THRESHOLD
+    for (sf_mapped_region* region = sf_mapped_regions; region != NULL; region = region->next) {
+        sf_block_info_t info = {
+            .address = region,
+            .size = region->length,
+            .payload = decode_header(region->header) >> 32,
+            .state = SF_BLOCK_MAPPED,
+        };
+        int result = fn(&info, ctx);
+        if (result != 0)
+            return result;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Calls fn for every block; see sfmm_ext.h.
+ *
+ * @return 0 once every block has been visited, the first nonzero value returned by
+ *         fn, or -1 with sf_errno = EINVAL if fn is NULL.
+ */
+int sf_heap_walk(sf_heap_walk_fn fn, void* ctx)
+{
+    if (fn == NULL) {
+        sf_errno = EINVAL;
+        return -1;
+    }
+
+    LOCK_HEAP();
+    int result = walk_heap_blocks(fn, ctx);
+    UNLOCK_HEAP();
+    return result;
+}
+
+/** Destination of sf_heap_snapshot's copying walk. */
+typedef struct sf_snapshot_buffer {
+    sf_block_info_t* records; // NULL while counting.
+    size_t count;
+} sf_snapshot_buffer;
+
+static int record_block_for_snapshot(const sf_block_info_t* block, void* ctx)
+{
+    sf_snapshot_buffer* buffer = ctx;
+    if (buffer->records != NULL)
+        buffer->records[buffer->count] = *block;
+    buffer->count++;
+    return 0;
+}
+
+static const char* get_block_state_name(sf_block_state_t state)
+{
+    switch (state) {
+    case SF_BLOCK_FREE:      return "free";
+    case SF_BLOCK_ALLOCATED: return "allocated";
+    case SF_BLOCK_CACHED:    return "cached";
+    case SF_BLOCK_SLAB_RUN:  return "slab_run";
+    case SF_BLOCK_MAPPED:    return "mapped";
+    }
+    return "unknown";
+}
+
+/**
+ * Writes a JSON snapshot of every block to `path`; see sfmm_ext.h for the format.
+ *
+ * @return 0 on success, or -1 if the records could not be mapped (sf_errno = ENOMEM)
+ *         or the file could not be written.
+ */
+int sf_heap_snapshot(const char* path)
+{
+    sf_snapshot_buffer buffer = {NULL, 0};
+
+    LOCK_HEAP();
+    void* heap_start = sf_mem_start();
+    void* heap_end = sf_mem_end();
+
+    // Count, map room for exactly that many records, then copy.
+    walk_heap_blocks(record_block_for_snapshot, &buffer);
+    size_t mapping_size = buffer.count * sizeof(sf_block_info_t) + 1;
+    sf_block_info_t* records = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (records == MAP_FAILED) {
+        UNLOCK_HEAP();
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    buffer.records = records;
+    buffer.count = 0;
+    walk_heap_blocks(record_block_for_snapshot, &buffer);
+    UNLOCK_HEAP();
+
+    int failed = 1;
+    FILE* file = fopen(path, "w");
+    if (file != NULL) {
+        fprintf(file, "{\"heap_start\": \"%p\", \"heap_end\": \"%p\", \"blocks\": [",
+                heap_start, heap_end);
+        for (size_t i = 0; i < buffer.count; i++) {
+            fprintf(file, "%s\n{\"address\": \"%p\", \"size\": %zu, \"state\": \"%s\", \"payload\": %zu}",
+                    (i == 0) ? "" : ",", records[i].address, records[i].size,
+                    get_block_state_name(records[i].state), records[i].payload);
+        }
+        fprintf(file, "\n]}\n");
+        failed = ferror(file);
+        if (fclose(file) != 0)
+            failed = 1;
+    }
+
+    munmap(records, mapping_size);
+    return failed ? -1 : 0;
+}
+
+#ifdef THREAD_SAFE
+/* ========================================================================
+ * THREAD CACHE (THREAD_SAFE builds only)
+ * ========================================================================
+ * Each thread keeps up to THREAD_CACHE_MAX quick-list-sized blocks per size
+ * class. Cached blocks are marked ALLOCATED | IN_QUICK_LIST exactly like
+ * quick-list blocks, so they are never coalesced and double frees still abort.
+ * Their headers belong to the owning thread: locked paths never write them.
+ * The lock is only taken to refill an empty class or flush a full one, and
+ * each of those moves a whole batch of blocks at once.
+ *
+ * With REMOTE_FREES, a block freed by a thread other than the one whose cache
+ * handed it out is pushed back to that owner instead, so producer/consumer
+ * pairs recycle blocks without either side locking. The owner recorded in a
+ * footer is only a routing hint: any cache may hold any block.
+ * ======================================================================*/
+
+/**
+ * Folds this thread's counters into the global ones. Caller holds sf_heap_lock.
+ */
+static void fold_thread_cache_stats(sf_thread_cache* cache)
+{
+    sf_quick_list_hits += cache->quick_list_hits;
+    sf_quick_list_misses += cache->quick_list_misses;
+    cache->quick_list_hits = 0;
+    cache->quick_list_misses = 0;
+
+    // Another thread may free what this one allocated, so the delta is signed and
+    // sf_current_payload is compared as signed while the other side is unfolded.
+    sf_current_payload += (size_t)cache->payload_delta;
+    cache->payload_delta = 0;
+    sf_allocated_payload += (size_t)cache->allocated_payload_delta;
+    cache->allocated_payload_delta = 0;
+
+#ifdef ALLOC_STATS
+    for (int i = 0; i < SF_STATS_NUM_CLASSES; i++) {
+        sf_stats.malloc_count[i] += cache->malloc_count[i];
+        sf_stats.free_count[i] += cache->free_count[i];
+        cache->malloc_count[i] = 0;
+        cache->free_count[i] = 0;
+    }
+#endif
+    if ((ptrdiff_t)sf_current_payload > (ptrdiff_t)sf_peak_payload)
+        sf_peak_payload = sf_current_payload;
+}
+
+/**
+ * Marks a block as cached (allocated + in quick list, payload preserved) and pushes it.
+ */
+static void push_block_onto_thread_cache(sf_thread_cache* cache, int ql_index,
+                                         sf_block* block, size_t block_size, size_t payload_size)
+{
+    uint64_t cached_header = ((uint64_t)payload_size << 32) |
+                             (block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST) |
+                             (decode_header(block->header) & PREV_BLOCK_ALLOCATED);
+    block->header = encode_header(cached_header);
+    write_allocated_footer(block, block_size);
+
+    block->body.links.next = cache->lists[ql_index].first;
+    cache->lists[ql_index].first = block;
+    cache->lists[ql_index].length++;
+}
+
+/**
+ * Moves up to `count` blocks from a thread cache class back to the shared heap.
+ * Caller holds sf_heap_lock.
+ */
+static void flush_thread_cache_class(sf_thread_cache* cache, int ql_index, int count)
+{
+    size_t block_size = 32 + 16 * (size_t)ql_index;
+
+    while (count-- > 0 && cache->lists[ql_index].first != NULL) {
+        sf_block* block = cache->lists[ql_index].first;
+        cache->lists[ql_index].first = block->body.links.next;
+        cache->lists[ql_index].length--;
+
+        release_block_to_heap(block, block_size, get_payload_size(block));
+    }
+}
+
+/**
+ * Refills an empty thread cache class with up to THREAD_CACHE_REFILL blocks, taken
+ * first from the shared quick list and then carved from the free lists. The heap is
+ * never grown here; if nothing is available the caller falls back to sf_malloc's
+ * locked path. Caller holds sf_heap_lock.
+ */
+static void refill_thread_cache_class(sf_thread_cache* cache, int ql_index)
+{
+    size_t block_size = 32 + 16 * (size_t)ql_index;
+
+    if (sf_mem_start() == sf_mem_end())
+        initialize_heap_during_first_call_to_sf_malloc();
+
+    while (cache->lists[ql_index].length < THREAD_CACHE_REFILL) {
+        sf_block* block = pop_block_from_quick_list(ql_index);
+
+        if (block != NULL) {
+            // Cached blocks carry no payload; drop the one the quick list retained.
+            sf_allocated_payload -= get_payload_size(block);
+        } else {
+            block = find_first_free_block_that_fits(block_size);
+            if (block == NULL)
+                break;
+
+            // Only exact-size blocks can be cached; an unsplittable block stays free.
+            size_t found_size = decode_header(block->header) & 0xFFFFFFFF & ~0xF;
+            if (found_size != block_size && found_size - block_size < 32)
+                break;
+
+            remove_block_from_free_list(block);
+            split_free_block_if_necessary(block, block_size);
+            mark_block_as_allocated(block, block_size, 0);
+        }
+
+        push_block_onto_thread_cache(cache, ql_index, block, block_size, 0);
+    }
+}
+
+#ifdef REMOTE_FREES
+/**
+ * Claims an unowned sf_remote_frees slot for a new thread. When every slot is taken
+ * the owner tag stays 0: the thread's blocks record no owner and it receives no
+ * remote frees.
+ */
+static void claim_remote_free_list(sf_thread_cache* cache)
+{
+    for (unsigned i = 0; i < THREAD_CACHE_OWNERS; i++) {
+        int unclaimed = 0;
+        if (__atomic_compare_exchange_n(&sf_remote_frees[i].claimed, &unclaimed, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            cache->owner_tag = i + 1;
+            return;
+        }
+    }
+}
+
+/**
+ * Writes the footer of a block handed out by a thread cache, recording the owner in
+ * its payload field. The size and allocated bits that coalescing reads are unchanged.
+ */
+static void write_owner_footer(sf_block* block, size_t block_size, unsigned owner_tag)
+{
+    if (owner_tag == 0) {
+        write_allocated_footer(block, block_size);
+        return;
+    }
+    uint64_t footer = ((uint64_t)(REMOTE_FREE_OWNER_TAG | owner_tag) << 32) |
+                      (decode_header(block->header) & 0xFFFFFFFF);
+    *(sf_footer*)((char*)block + block_size - 8) = encode_header(footer);
+}
+
+/**
+ * @return The owner tag recorded by write_owner_footer(), or 0 if the block has none.
+ *         A plain footer's payload field never has REMOTE_FREE_OWNER_TAG set, since
+ *         thread-cached blocks hold at most a few hundred bytes.
+ */
+static unsigned get_block_owner(sf_block* block, size_t block_size)
+{
+    uint64_t footer = decode_header(*(sf_footer*)((char*)block + block_size - 8));
+    uint32_t tag = (uint32_t)(footer >> 32);
+    if (!(tag & REMOTE_FREE_OWNER_TAG))
+        return 0;
+    tag &= ~REMOTE_FREE_OWNER_TAG;
+    return (tag <= THREAD_CACHE_OWNERS) ? tag : 0;
+}
+
+/**
+ * Pushes a block freed by a foreign thread onto its owner's remote-free list. The
+ * block is marked as cached first, so freeing it again still aborts.
+ *
+ * @return 1 if the block was pushed, 0 if the owner has released its list.
+ */
+static int push_remote_free(unsigned owner_tag, sf_block* block, size_t block_size, size_t payload_size)
+{
+    sf_remote_free_list* list = &sf_remote_frees[owner_tag - 1];
+    if (!__atomic_load_n(&list->claimed, __ATOMIC_ACQUIRE))
+        return 0;
+
+    uint64_t cached_header = ((uint64_t)payload_size << 32) |
+                             (block_size | THIS_BLOCK_ALLOCATED | IN_QUICK_LIST);
+    block->header = encode_header(cached_header);
+    write_allocated_footer(block, block_size);
+
+    sf_block* head = __atomic_load_n(&list->head, __ATOMIC_RELAXED);
+    do {
+        block->body.links.next = head;
+    } while (!__atomic_compare_exchange_n(&list->head, &head, block, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/**
+ * Moves every block on the calling thread's remote-free list into its cache, without
+ * the lock. Classes pushed past THREAD_CACHE_MAX are cut back to half in one locked
+ * batch.
+ */
+static void drain_remote_frees(sf_thread_cache* cache)
+{
+    if (cache->owner_tag == 0)
+        return;
+
+    sf_block* block = __atomic_exchange_n(&sf_remote_frees[cache->owner_tag - 1].head, NULL,
+                                          __ATOMIC_ACQUIRE);
+    int overflowed = 0;
+    while (block != NULL) {
+        sf_block* next = block->body.links.next;
+        size_t block_size = decode_header(block->header) & 0xFFFFFFFF & ~0xF;
+        int ql_index = (block_size - 32) / 16;
+
+        // push_remote_free() already marked the block as cached; only the link changes.
+        block->body.links.next = cache->lists[ql_index].first;
+        cache->lists[ql_index].first = block;
+        if (++cache->lists[ql_index].length > THREAD_CACHE_MAX)
+            overflowed = 1;
+        block = next;
+    }
+
+    if (overflowed) {
+        LOCK_HEAP();
+        for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+            if (cache->lists[i].length > THREAD_CACHE_MAX)
+                flush_thread_cache_class(cache, i, cache->lists[i].length - THREAD_CACHE_MAX / 2);
+        }
+        fold_thread_cache_stats(cache);
+        UNLOCK_HEAP();
+    }
+}
+#endif
+
+/**
+ * Forgets the blocks and payload deltas a cache still holds from before the last
+ * sf_reset(); the heap they belonged to has been rebuilt since.
+ */
+static void discard_stale_thread_cache(sf_thread_cache* cache)
+{
+    size_t generation = __atomic_load_n(&sf_heap_generation, __ATOMIC_ACQUIRE);
+    if (SF_LIKELY(cache->heap_generation == generation))
+        return;
+
+    for (int i = 0; i < NUM_QUICK_LISTS; i++) {
+        cache->lists[i].length = 0;
+        cache->lists[i].first = NULL;
+    }
+    cache->payload_delta = 0;
+    cache->allocated_payload_delta = 0;
+    cache->heap_generation = generation;
+}
+
+/**
+ * pthread key destructor: returns an exiting thread's cached blocks to the shared
+ * heap and folds its counters, so nothing is stranded in a dead thread's cache.
+ * Its remote-free list is released first; a free racing with that waits on the
+ * list until the next thread to claim it drains it.
+ */
+static void release_thread_cache_at_exit(void* cache_ptr)
+{
+    sf_thread_cache* cache = cache_ptr;
+
+    LOCK_HEAP();
+    discard_stale_thread_cache(cache);
+#ifdef REMOTE_FREES
+    if (cache->owner_tag != 0)
+        __atomic_store_n(&sf_remote_frees[cache->owner_tag - 1].claimed, 0, __ATOMIC_RELEASE);
+    drain_remote_frees(cache);
+#endif
+    for (int i = 0; i < NUM_QUICK_LISTS; i++)
+        flush_thread_cache_class(cache, i, cache->lists[i].length);
+    fold_thread_cache_stats(cache);
+    UNLOCK_HEAP();
+}
+
+static void create_thread_cache_key()
+{
+    pthread_key_create(&sf_thread_cache_key, release_thread_cache_at_exit);
+}
+
+/**
+ * Returns the calling thread's cache, arming its exit destructor on first use.
+ */
+static sf_thread_cache* get_thread_cache()
+{
+    sf_thread_cache* cache = &sf_local_cache;
+    if (!cache->registered) {
+        pthread_once(&sf_thread_cache_key_once, create_thread_cache_key);
+        pthread_setspecific(sf_thread_cache_key, cache);
+#ifdef REMOTE_FREES
+        claim_remote_free_list(cache);
+#endif
+        cache->registered = 1;
+    }
+    discard_stale_thread_cache(cache);
+    return cache;
+}
+
+/**
+ * sf_malloc fast path: pops an exact-size block from the thread cache, refilling the
+ * class in one locked batch if it is empty.
+ *
+ * @return The allocated block, or NULL if the request is not quick-list-sized or no
+ *         block could be cached (the caller then takes the locked path).
+ */
+static sf_block* allocate_from_thread_cache(size_t required_block_size, size_t requested_size)
+{
+    size_t max_quick_size = 32 + 16 * (NUM_QUICK_LISTS - 1);
+    if (required_block_size > max_quick_size)
+        return NULL;
+
+    sf_thread_cache* cache = get_thread_cache();
+    int ql_index = (required_block_size - 32) / 16;
+
+    if (cache->lists[ql_index].first != NULL) {
+        cache->quick_list_hits++;
+    } else {
+        cache->quick_list_misses++;
+#ifdef REMOTE_FREES
+        // Blocks other threads have freed back to this one come first, without the lock.
+        drain_remote_frees(cache);
+#endif
+        if (cache->lists[ql_index].first == NULL) {
+            LOCK_HEAP();
+            refill_thread_cache_class(cache, ql_index);
+            fold_thread_cache_stats(cache);
+            UNLOCK_HEAP();
+
+            if (cache->lists[ql_index].first == NULL)
+                return NULL;
+        }
+    }
+
+    sf_block* block = cache->lists[ql_index].first;
+    cache->lists[ql_index].first = block->body.links.next;
+    cache->lists[ql_index].length--;
+
+    // Rebuild the header as a plain allocated block (clears IN_QUICK_LIST).
+    uint64_t new_header = ((uint64_t)requested_size << 32) |
+                          (required_block_size | THIS_BLOCK_ALLOCATED) |
+                          (decode_header(block->header) & PREV_BLOCK_ALLOCATED);
+    size_t cached_payload = decode_header(block->header) >> 32;
+    block->header = encode_header(new_header);
+#ifdef REMOTE_FREES
+    write_owner_footer(block, required_block_size, cache->owner_tag);
+#else
+    write_allocated_footer(block, required_block_size);
+#endif
+
+    // The block stays allocated while cached; only its payload field changes.
+    cache->payload_delta += (ptrdiff_t)requested_size;
+    cache->allocated_payload_delta += (ptrdiff_t)requested_size - (ptrdiff_t)cached_payload;
+#ifdef ALLOC_STATS
+    cache->malloc_count[get_stats_size_class(required_block_size)]++;
+#endif
+    return block;
+}
+
+/**
+ * sf_free fast path: caches a small block in the thread cache, or with REMOTE_FREES
+ * hands it back to the thread whose cache allocated it. When a class exceeds
+ * THREAD_CACHE_MAX, half of it is flushed to the shared heap in one locked batch.
+ *
+ * @return 1 if the block was taken by the thread cache, 0 if it is too large.
+ */
+static int release_to_thread_cache(sf_block* block, size_t block_size, size_t payload_size)
+{
+    size_t max_quick_size = 32 + 16 * (NUM_QUICK_LISTS - 1);
+    if (block_size > max_quick_size)
+        return 0;
+
+    sf_thread_cache* cache = get_thread_cache();
+    int ql_index = (block_size - 32) / 16;
+
+    // The freeing thread's counters take the free wherever the block goes.
+    cache->payload_delta -= (ptrdiff_t)payload_size;
+#ifdef ALLOC_STATS
+    cache->free_count[get_stats_size_class(block_size)]++;
+#endif
+
+#ifdef REMOTE_FREES
+    unsigned owner_tag = get_block_owner(block, block_size);
+    if (owner_tag != 0 && owner_tag != cache->owner_tag &&
+        push_remote_free(owner_tag, block, block_size, payload_size))
+        return 1;
+#endif
+
+    push_block_onto_thread_cache(cache, ql_index, block, block_size, payload_size);
+    if (cache->lists[ql_index].length > THREAD_CACHE_MAX) {
+        LOCK_HEAP();
+        flush_thread_cache_class(cache, ql_index, THREAD_CACHE_MAX / 2);
+        fold_thread_cache_stats(cache);
+        UNLOCK_HEAP();
+    }
+    return 1;
+}
+#endif
+
+/**
+ * Returns every block cached by the calling thread to the shared heap and folds the
+ * thread's counters into the globals. A no-op unless built with THREAD_SAFE.
+ */
+void sf_thread_cache_flush()
+{
+#ifdef THREAD_SAFE
+    sf_thread_cache* cache = &sf_local_cache;
+
+    LOCK_HEAP();
+    discard_stale_thread_cache(cache);
+#ifdef REMOTE_FREES
+    drain_remote_frees(cache);
+#endif
+    for (int i = 0; i < NUM_QUICK_LISTS; i++)
+        flush_thread_cache_class(cache, i, cache->lists[i].length);
+    fold_thread_cache_stats(cache);
+    UNLOCK_HEAP();
+#endif
+}
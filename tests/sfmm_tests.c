@@ -1,9 +1,11 @@
 #include <criterion/criterion.h>
 #include <errno.h>
+#include <string.h>
 #include <signal.h>
 #include "debug.h"
 #include "sfmm.h"
 #include "helper.h"
+#include "sfmm_ext.h"
 #define TEST_TIMEOUT 15
 
 /*
@@ -12,9 +14,17 @@
  */
 void assert_free_block_count(size_t size, int count) {
     int cnt = 0;
-    for(int i = 0; i < NUM_FREE_LISTS; i++) {
-        sf_block *bp = sf_free_list_heads[i].body.links.next;
-        while(bp != &sf_free_list_heads[i]) {
+#ifdef TLSF
+    // TLSF keeps its free blocks in its own, finer classes.
+    sf_block *heads = sf_tlsf_free_list_heads;
+    int num_lists = TLSF_NUM_CLASSES;
+#else
+    sf_block *heads = sf_free_list_heads;
+    int num_lists = NUM_FREE_LISTS;
+#endif
+    for(int i = 0; i < num_lists; i++) {
+        sf_block *bp = heads[i].body.links.next;
+        while(bp != &heads[i]) {
 	    if(size == 0 || size == ((bp->header ^ sf_magic()) & ~0xffffffff0000000f))
 	        cnt++;
 	    bp = bp->body.links.next;
@@ -52,6 +62,37 @@ void assert_quick_list_block_count(size_t size, int count) {
     }
 }
 
+/*
+ * Bytes of the heap's free tail that `count` calls to sf_malloc(size) take.
+ * THREAD_SAFE builds carve quick-list-sized blocks a whole refill batch at a
+ * time; the blocks not handed out stay in the thread cache. SLAB_ALLOCATOR
+ * builds put tiny requests in runs that the heap grows past its first page for.
+ */
+size_t carved_bytes(size_t size, int count) {
+#ifdef SLAB_ALLOCATOR
+	if (size <= SLAB_MAX_SIZE)
+		return 0;
+#endif
+	size_t block_size = calculate_aligned_block_size(size);
+#ifdef THREAD_SAFE
+	if (block_size <= 32 + 16 * (NUM_QUICK_LISTS - 1))
+		count = (count + THREAD_CACHE_REFILL - 1) / THREAD_CACHE_REFILL * THREAD_CACHE_REFILL;
+#endif
+	return block_size * count;
+}
+
+/*
+ * Block bytes sf_fragmentation() counts for the only live sf_malloc(size) of its
+ * size. A tiny request in a SLAB_ALLOCATOR build is charged its whole run.
+ */
+size_t charged_bytes(size_t size) {
+#ifdef SLAB_ALLOCATOR
+	if (size <= SLAB_MAX_SIZE)
+		return SLAB_RUN_SIZE;
+#endif
+	return carved_bytes(size, 1);
+}
+
 Test(sfmm_basecode_suite, malloc_an_int, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
 	size_t sz = sizeof(int);
@@ -65,12 +106,19 @@ Test(sfmm_basecode_suite, malloc_an_int, .timeout = TEST_TIMEOUT) {
 
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(4016, 1);
+	assert_free_block_count(4048 - carved_bytes(sz, 1), 1);
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+#ifdef SLAB_ALLOCATOR
+	// The int's slab run is aligned past the first page, so the heap grows by one run.
+	cr_assert(sf_mem_start() + PAGE_SZ + SLAB_RUN_SIZE == sf_mem_end(), "Allocated more than necessary!");
+#else
 	cr_assert(sf_mem_start() + PAGE_SZ == sf_mem_end(), "Allocated more than necessary!");
+#endif
 }
 
+// A request this large is mapped instead of carved from the heap once it reaches MMAP_THRESHOLD.
+#if !defined(MMAP_THRESHOLD) || MMAP_THRESHOLD > 16316
 Test(sfmm_basecode_suite, malloc_four_pages, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
 
@@ -82,7 +130,10 @@ Test(sfmm_basecode_suite, malloc_four_pages, .timeout = TEST_TIMEOUT) {
 	assert_free_block_count(0, 0);
 	cr_assert(sf_errno == 0, "sf_errno is not 0!");
 }
+#endif
 
+// A request this large is mapped instead of failing once it reaches MMAP_THRESHOLD.
+#if !defined(MMAP_THRESHOLD) || MMAP_THRESHOLD > 151505
 Test(sfmm_basecode_suite, malloc_too_large, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
 	void *x = sf_malloc(151505);
@@ -93,7 +144,10 @@ Test(sfmm_basecode_suite, malloc_too_large, .timeout = TEST_TIMEOUT) {
 	assert_free_block_count(151504, 1);
 	cr_assert(sf_errno == ENOMEM, "sf_errno is not ENOMEM!");
 }
+#endif
 
+// y's slab run would double a geometrically growing heap, leaving free space past the run.
+#if !defined(SLAB_ALLOCATOR) || !defined(HEAP_GROWTH_GEOMETRIC)
 Test(sfmm_basecode_suite, free_quick, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
 	size_t sz_x = 8, sz_y = 32, sz_z = 1;
@@ -103,12 +157,21 @@ Test(sfmm_basecode_suite, free_quick, .timeout = TEST_TIMEOUT) {
 
 	sf_free(y);
 
+#if defined(SLAB_ALLOCATOR)
+	// y goes back to a slot of its slab run, not to a quick list.
+	assert_quick_list_block_count(0, 0);
+#elif defined(THREAD_SAFE)
+	// y waits in this thread's cache, which the quick-list helper cannot see.
+	cr_assert((((sf_block *)((char *)y - 8))->header ^ sf_magic()) & IN_QUICK_LIST, "y is not cached!");
+#else
 	assert_quick_list_block_count(0, 1);
 	assert_quick_list_block_count(48, 1);
+#endif
 	assert_free_block_count(0, 1);
-	assert_free_block_count(3936, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 2) - carved_bytes(sz_y, 1), 1); // x and z share a class
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
+#endif
 
 Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
@@ -119,10 +182,24 @@ Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 
 	sf_free(y);
 
+	size_t bsz_y = calculate_aligned_block_size(sz_y); // 224, or 208 without allocated-block footers
+#if defined(FOOTER_ELISION)
+	// Without a footer y's block is quick-list sized, so it is cached instead.
+	assert_quick_list_block_count(0, 1);
+	assert_quick_list_block_count(bsz_y, 1);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 2) - bsz_y, 1); // x and z share a class
+#elif (defined(THREAD_SAFE) || defined(SLAB_ALLOCATOR)) && !defined(DEFERRED_COALESCING)
+	// z comes out of x's refill batch or slab run, so y borders the free tail and merges with it.
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 2), 1);
+#else
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 2);
-	assert_free_block_count(224, 1);
-	assert_free_block_count(3760, 1);
+	assert_free_block_count(bsz_y, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 2) - bsz_y, 1); // x and z share a class
+#endif
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
@@ -137,11 +214,36 @@ Test(sfmm_basecode_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
 
 	sf_free(y);
 	sf_free(x);
-
+#ifdef DEFERRED_COALESCING
+	sf_trim(SIZE_MAX); // runs the deferred coalescing pass and keeps the free tail committed
+#endif
+
+	size_t bsz_x = calculate_aligned_block_size(sz_x); // 224, or 208 without allocated-block footers
+	size_t bsz_y = calculate_aligned_block_size(sz_y);
+#if defined(FOOTER_ELISION) && defined(SLAB_ALLOCATOR)
+	// Without a footer x's block is cached; z lives in w's slab run, so y merges with the free tail.
+	assert_quick_list_block_count(0, 1);
+	assert_quick_list_block_count(bsz_x, 1);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - bsz_x, 1);
+#elif defined(FOOTER_ELISION)
+	// Without a footer x's block is cached, so y has no free neighbour to merge with.
+	assert_quick_list_block_count(0, 1);
+	assert_quick_list_block_count(bsz_x, 1);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(bsz_y, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_w, 2) - bsz_x - bsz_y, 1); // w and z share a class
+#elif defined(THREAD_SAFE) || defined(SLAB_ALLOCATOR)
+	// z comes out of w's refill batch or slab run, so x and y merge with the free tail as well.
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_w, 2), 1);
+#else
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 2);
 	assert_free_block_count(544, 1);
 	assert_free_block_count(3440, 1);
+#endif
 
 	cr_assert(sf_errno == 0, "sf_errno is not zero!");
 }
@@ -159,16 +261,32 @@ Test(sfmm_basecode_suite, freelist, .timeout = TEST_TIMEOUT) {
 	sf_free(w);
 	sf_free(y);
 
+#ifdef FOOTER_ELISION
+	// Without footers the 200-byte requests use 208-byte blocks, which are cached instead.
+	assert_quick_list_block_count(0, 3);
+	assert_quick_list_block_count(208, 3);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(1872, 1);
+#else
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 4);
 	assert_free_block_count(224, 3);
 	assert_free_block_count(1808, 1);
+#endif
 
 	// First block in list should be the most recently freed block.
+#if defined(FOOTER_ELISION)
+	int i = (208 - 32) / 16;
+	sf_block *bp = sf_quick_lists[i].first;
+#elif defined(TLSF)
+	int i = get_free_list_index_for_size(224);
+	sf_block *bp = sf_tlsf_free_list_heads[i].body.links.next;
+#else
 	int i = 3;
 	sf_block *bp = sf_free_list_heads[i].body.links.next;
+#endif
 	cr_assert_eq(bp, (char *)y - 8,
-		     "Wrong first block in free list %d: (found=%p, exp=%p)",
+		     "Wrong first block in list %d: (found=%p, exp=%p)",
                      i, bp, (char *)y - 8);
 }
 
@@ -185,10 +303,22 @@ Test(sfmm_basecode_suite, realloc_larger_block, .timeout = TEST_TIMEOUT) {
 		  "Realloc'ed block size (%ld) not what was expected (%ld)!",
 		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, 96);
 
+#if defined(SLAB_ALLOCATOR)
+	// x leaves its slab slot for a heap block; the slot goes back to the run.
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x1, 1), 1);
+#elif defined(THREAD_SAFE)
+	// x is the last block of its refill batch, so it grows into the free tail in place.
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 2) - (96 - 32), 1);
+#else
 	assert_quick_list_block_count(0, 1);
 	assert_quick_list_block_count(32, 1);
 	assert_free_block_count(0, 1);
 	assert_free_block_count(3888, 1);
+#endif
 }
 
 Test(sfmm_basecode_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOUT) {
@@ -208,7 +338,7 @@ Test(sfmm_basecode_suite, realloc_smaller_block_splinter, .timeout = TEST_TIMEOU
 	// There should be only one free block.
 	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(3952, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 1), 1);
 }
 
 Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIMEOUT) {
@@ -228,9 +358,9 @@ Test(sfmm_basecode_suite, realloc_smaller_block_free_block, .timeout = TEST_TIME
 	// to the freelist.  This block will go into the main freelist and be coalesced.
 	// Note that we don't put split blocks into the quick lists because their sizes are not sizes
 	// that were requested by the client, so they are not very likely to satisfy a new request.
-	assert_quick_list_block_count(0, 0);	
+	assert_quick_list_block_count(0, 0);
 	assert_free_block_count(0, 1);
-	assert_free_block_count(4016, 1);
+	assert_free_block_count(4048 - carved_bytes(sz_x, 1) + (80 - 32), 1);
 }
 
 //############################################
@@ -274,9 +404,10 @@ Test(sfmm_student_suite, fragmentation_single_allocation, .timeout = TEST_TIMEOU
 	size_t requested = 20;
 	void *x = sf_malloc(requested);
 	cr_assert_not_null(x, "Allocation failed.");
+	sf_thread_cache_flush(); // folds per-thread totals in THREAD_SAFE builds
 
 	double payload = (double)requested;
-	double block_size = 48.0; // Actual block size (header + footer + padding)
+	double block_size = charged_bytes(requested); // 48 bytes (header + footer + padding)
 	double expected = payload / block_size;
 
 	cr_assert_float_eq(sf_fragmentation(), expected, 1e-6,
@@ -307,9 +438,10 @@ Test(sfmm_student_suite, fragmentation_multiple_allocations, .timeout = TEST_TIM
 	void *c = sf_malloc(40);   // 64-byte block
 
 	cr_assert(a && b && c, "Allocation failed.");
+	sf_thread_cache_flush(); // folds per-thread totals in THREAD_SAFE builds
 
 	double payload = 24 + 100 + 40;
-	double block_size = 48 + 128 + 64;
+	double block_size = charged_bytes(24) + charged_bytes(100) + charged_bytes(40);
 	double expected = payload / block_size;
 
 	cr_assert_float_eq(sf_fragmentation(), expected, 1e-6,
@@ -346,9 +478,10 @@ Test(sfmm_student_suite, fragmentation_ignores_freed_large_middle_block, .timeou
 	cr_assert_not_null(c, "Allocation for 'c' failed.");
 
 	sf_free(b);  // Goes to main free list, still marked unallocated
+	sf_thread_cache_flush(); // folds per-thread totals in THREAD_SAFE builds
 
 	double payload = 24 + 64;
-	double block_size = 48 + 80;
+	double block_size = charged_bytes(24) + charged_bytes(64);
 	double expected = payload / block_size;
 
 	cr_assert_float_eq(sf_fragmentation(), expected, 1e-6,
@@ -384,6 +517,37 @@ Test(sfmm_student_suite, fragmentation_all_freed, .timeout = TEST_TIMEOUT) {
 					   "Expected 0.0 fragmentation after all blocks are freed.");
 }
 
+/**
+ * Test: fragmentation_totals_match_heap_walk
+ *
+ * The constant-time sf_fragmentation() must agree with a full heap walk after
+ * quick-list reuse, flushes, splits, realloc growth and shrinking, and frees.
+ */
+Test(sfmm_student_suite, fragmentation_totals_match_heap_walk, .timeout = TEST_TIMEOUT) {
+	void *small[QUICK_LIST_MAX + 2];
+	for (int i = 0; i < QUICK_LIST_MAX + 2; i++)
+		small[i] = sf_malloc(20);
+	void *big = sf_malloc(1000);
+	void *mid = sf_malloc(300);
+
+	for (int i = 0; i < QUICK_LIST_MAX + 2; i++)
+		sf_free(small[i]); // overflows the quick list, forcing a flush
+	sf_thread_cache_flush(); // folds per-thread totals in THREAD_SAFE builds
+	cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-12, "Totals drifted after frees.");
+
+	void *reused = sf_malloc(30); // same 48-byte class, served from the quick list
+	mid = sf_realloc(mid, 2000);
+	big = sf_realloc(big, 200);
+	sf_thread_cache_flush();
+	cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-12, "Totals drifted after reallocs.");
+
+	sf_free(reused);
+	sf_free(mid);
+	sf_free(big);
+	sf_thread_cache_flush();
+	cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-12, "Totals drifted after cleanup.");
+}
+
 /**
  * Test: utilization_no_allocations
  *
@@ -407,8 +571,13 @@ Test(sfmm_student_suite, utilization_no_allocations, .timeout = TEST_TIMEOUT) {
 Test(sfmm_student_suite, utilization_single_allocation, .timeout = TEST_TIMEOUT) {
 	void *x = sf_malloc(20);
 	cr_assert_not_null(x, "Allocation failed.");
+	sf_thread_cache_flush(); // folds per-thread totals in THREAD_SAFE builds
 
+#ifdef SLAB_ALLOCATOR
+	double expected = 20.0 / (4096.0 + SLAB_RUN_SIZE); // the slab run grows the heap past its first page
+#else
 	double expected = 20.0 / 4096.0;
+#endif
 	cr_assert_float_eq(sf_utilization(), expected, 1e-6,
 		"Expected utilization %.6f but got %.6f", expected, sf_utilization());
 
@@ -434,6 +603,7 @@ Test(sfmm_student_suite, utilization_multiple_allocations, .timeout = TEST_TIMEO
 	void *c = sf_malloc(300);
 
 	cr_assert(a && b && c, "Allocations failed.");
+	sf_thread_cache_flush(); // folds per-thread totals in THREAD_SAFE builds
 
 	double expected = 600.0 / 4096.0;
 	cr_assert_float_eq(sf_utilization(), expected, 1e-6,
@@ -484,3 +654,1170 @@ Test(sfmm_student_suite, utilization_grows_with_heap, .timeout = TEST_TIMEOUT) {
 
 	sf_free(x);
 }
+
+// THREAD_SAFE caches the freed block per thread and SLAB_ALLOCATOR serves 8 bytes from a run.
+#if !defined(THREAD_SAFE) && !defined(SLAB_ALLOCATOR)
+/**
+ * Test: quick_list_fast_path_reuses_block
+ *
+ * Frees a small block into its quick list and then requests the same size again.
+ * The second malloc must be served from the quick list (same address, no split)
+ * and the quick-list hit counter must record it.
+ */
+Test(sfmm_student_suite, quick_list_fast_path_reuses_block, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(32);   // 48-byte block
+	void *y = sf_malloc(8);    // guard block so x does not touch the wilderness
+	cr_assert(x && y, "Allocation failed.");
+
+	sf_free(x);
+	assert_quick_list_block_count(48, 1);
+
+	size_t hits_before = sf_quick_list_hits;
+	void *z = sf_malloc(30);   // also a 48-byte block
+	cr_assert_eq(z, x, "Fast path did not reuse the quick-list block (got %p, exp %p)", z, x);
+	cr_assert_eq(sf_quick_list_hits, hits_before + 1, "Quick-list hit was not counted.");
+
+	sf_block *bp = (sf_block *)((char *)z - 8);
+	cr_assert(!((bp->header ^ sf_magic()) & IN_QUICK_LIST), "IN_QUICK_LIST bit still set!");
+	cr_assert(((bp->header ^ sf_magic()) >> 32) == 30, "Payload size not updated!");
+
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3968, 1);
+
+	// A block popped from a quick list must be freeable again.
+	sf_free(z);
+	assert_quick_list_block_count(48, 1);
+}
+#endif
+
+// Overflow handling belongs to sf_quick_lists, which THREAD_SAFE and slab-sized requests bypass.
+#if QUICK_LIST_FLUSH_PERCENT == 100 && !defined(THREAD_SAFE) && !defined(SLAB_ALLOCATOR)
+/**
+ * Test: quick_list_flush_on_overflow
+ *
+ * Frees QUICK_LIST_MAX + 1 adjacent 32-byte blocks. The last free flushes the five
+ * cached blocks, which coalesce into a single 160-byte free block, and then caches
+ * the sixth block on the now-empty quick list.
+ */
+Test(sfmm_student_suite, quick_list_flush_on_overflow, .timeout = TEST_TIMEOUT) {
+	void *p[QUICK_LIST_MAX + 1];
+	for (int i = 0; i <= QUICK_LIST_MAX; i++)
+		p[i] = sf_malloc(10);
+	/* void *guard = */ sf_malloc(10);
+
+	for (int i = 0; i <= QUICK_LIST_MAX; i++)
+		sf_free(p[i]);
+
+	assert_quick_list_block_count(0, 1);
+	assert_quick_list_block_count(32, 1);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(160, 1);
+	assert_free_block_count(3824, 1);
+}
+#endif
+
+// Overflow handling belongs to sf_quick_lists, which THREAD_SAFE and slab-sized requests bypass.
+#if QUICK_LIST_FLUSH_PERCENT != 100 && !defined(THREAD_SAFE) && !defined(SLAB_ALLOCATOR)
+/**
+ * Test: quick_list_partial_flush_on_overflow
+ *
+ * Frees QUICK_LIST_MAX + 1 adjacent 32-byte blocks. The last free evicts only the
+ * oldest QUICK_LIST_FLUSH_PERCENT of the list; those blocks are adjacent, so they
+ * are merged into one free block, and the rest stay cached.
+ */
+Test(sfmm_student_suite, quick_list_partial_flush_on_overflow, .timeout = TEST_TIMEOUT) {
+	int evicted = (QUICK_LIST_MAX * QUICK_LIST_FLUSH_PERCENT + 99) / 100;
+	if (evicted == 0)
+		evicted = 1;
+
+	void *p[QUICK_LIST_MAX + 1];
+	for (int i = 0; i <= QUICK_LIST_MAX; i++)
+		p[i] = sf_malloc(10);
+	/* void *guard = */ sf_malloc(10);
+
+	for (int i = 0; i <= QUICK_LIST_MAX; i++)
+		sf_free(p[i]);
+
+	assert_quick_list_block_count(32, QUICK_LIST_MAX - evicted + 1);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(32 * evicted, 1);
+	assert_free_block_count(3824, 1);
+}
+#endif
+
+// THREAD_SAFE and slab-sized requests bypass sf_quick_lists, and the expected counts assume
+// whole-list flushes.
+#if defined(ADAPTIVE_QUICK_LISTS) && !defined(THREAD_SAFE) && !defined(SLAB_ALLOCATOR) && QUICK_LIST_FLUSH_PERCENT == 100
+/**
+ * Test: adaptive_quick_list_capacity
+ *
+ * A miss right after an overflow flush doubles the class's capacity, so six
+ * 32-byte blocks can then be cached without a flush. Once the class goes a full
+ * sweep interval without hits, its blocks are flushed back to the free lists.
+ */
+Test(sfmm_student_suite, adaptive_quick_list_capacity, .timeout = TEST_TIMEOUT) {
+	void *p[2 * QUICK_LIST_MAX];
+	for (int i = 0; i < 2 * QUICK_LIST_MAX; i++)
+		p[i] = sf_malloc(10);
+	/* void *guard = */ sf_malloc(10);
+
+	for (int i = 0; i <= QUICK_LIST_MAX; i++)
+		sf_free(p[i]); // the last free flushes the first QUICK_LIST_MAX
+	void *a = sf_malloc(10); // hit
+	void *b = sf_malloc(10); // miss after a flush: capacity grows
+
+	sf_free(a);
+	sf_free(b);
+	for (int i = QUICK_LIST_MAX + 1; i < 2 * QUICK_LIST_MAX; i++)
+		sf_free(p[i]);
+	assert_quick_list_block_count(32, QUICK_LIST_MAX + 1);
+
+	for (int i = 0; i < QUICK_LIST_SWEEP_INTERVAL; i++)
+		sf_free(sf_malloc(30)); // keeps the 48-byte class busy
+	assert_quick_list_block_count(32, 0);
+	assert_quick_list_block_count(48, 1);
+}
+#endif
+
+// Assumes the power-of-two classes; see tlsf_class_mapping for TLSF's.
+#ifndef TLSF
+/**
+ * Test: free_list_index_boundaries
+ *
+ * Checks the power-of-two size classes at their boundaries:
+ *   class 0 = {32}, class k = (32 * 2^(k-1), 32 * 2^k], last class = everything larger.
+ */
+Test(sfmm_student_suite, free_list_index_boundaries, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(get_free_list_index_for_size(32), 0);
+	cr_assert_eq(get_free_list_index_for_size(48), 1);
+	cr_assert_eq(get_free_list_index_for_size(64), 1);
+	cr_assert_eq(get_free_list_index_for_size(80), 2);
+	cr_assert_eq(get_free_list_index_for_size(128), 2);
+	cr_assert_eq(get_free_list_index_for_size(144), 3);
+	cr_assert_eq(get_free_list_index_for_size(4096), 7);
+	cr_assert_eq(get_free_list_index_for_size(4112), 8);
+	cr_assert_eq(get_free_list_index_for_size(32768), 10);
+	cr_assert_eq(get_free_list_index_for_size(32784), NUM_FREE_LISTS - 1);
+	cr_assert_eq(get_free_list_index_for_size(1 << 27), NUM_FREE_LISTS - 1);
+}
+#endif
+
+// Reads sf_free_list_bitmap, which TLSF replaces with its two-level bitmaps.
+#ifndef TLSF
+/**
+ * Test: free_list_bitmap_tracks_nonempty_lists
+ *
+ * After a mix of frees that populate several classes (and a malloc that empties one),
+ * every bit of sf_free_list_bitmap must match whether its list is non-empty.
+ */
+Test(sfmm_student_suite, free_list_bitmap_tracks_nonempty_lists, .timeout = TEST_TIMEOUT) {
+	// Every block is larger than a quick list holds, so each takes the same path in all modes.
+	void *a = sf_malloc(210);  // 240 (224 with FOOTER_ELISION) -> class 3
+	/* void *b = */ sf_malloc(300);
+	void *c = sf_malloc(1000); // 1024 -> class 5
+	/* void *d = */ sf_malloc(300);
+
+	sf_free(a);
+	sf_free(c);
+
+	for (int i = 0; i < NUM_FREE_LISTS; i++) {
+		int nonempty = sf_free_list_heads[i].body.links.next != &sf_free_list_heads[i];
+		cr_assert_eq(!!(sf_free_list_bitmap & (1u << i)), nonempty,
+			     "Bitmap bit %d is out of sync with its free list", i);
+	}
+	cr_assert(sf_free_list_bitmap & (1u << 3), "Class 3 should be non-empty.");
+	cr_assert(sf_free_list_bitmap & (1u << 5), "Class 5 should be non-empty.");
+
+	// Re-allocating a's block empties class 3 again.
+	void *e = sf_malloc(210);
+	cr_assert_eq(e, a, "Expected a's freed block to be reused.");
+	cr_assert(!(sf_free_list_bitmap & (1u << 3)), "Class 3 bit should be cleared.");
+}
+#endif
+
+// Geometric growth overshoots the exact page count, and a low MMAP_THRESHOLD maps the request.
+#if !defined(HEAP_GROWTH_GEOMETRIC) && (!defined(MMAP_THRESHOLD) || MMAP_THRESHOLD > 40960)
+/**
+ * Test: multi_page_growth_is_exact
+ *
+ * A 40 KB request grows the heap once by exactly the pages it still needs
+ * (the initial free block counts toward it), leaving a single free remainder.
+ */
+Test(sfmm_student_suite, multi_page_growth_is_exact, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(40960); // 40976-byte block: 4048 free + 9 pages is not enough, 10 is
+
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 11 * PAGE_SZ,
+		     "Heap should have grown to exactly 11 pages.");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4032, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+
+	sf_free(x);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(11 * PAGE_SZ - 48, 1);
+}
+#endif
+
+// The 20000-byte request is mapped instead once it reaches MMAP_THRESHOLD.
+#if !defined(MMAP_THRESHOLD) || MMAP_THRESHOLD > 20000
+/**
+ * Test: realloc_grows_in_place
+ *
+ * Append-style growth keeps the same payload address: first by absorbing the free
+ * block that follows, then by extending the heap under the last block.
+ */
+Test(sfmm_student_suite, realloc_grows_in_place, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t in_place_before = sf_realloc_in_place;
+	char *x = sf_malloc(300); // too large for a quick list, so no mode batches it
+	memset(x, 'a', 300);
+
+	char *y = sf_realloc(x, 1000); // absorbs part of the 3728-byte free tail
+	cr_assert_eq(y, x, "Realloc into a free successor should not move the block.");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - calculate_aligned_block_size(1000), 1);
+
+	char *z = sf_realloc(y, 20000); // needs 20000 - 4048 more bytes -> 4 new pages
+	cr_assert_eq(z, x, "Realloc at the heap end should not move the block.");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 5 * PAGE_SZ,
+		     "Heap should have grown by exactly 4 pages.");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(5 * PAGE_SZ - 48 - calculate_aligned_block_size(20000), 1);
+
+	cr_assert_eq(sf_realloc_in_place - in_place_before, 2, "Both reallocs should be in place.");
+	for (int i = 0; i < 300; i++)
+		cr_assert_eq(z[i], 'a', "Payload byte %d was not preserved.", i);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+#endif
+
+/**
+ * Test: realloc_shrink_tail_goes_to_quick_list
+ *
+ * Shrinking a block whose successor is allocated caches the tail on its quick
+ * list instead of freeing it, and growing the block again takes the tail back
+ * without moving.
+ */
+Test(sfmm_student_suite, realloc_shrink_tail_goes_to_quick_list, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	size_t in_place_before = sf_realloc_in_place;
+	size_t tail = calculate_aligned_block_size(300) - calculate_aligned_block_size(200);
+	char *x = sf_malloc(300); // too big for a quick list in every layout
+	char *y = sf_malloc(300); // keeps the tail from touching the free wilderness
+	memset(x, 'a', 100);
+
+	cr_assert_eq(sf_realloc(x, 200), x, "A shrinking realloc should not move.");
+	assert_quick_list_block_count(tail, 1);
+	assert_free_block_count(0, 1);
+
+	char *z = sf_realloc(x, 300);
+	cr_assert_eq(z, x, "Growing back over the cached tail should not move.");
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	cr_assert_eq(sf_realloc_in_place - in_place_before, 1, "The grow should count as in place.");
+	for (int i = 0; i < 100; i++)
+		cr_assert_eq(z[i], 'a', "Payload byte %d was not preserved.", i);
+	sf_free(y);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+/**
+ * Test: allocating_before_a_cached_block_keeps_it_cached
+ *
+ * Allocating the free block in front of a cached block must leave the cached
+ * block's IN_QUICK_LIST bit alone, so freeing it again would still abort.
+ */
+Test(sfmm_student_suite, allocating_before_a_cached_block_keeps_it_cached, .timeout = TEST_TIMEOUT) {
+	char *a = sf_malloc(200);
+	char *b = sf_malloc(40);
+	/* void *guard = */ sf_malloc(200);
+	sf_free(a); // too big for a quick list, so it goes to the free lists
+	sf_free(b); // cached
+	sf_block *bb = (sf_block *)(b - 8);
+	cr_assert((bb->header ^ sf_magic()) & IN_QUICK_LIST, "b should be cached.");
+
+	char *x = sf_malloc(200);
+	cr_assert_eq(x, a, "The freed block in front of b should be reused.");
+	cr_assert((bb->header ^ sf_magic()) & IN_QUICK_LIST, "Allocating a cleared b's IN_QUICK_LIST bit.");
+	cr_assert_eq(sf_malloc(40), b, "b should still be served from its cache.");
+}
+
+/**
+ * Test: batch_malloc_and_free
+ *
+ * sf_malloc_batch carves its blocks back to back from one free region, and
+ * sf_free_batch (given them out of order) merges the run back into a single
+ * free block without going through the quick lists.
+ */
+Test(sfmm_student_suite, batch_malloc_and_free, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[10];
+	size_t bsz = calculate_aligned_block_size(100); // 128 bytes
+	size_t got = sf_malloc_batch(100, 10, ptrs);
+
+	cr_assert_eq(got, 10, "Expected all 10 blocks to be allocated.");
+	for (int i = 1; i < 10; i++)
+		cr_assert_eq((char *)ptrs[i], (char *)ptrs[i - 1] + bsz, "Block %d is not contiguous.", i);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048 - 10 * bsz, 1);
+	cr_assert_float_eq(sf_fragmentation(), 100.0 / bsz, 1e-9, "Unexpected fragmentation.");
+
+	void *shuffled[10] = { ptrs[7], ptrs[2], NULL, ptrs[9], ptrs[0], ptrs[5],
+			       ptrs[1], ptrs[8], ptrs[3], ptrs[6] };
+	/* ptrs[4] stays allocated, splitting the batch into two runs. */
+	sf_free_batch(shuffled, 10);
+
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(4 * bsz, 1);
+	assert_free_block_count(4048 - 5 * bsz, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+/**
+ * Test: batch_malloc_rejects_oversized_blocks
+ *
+ * A batch whose blocks cannot fit the header's size field fails straight away
+ * with ENOMEM instead of looking for regions to carve them from.
+ */
+Test(sfmm_student_suite, batch_malloc_rejects_oversized_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *ptrs[2] = { NULL, NULL };
+	size_t got = sf_malloc_batch((size_t)1 << 29, 2, ptrs);
+
+	cr_assert_eq(got, 0, "An oversized batch should allocate nothing.");
+	cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+	cr_assert(ptrs[0] == NULL && ptrs[1] == NULL, "An oversized batch wrote to out[].");
+}
+
+/**
+ * Test: memalign_returns_aligned_blocks
+ *
+ * sf_memalign returns payloads on the requested boundary, rejects alignments
+ * that are not powers of two, and leaves no slack behind once everything is
+ * freed: the leading and trailing pieces coalesce back into one free block.
+ */
+Test(sfmm_student_suite, memalign_returns_aligned_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_memalign(64, 300);
+	char *y = sf_memalign(PAGE_SZ, 500);
+	char *z = sf_aligned_alloc(256, 1000);
+	cr_assert(x && y && z, "Aligned allocation failed.");
+	cr_assert_eq((uintptr_t)x % 64, 0, "Payload %p is not 64-byte aligned.", x);
+	cr_assert_eq((uintptr_t)y % PAGE_SZ, 0, "Payload %p is not page aligned.", y);
+	cr_assert_eq((uintptr_t)z % 256, 0, "Payload %p is not 256-byte aligned.", z);
+	cr_assert_eq(sf_current_payload, 1800, "Aligned payloads not accounted.");
+	memset(x, 1, 300);
+	memset(y, 2, 500);
+	memset(z, 3, 1000);
+	cr_assert(x[299] == 1 && y[499] == 2, "Aligned blocks overlap.");
+
+	cr_assert_null(sf_memalign(48, 100), "A non-power-of-two alignment was accepted.");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+
+	sf_free(y);
+	sf_free(x);
+	sf_free(z);
+#ifdef DEFERRED_COALESCING
+	sf_trim(SIZE_MAX); // runs the deferred coalescing pass and keeps the free tail committed
+#endif
+	size_t heap_size = (char *)sf_mem_end() - (char *)sf_mem_start();
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(heap_size - 48, 1);
+}
+
+/**
+ * Test: calloc_zero_fills
+ *
+ * sf_calloc returns zeroed memory both from freshly grown pages (which it does
+ * not clear) and from reused blocks that held data, and rejects a count * size
+ * that overflows.
+ */
+Test(sfmm_student_suite, calloc_zero_fills, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_null(sf_calloc(SIZE_MAX / 2, 4), "An overflowing calloc succeeded.");
+	cr_assert_eq(sf_errno, ENOMEM, "sf_errno is not ENOMEM!");
+	cr_assert_null(sf_calloc(0, 16), "A zero-length calloc returned a block.");
+
+	sf_errno = 0;
+	unsigned char *x = sf_calloc(3, 1000);
+	cr_assert_not_null(x, "x is NULL!");
+	for (size_t i = 0; i < 3000; i++)
+		cr_assert_eq(x[i], 0, "Fresh calloc byte %zu is not zero.", i);
+
+	memset(x, 0xff, 3000);
+	sf_free(x);
+	unsigned char *y = sf_calloc(250, 8);
+	cr_assert_eq(y, x, "calloc did not reuse the freed block.");
+	for (size_t i = 0; i < 250 * 8; i++)
+		cr_assert_eq(y[i], 0, "Reused calloc byte %zu is not zero.", i);
+	cr_assert_eq(sf_current_payload, 2000, "calloc payload not accounted.");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+// TLSF builds only support first-fit placement.
+#ifndef TLSF
+/**
+ * Test: best_fit_takes_smallest_block
+ *
+ * Under best-fit placement a request takes the smallest free block it fits in,
+ * not the most recently freed one. The policy can only be chosen before the heap
+ * is set up.
+ */
+Test(sfmm_student_suite, best_fit_takes_smallest_block, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_set_placement_policy((sf_placement_policy_t)7), -1, "An unknown policy was accepted.");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+	cr_assert_eq(sf_set_placement_policy(SF_PLACEMENT_BEST_FIT), 0, "Best-fit placement was rejected.");
+
+	char *a = sf_malloc(2000);
+	sf_malloc(300);
+	char *b = sf_malloc(1200);
+	sf_malloc(300);
+	char *c = sf_malloc(1500);
+	sf_malloc(300);
+	cr_assert(a && b && c, "Allocation failed.");
+
+	sf_errno = 0;
+	cr_assert_eq(sf_set_placement_policy(SF_PLACEMENT_FIRST_FIT), -1, "The policy changed after the heap was set up.");
+	cr_assert_eq(sf_errno, EINVAL, "sf_errno is not EINVAL!");
+
+	sf_free(a);
+	sf_free(b);
+	sf_free(c);
+	char *x = sf_malloc(1100);
+	cr_assert_eq(x, b, "Best fit did not take the smallest fitting block.");
+	char *y = sf_malloc(1900);
+	cr_assert_eq(y, a, "Best fit did not take the only fitting block.");
+}
+
+/**
+ * Test: address_ordered_takes_lowest_block
+ *
+ * Under address-ordered placement a request takes the lowest-addressed free block
+ * of its class, and freed blocks are kept in address order.
+ */
+Test(sfmm_student_suite, address_ordered_takes_lowest_block, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(sf_set_placement_policy(SF_PLACEMENT_ADDRESS_ORDERED), 0, "Address-ordered placement was rejected.");
+
+	char *a = sf_malloc(500);
+	sf_malloc(300);
+	char *b = sf_malloc(500);
+	sf_malloc(300);
+	char *c = sf_malloc(500);
+	sf_malloc(300);
+	cr_assert(a && b && c, "Allocation failed.");
+
+	sf_free(c);
+	sf_free(a);
+	sf_free(b);
+	char *x = sf_malloc(500);
+	cr_assert_eq(x, a, "Address order did not take the lowest block.");
+
+	size_t block_size = (((sf_block *)(b - 8))->header ^ sf_magic()) & ~0xffffffff0000000f;
+	sf_block *head = &sf_free_list_heads[get_free_list_index_for_size(block_size)];
+	cr_assert_eq(head->body.links.next, (sf_block *)(b - 8), "Free list is not in address order.");
+	cr_assert_eq(head->body.links.next->body.links.next, (sf_block *)(c - 8), "Free list is not in address order.");
+}
+#endif
+
+#ifdef STATIC_MAGIC
+/**
+ * Test: static_magic_matches_sfutil
+ *
+ * With a compile-time magic, headers are encoded with that constant and sfutil
+ * is told about it, so sf_magic() still decodes the heap.
+ */
+Test(sfmm_student_suite, static_magic_matches_sfutil, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc(100);
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq(sf_magic(), (sf_header)STATIC_MAGIC, "sfutil was not given the static magic.");
+
+	sf_block *bp = (sf_block *)(x - 8);
+	cr_assert_eq(decode_header(bp->header), (100ul << 32) | calculate_aligned_block_size(100) | THIS_BLOCK_ALLOCATED | PREV_BLOCK_ALLOCATED,
+		     "Header was not encoded with the static magic.");
+}
+#endif
+
+// The 24-byte requests would be served from slab runs instead of heap blocks.
+#if defined(FOOTER_ELISION) && !defined(SLAB_ALLOCATOR)
+/**
+ * Test: footer_elision_prev_alloc_bit
+ *
+ * Without allocated-block footers a 24-byte payload fits in a 32-byte block, and
+ * the successor's PREV_BLOCK_ALLOCATED bit follows the block's allocation state.
+ */
+Test(sfmm_student_suite, footer_elision_prev_alloc_bit, .timeout = TEST_TIMEOUT) {
+	char *x = sf_malloc(24);
+	char *y = sf_malloc(500); // 512-byte block, freed to the free lists
+	/* void *z = */ sf_malloc(24);
+	sf_block *bx = (sf_block *)(x - 8);
+	sf_block *by = (sf_block *)(y - 8);
+
+	cr_assert_eq((bx->header ^ sf_magic()) & 0xfffffff0, 32, "24-byte payload should use a 32-byte block.");
+	cr_assert_eq((char *)by, (char *)bx + 32, "y should directly follow x.");
+	memset(x, 0xff, 24); // the whole row after the header belongs to the payload
+	cr_assert((by->header ^ sf_magic()) & PREV_BLOCK_ALLOCATED, "y should see x as allocated.");
+
+	sf_free(y);
+	sf_block *after_y = (sf_block *)((char *)by + 512);
+	cr_assert(!((after_y->header ^ sf_magic()) & PREV_BLOCK_ALLOCATED),
+		  "The block after a freed block should see it as free.");
+	cr_assert((by->header ^ sf_magic()) & PREV_BLOCK_ALLOCATED, "Freeing y must keep its own prev bit.");
+	assert_free_block_count(512, 1);
+}
+#endif
+
+// The 8-page request is mapped instead once it reaches MMAP_THRESHOLD.
+#if !defined(MMAP_THRESHOLD) || MMAP_THRESHOLD > 32768
+/**
+ * Test: trim_decommits_free_tail
+ *
+ * sf_trim() decommits the free pages at the end of the heap once, leaves the free
+ * lists untouched, and the pages can be used again afterwards. With a threshold
+ * set, freeing a large tail block trims it automatically.
+ */
+Test(sfmm_student_suite, trim_decommits_free_tail, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_malloc(8 * PAGE_SZ);
+	cr_assert_not_null(x, "x is NULL!");
+	sf_free(x);
+
+	size_t released = sf_trim(0);
+	cr_assert(released >= 7 * PAGE_SZ, "Expected most of the heap to be decommitted, got %zu.", released);
+	cr_assert_eq(released % PAGE_SZ, 0, "Only whole pages can be decommitted.");
+	cr_assert_eq(sf_trim(0), 0, "The tail was already decommitted.");
+	assert_free_block_count(0, 1);
+
+	char *y = sf_malloc(4 * PAGE_SZ);
+	cr_assert_not_null(y, "y is NULL!");
+	memset(y, 0xab, 4 * PAGE_SZ);
+	cr_assert_eq(y[4 * PAGE_SZ - 1], (char)0xab, "Decommitted pages should be usable again.");
+
+	sf_set_trim_threshold(2 * PAGE_SZ);
+	sf_free(y); // leaves 4 committed pages at the tail
+	cr_assert_eq(sf_trim(0), 0, "Freeing y should have trimmed the tail already.");
+	sf_set_trim_threshold(0);
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+#endif
+
+/**
+ * Test: reset_discards_every_block
+ *
+ * sf_reset() leaves one free block spanning the whole heap, nothing cached and no
+ * payload, and allocation starts over from the first block afterwards.
+ */
+Test(sfmm_student_suite, reset_discards_every_block, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *x = sf_malloc(100);
+	char *y = sf_malloc(2000);
+	void *z = sf_malloc(50);
+	cr_assert(x != NULL && y != NULL && z != NULL, "Allocation failed.");
+	sf_free(z); // cached on a quick list
+	size_t heap_size = (char *)sf_mem_end() - (char *)sf_mem_start();
+
+	sf_reset();
+	cr_assert_eq(sf_current_payload, 0, "Reset left %zu bytes of payload.", sf_current_payload);
+	cr_assert_eq((size_t)((char *)sf_mem_end() - (char *)sf_mem_start()), heap_size,
+		     "The heap should keep its pages.");
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(heap_size - 48, 1);
+
+	char *w = sf_malloc(100);
+	cr_assert_eq(w, x, "Allocation should start over from the first block.");
+	sf_free(w);
+	cr_assert_eq(sf_current_payload, 0, "Payload still accounted after all frees.");
+	cr_assert(sf_errno == 0, "sf_errno is not 0!");
+}
+
+/**
+ * Test: stats_count_allocator_events
+ *
+ * sf_get_stats() reports per-class malloc/free counts, quick-list hits, in-place
+ * reallocs and free bytes per class; without ALLOC_STATS it fails and zeroes
+ * the struct.
+ */
+Test(sfmm_student_suite, stats_count_allocator_events, .timeout = TEST_TIMEOUT) {
+	sf_stats_t stats;
+	cr_assert_eq(sf_get_stats(NULL), -1, "A NULL struct should be rejected.");
+
+#if defined(ALLOC_STATS) && !defined(THREAD_SAFE)
+	size_t bsz = calculate_aligned_block_size(100);
+	int cls = get_stats_size_class(bsz);
+	void *x = sf_malloc(100);
+	sf_free(x);
+	x = sf_malloc(100); // served from the quick list
+
+	cr_assert_eq(sf_get_stats(&stats), 0, "sf_get_stats should succeed.");
+	cr_assert_eq(stats.malloc_count[cls], 2, "Expected 2 mallocs in class %d.", cls);
+	cr_assert_eq(stats.free_count[cls], 1, "Expected 1 free in class %d.", cls);
+	cr_assert_eq(stats.quick_list_hits, 1, "Expected 1 quick-list hit.");
+	cr_assert(stats.splits >= 1, "Carving x out of the heap should split.");
+	cr_assert_eq(stats.current_payload, 100, "Current payload should be 100.");
+
+	x = sf_realloc(x, 2000); // the rest of the heap is free, so x grows in place
+	size_t grown = calculate_aligned_block_size(2000);
+	cr_assert_eq(sf_get_stats(&stats), 0, "sf_get_stats should succeed.");
+	cr_assert_eq(stats.realloc_in_place, 1, "Expected 1 in-place realloc.");
+	cr_assert_eq(stats.realloc_moved, 0, "Expected no moved reallocs.");
+	cr_assert_eq(stats.free_bytes[get_stats_size_class(4048 - grown)], 4048 - grown,
+		     "The remainder of the heap should be counted as free bytes.");
+#elif !defined(ALLOC_STATS)
+	stats.splits = 1;
+	cr_assert_eq(sf_get_stats(&stats), -1, "sf_get_stats should fail without ALLOC_STATS.");
+	cr_assert_eq(stats.splits, 0, "The struct should be zeroed.");
+#endif
+}
+
+#if defined(ALLOC_STATS) && defined(THREAD_SAFE)
+/**
+ * Test: stats_ignore_cache_deltas_from_before_reset
+ *
+ * The calling thread's cached payload deltas date from the heap sf_reset()
+ * discarded, so sf_get_stats() must not fold them into the new heap's numbers.
+ */
+Test(sfmm_student_suite, stats_ignore_cache_deltas_from_before_reset, .timeout = TEST_TIMEOUT) {
+	sf_stats_t stats;
+	void *x = sf_malloc(40);
+	cr_assert_not_null(x, "Allocation failed.");
+
+	sf_reset();
+	cr_assert_eq(sf_get_stats(&stats), 0, "sf_get_stats should succeed.");
+	cr_assert_eq(stats.current_payload, 0, "Reset left %zu bytes of payload.", stats.current_payload);
+	cr_assert_eq(sf_get_stats(&stats), 0, "sf_get_stats should succeed.");
+	cr_assert_eq(stats.current_payload, 0, "A second read should agree.");
+}
+#endif
+
+/**
+ * Test: trace_records_each_call
+ *
+ * With ALLOC_TRACE a trace holds one record per sf_malloc/sf_realloc/sf_free,
+ * in order, with matching pointer ids; without it tracing cannot be started.
+ */
+Test(sfmm_student_suite, trace_records_each_call, .timeout = TEST_TIMEOUT) {
+	const char *path = "sfmm_tests.trace";
+	cr_assert_eq(sf_trace_stop(), -1, "Stopping an inactive trace should fail.");
+
+#ifdef ALLOC_TRACE
+	cr_assert_eq(sf_trace_start(path), 0, "sf_trace_start failed.");
+	cr_assert_eq(sf_trace_start(path), -1, "A second trace should be rejected.");
+	void *x = sf_malloc(100);
+	x = sf_realloc(x, 3000); // copies through nested sf_malloc/sf_free calls
+	sf_free(x);
+	cr_assert_eq(sf_trace_stop(), 0, "sf_trace_stop failed.");
+
+	FILE *trace = fopen(path, "rb");
+	cr_assert_not_null(trace, "The trace file was not written.");
+	char magic[8];
+	sf_trace_record records[4];
+	cr_assert_eq(fread(magic, 1, 8, trace), 8, "Missing trace header.");
+	cr_assert(memcmp(magic, SF_TRACE_MAGIC, 8) == 0, "Bad trace header.");
+	size_t count = fread(records, sizeof(records[0]), 4, trace);
+	fclose(trace);
+	remove(path);
+
+	cr_assert_eq(count, 3, "Expected 3 records, got %zu.", count);
+	cr_assert(records[0].op == SF_TRACE_MALLOC && records[0].size == 100 && records[0].id != 0,
+		  "Bad malloc record.");
+	cr_assert(records[1].op == SF_TRACE_REALLOC && records[1].size == 3000 &&
+		  records[1].old_id == records[0].id && records[1].id != 0, "Bad realloc record.");
+	cr_assert(records[2].op == SF_TRACE_FREE && records[2].id == records[1].id, "Bad free record.");
+	cr_assert(records[1].timestamp_ns >= records[0].timestamp_ns &&
+		  records[2].timestamp_ns >= records[1].timestamp_ns, "Timestamps should not decrease.");
+#else
+	cr_assert_eq(sf_trace_start(path), -1, "Tracing should be unavailable without ALLOC_TRACE.");
+#endif
+}
+
+/**
+ * Test: profile_samples_live_allocations
+ *
+ * With ALLOC_PROFILE and a rate of one byte every allocation is sampled, a
+ * free drops its sample, and the dump totals the rest under a heap_v2 header;
+ * without it the profiler cannot be used.
+ */
+Test(sfmm_student_suite, profile_samples_live_allocations, .timeout = TEST_TIMEOUT) {
+	const char *path = "sfmm_tests.heap";
+
+#ifdef ALLOC_PROFILE
+	cr_assert_eq(sf_profile_set_rate(1), 0, "sf_profile_set_rate failed.");
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(200);
+	sf_free(x);
+	cr_assert_eq(sf_profile_set_rate(0), 0, "Disabling the profiler failed.");
+	void *z = sf_malloc(300); // not sampled
+	cr_assert_eq(sf_profile_dump(path), 0, "sf_profile_dump failed.");
+	sf_free(y);
+	sf_free(z);
+
+	FILE *profile = fopen(path, "r");
+	cr_assert_not_null(profile, "The profile was not written.");
+	size_t live_count, live_bytes, total_count, total_bytes, rate;
+	int fields = fscanf(profile, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+			    &live_count, &live_bytes, &total_count, &total_bytes, &rate);
+	char line[256];
+	int has_mappings = 0;
+	while (fgets(line, sizeof(line), profile) != NULL)
+		has_mappings |= strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+	fclose(profile);
+	remove(path);
+
+	cr_assert_eq(fields, 5, "Bad profile header.");
+	cr_assert(live_count == 1 && live_bytes == 200, "Expected 1 live sample of 200 bytes, got %zu of %zu.",
+		  live_count, live_bytes);
+	cr_assert(total_count == 2 && total_bytes == 300, "Expected 2 samples of 300 bytes, got %zu of %zu.",
+		  total_count, total_bytes);
+	cr_assert_eq(rate, 1, "The header should carry the sampling rate.");
+	cr_assert(has_mappings, "The profile lacks the memory map.");
+#else
+	cr_assert_eq(sf_profile_set_rate(1), -1, "Profiling should be unavailable without ALLOC_PROFILE.");
+	cr_assert_eq(sf_profile_dump(path), -1, "Profiling should be unavailable without ALLOC_PROFILE.");
+#endif
+}
+
+typedef struct walk_totals {
+	size_t heap_bytes;
+	char *expected_next; // The walk must visit heap blocks back to back.
+	sf_block_info_t a, b;
+} walk_totals;
+
+static int total_heap_blocks(const sf_block_info_t *block, void *ctx) {
+	walk_totals *totals = ctx;
+	if (block->state == SF_BLOCK_MAPPED)
+		return 0;
+	cr_assert_eq(block->address, totals->expected_next, "Walk skipped or repeated a block.");
+	totals->expected_next = (char *)block->address + block->size;
+	totals->heap_bytes += block->size;
+	if ((char *)block->address + 8 == (char *)totals->a.address)
+		totals->a = *block;
+	else if ((char *)block->address + 8 == (char *)totals->b.address)
+		totals->b = *block;
+	return 0;
+}
+
+/**
+ * Test: heap_walk_and_snapshot_report_each_block
+ *
+ * sf_heap_walk visits every heap block in address order with its state and live
+ * payload, and sf_heap_snapshot writes the same blocks as JSON.
+ */
+Test(sfmm_student_suite, heap_walk_and_snapshot_report_each_block, .timeout = TEST_TIMEOUT) {
+	void *x = sf_malloc(100);
+	void *y = sf_malloc(3000);
+	sf_free(x);
+
+	walk_totals totals = {0, (char *)sf_mem_start() + 40, {.address = x}, {.address = y}};
+	cr_assert_eq(sf_heap_walk(total_heap_blocks, &totals), 0, "sf_heap_walk failed.");
+	cr_assert_eq(totals.heap_bytes, (char *)sf_mem_end() - (char *)sf_mem_start() - 48,
+		     "The walk did not cover the heap (%zu bytes).", totals.heap_bytes);
+	cr_assert(totals.a.state == SF_BLOCK_CACHED && totals.a.payload == 0,
+		  "A quick-list block should be cached with no payload.");
+	cr_assert(totals.b.state == SF_BLOCK_ALLOCATED && totals.b.payload == 3000,
+		  "A live block should report its requested size.");
+	cr_assert_eq(sf_heap_walk(NULL, NULL), -1, "A NULL callback should be rejected.");
+
+	const char *path = "sfmm_tests.json";
+	cr_assert_eq(sf_heap_snapshot(path), 0, "sf_heap_snapshot failed.");
+	FILE *snapshot = fopen(path, "r");
+	cr_assert_not_null(snapshot, "The snapshot was not written.");
+	char line[256], expected[128];
+	snprintf(expected, sizeof(expected), "{\"address\": \"%p\", \"size\": %zu, \"state\": \"allocated\", \"payload\": 3000}",
+		 totals.b.address, totals.b.size);
+	int found = 0;
+	while (fgets(line, sizeof(line), snapshot) != NULL)
+		found |= (strncmp(line, expected, strlen(expected)) == 0);
+	fclose(snapshot);
+	remove(path);
+	cr_assert(found, "The snapshot is missing %s", expected);
+}
+
+#ifdef TLSF
+/**
+ * Test: tlsf_class_mapping
+ *
+ * Under TLSF, small blocks map to 32-byte linear classes, and larger blocks map to
+ * TLSF_SL_COUNT linear subdivisions of each power of two.
+ */
+Test(sfmm_student_suite, tlsf_class_mapping, .timeout = TEST_TIMEOUT) {
+	cr_assert_eq(get_free_list_index_for_size(32), 1);
+	cr_assert_eq(get_free_list_index_for_size(48), 1);
+	cr_assert_eq(get_free_list_index_for_size(240), 7);
+	cr_assert_eq(get_free_list_index_for_size(256), TLSF_SL_COUNT);
+	cr_assert_eq(get_free_list_index_for_size(2048), 4 * TLSF_SL_COUNT);
+	cr_assert_eq(get_free_list_index_for_size(2048 + 256), 4 * TLSF_SL_COUNT + 1);
+	cr_assert_eq(get_free_list_index_for_size(4096 - 16), 4 * TLSF_SL_COUNT + TLSF_SL_COUNT - 1);
+}
+
+/**
+ * Test: tlsf_good_fit_placement
+ *
+ * With a small and a large free block available, a mid-size request must be placed
+ * in the smallest class that is guaranteed to fit instead of splitting the large block.
+ */
+Test(sfmm_student_suite, tlsf_good_fit_placement, .timeout = TEST_TIMEOUT) {
+	void *a = sf_malloc(2500);  // 2528-byte block
+	/* void *b = */ sf_malloc(8);
+	/* void *c = */ sf_malloc(8);
+
+	sf_free(a);
+
+	void *d = sf_malloc(2200);  // 2224-byte block: must come from a's class, not the wilderness
+	cr_assert_eq(d, a, "Expected the 2528-byte block to be reused (got %p, exp %p)", d, a);
+}
+#endif
+
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#include <string.h>
+
+static void *thread_cache_worker(void *arg) {
+	size_t size = (size_t)arg;
+	void *blocks[64];
+	for (int round = 0; round < 200; round++) {
+		for (int i = 0; i < 64; i++) {
+			blocks[i] = sf_malloc(size);
+			cr_assert_not_null(blocks[i], "Allocation failed in worker.");
+			memset(blocks[i], (int)size, size);
+		}
+		for (int i = 0; i < 64; i++) {
+			unsigned char *p = blocks[i];
+			cr_assert(p[0] == (unsigned char)size && p[size - 1] == (unsigned char)size,
+				  "Block contents were clobbered by another thread.");
+			sf_free(blocks[i]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Test: thread_safe_concurrent_small_objects
+ *
+ * Several threads churn small blocks concurrently through their thread caches.
+ * After they exit (which flushes their caches back to the shared quick lists), all
+ * payload must be accounted as freed and the per-thread hit counters must have been
+ * folded into the globals.
+ */
+Test(sfmm_student_suite, thread_safe_concurrent_small_objects, .timeout = TEST_TIMEOUT) {
+	pthread_t threads[4];
+	for (size_t t = 0; t < 4; t++)
+		pthread_create(&threads[t], NULL, thread_cache_worker, (void *)(16 + 40 * t));
+	for (int t = 0; t < 4; t++)
+		pthread_join(threads[t], NULL);
+
+	cr_assert_eq(sf_current_payload, 0, "Payload still accounted after all frees (%zu).", sf_current_payload);
+	cr_assert_gt(sf_quick_list_hits, 0, "Thread cache hits were not folded into the globals.");
+
+	int shared_quick_blocks = 0;
+	for (int i = 0; i < NUM_QUICK_LISTS; i++)
+		shared_quick_blocks += sf_quick_lists[i].length;
+	cr_assert_gt(shared_quick_blocks, 0, "Exited threads did not return their cached blocks.");
+}
+#endif
+
+// Every THREAD_SAFE build routes frees of another thread's blocks back to it.
+#ifdef THREAD_SAFE
+static void *remote_free_worker(void *arg) {
+	void **blocks = arg;
+	for (int i = 0; i < THREAD_CACHE_REFILL; i++)
+		sf_free(blocks[i]);
+	return NULL;
+}
+
+/**
+ * Test: remote_frees_return_to_owner
+ *
+ * Blocks freed by another thread go back to the thread whose cache handed them out,
+ * not to the freeing thread's cache (which would flush them to the shared quick list
+ * when it exits). The owner's next miss reuses them.
+ */
+Test(sfmm_student_suite, remote_frees_return_to_owner, .timeout = TEST_TIMEOUT) {
+	void *blocks[THREAD_CACHE_REFILL];
+	for (int i = 0; i < THREAD_CACHE_REFILL; i++)
+		blocks[i] = sf_malloc(40); // one refill's worth of 48-byte blocks
+
+	pthread_t consumer;
+	pthread_create(&consumer, NULL, remote_free_worker, blocks);
+	pthread_join(consumer, NULL);
+	cr_assert_eq(sf_quick_lists[1].length, 0, "Remote frees reached the shared quick list.");
+
+	for (int i = 0; i < THREAD_CACHE_REFILL; i++) {
+		void *x = sf_malloc(40);
+		int reused = 0;
+		for (int j = 0; j < THREAD_CACHE_REFILL; j++)
+			reused |= (x == blocks[j]);
+		cr_assert(reused, "Allocation %d did not reuse a remotely freed block.", i);
+		sf_free(x);
+	}
+	sf_thread_cache_flush();
+	cr_assert_eq(sf_current_payload, 0, "Payload still accounted after all frees (%zu).", sf_current_payload);
+}
+#endif
+
+/**
+ * Test: arena_blocks_are_isolated
+ *
+ * Blocks freed into an arena are reused by that arena only: they never show up in
+ * the main heap's free lists or quick lists, and the arena tracks its own payload.
+ */
+Test(sfmm_student_suite, arena_blocks_are_isolated, .timeout = TEST_TIMEOUT) {
+	sf_arena_t *arena = sf_arena_create();
+	cr_assert_not_null(arena, "sf_arena_create failed.");
+
+	size_t main_payload = sf_current_payload;
+	void *x = sf_arena_malloc(arena, 100);
+	void *y = sf_arena_malloc(arena, 40);
+	cr_assert(x && y, "Arena allocation failed.");
+	cr_assert_eq(sf_current_payload, main_payload, "Arena payload leaked into the main heap counters.");
+	double block_size = calculate_aligned_block_size(100) + calculate_aligned_block_size(40); // 128 + 64
+	cr_assert_float_eq(sf_arena_fragmentation(arena), 140.0 / block_size, 1e-6,
+			   "Unexpected arena fragmentation %f", sf_arena_fragmentation(arena));
+
+	sf_arena_free(arena, y);
+	sf_arena_free(arena, x);
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+
+	void *z = sf_arena_malloc(arena, 40);
+	cr_assert_eq(z, y, "Arena quick list did not serve the freed block.");
+
+	sf_arena_destroy(arena);
+}
+
+/**
+ * Test: arena_destroy_releases_everything
+ *
+ * Destroying an arena with many live blocks (spread over several chunks) gives all
+ * of its memory back to the main heap in one call, leaving one free block there.
+ */
+Test(sfmm_student_suite, arena_destroy_releases_everything, .timeout = TEST_TIMEOUT) {
+	sf_arena_t *arena = sf_arena_create();
+	cr_assert_not_null(arena, "sf_arena_create failed.");
+
+	for (int i = 0; i < 200; i++)
+		cr_assert_not_null(sf_arena_malloc(arena, 8 + (i % 25) * 16), "Arena allocation %d failed.", i);
+	cr_assert_not_null(sf_arena_malloc(arena, 5 * PAGE_SZ), "Oversized arena allocation failed.");
+
+	sf_arena_destroy(arena);
+#ifdef DEFERRED_COALESCING
+	sf_trim(SIZE_MAX); // runs the deferred coalescing pass and keeps the free tail committed
+#endif
+
+	size_t heap_size = (char *)sf_mem_end() - (char *)sf_mem_start();
+	cr_assert_eq(sf_current_payload, 0, "Main heap still accounts arena memory.");
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(heap_size - 48, 1);
+}
+
+#ifdef MMAP_THRESHOLD
+/**
+ * Test: large_allocations_are_mapped
+ *
+ * Requests of at least MMAP_THRESHOLD bytes live outside the heap and count
+ * towards fragmentation. Growing one keeps its data, shrinking it below the
+ * threshold moves it into the heap, and freeing a mapped block unmaps it.
+ */
+Test(sfmm_student_suite, large_allocations_are_mapped, .timeout = TEST_TIMEOUT) {
+	size_t size = MMAP_THRESHOLD;
+	char *x = sf_malloc(size);
+	cr_assert_not_null(x, "Large allocation failed.");
+	cr_assert_eq((uintptr_t)x % 16, 0, "Mapped payload is misaligned.");
+	cr_assert(sf_mem_start() == sf_mem_end() || (void *)x < sf_mem_start() || (void *)x >= sf_mem_end(),
+		  "Large allocation was served from the heap.");
+	cr_assert_eq(sf_current_payload, size, "Mapped payload not accounted.");
+	cr_assert_gt(sf_fragmentation(), 0.5, "Mapped block missing from fragmentation.");
+	cr_assert_gt(sf_utilization(), 0.5, "Mapped block missing from utilization.");
+
+	memset(x, 'a', size);
+	char *y = sf_realloc(x, 4 * size);
+	cr_assert_not_null(y, "Growing a mapped block failed.");
+	for (size_t i = 0; i < size; i++)
+		cr_assert_eq(y[i], 'a', "Growing a mapped block lost byte %zu.", i);
+	cr_assert_eq(sf_current_payload, 4 * size, "Grown mapped payload not accounted.");
+
+	char *z = sf_realloc(y, 100);
+	cr_assert_not_null(z, "Shrinking a mapped block failed.");
+	cr_assert((void *)z >= sf_mem_start() && (void *)z < sf_mem_end(),
+		  "A small block was left in a mapping.");
+	cr_assert_eq(z[99], 'a', "Moving a mapped block into the heap lost data.");
+	sf_free(z);
+
+	void *w = sf_malloc(size);
+	cr_assert_not_null(w, "Large allocation failed.");
+	sf_free(w);
+	cr_assert_eq(sf_current_payload, 0, "Freed mapped block still accounted.");
+	cr_assert_lt(sf_fragmentation(), 0.9, "Freed mapped block still counted as allocated.");
+}
+
+/**
+ * Test: arena_chunks_stay_in_heap
+ *
+ * Arena chunks are heap blocks even when they are at least MMAP_THRESHOLD
+ * bytes, so arena blocks free and coalesce with the usual heap checks.
+ */
+Test(sfmm_student_suite, arena_chunks_stay_in_heap, .timeout = TEST_TIMEOUT) {
+	sf_arena_t *arena = sf_arena_create();
+	cr_assert_not_null(arena, "sf_arena_create failed.");
+	char *p = sf_arena_malloc(arena, 100);
+	char *q = sf_arena_malloc(arena, 200);
+	size_t big_size = (MMAP_THRESHOLD > ARENA_CHUNK_SIZE) ? MMAP_THRESHOLD : ARENA_CHUNK_SIZE;
+	char *big = sf_arena_malloc(arena, big_size); // needs a chunk of its own
+	cr_assert(p && q && big, "Arena allocation failed.");
+	cr_assert((void *)p >= sf_mem_start() && (void *)big + big_size <= sf_mem_end(),
+		  "An arena chunk was mapped outside the heap.");
+
+	sf_arena_free(arena, p);
+	sf_arena_free(arena, q);
+	sf_arena_free(arena, big);
+	sf_arena_destroy(arena);
+	cr_assert_eq(sf_current_payload, 0, "Main heap still accounts arena memory.");
+}
+#endif
+
+// HUGE_PAGES only shapes mappings, which need MMAP_THRESHOLD.
+#if defined(MMAP_THRESHOLD) && defined(HUGE_PAGES)
+#include <sys/mman.h>
+
+/**
+ * Test: huge_mappings_are_aligned
+ *
+ * A mapping of at least HUGE_PAGE_SZ starts on a huge-page boundary, and
+ * stays on one with its data intact when sf_realloc grows it. A smaller
+ * mapping lands on one when sf_realloc grows it past HUGE_PAGE_SZ.
+ */
+Test(sfmm_student_suite, huge_mappings_are_aligned, .timeout = TEST_TIMEOUT) {
+	size_t size = 3 << 20;
+	char *x = sf_malloc(size);
+	cr_assert_not_null(x, "Huge allocation failed.");
+	cr_assert_lt((uintptr_t)x % HUGE_PAGE_SZ, PAGE_SZ, "Huge mapping is not huge-page aligned.");
+
+	memset(x, 'h', size);
+	char *y = sf_realloc(x, 5 << 20);
+	cr_assert_not_null(y, "Growing a huge mapping failed.");
+	cr_assert_lt((uintptr_t)y % HUGE_PAGE_SZ, PAGE_SZ, "Grown huge mapping is not huge-page aligned.");
+	for (size_t i = 0; i < size; i += PAGE_SZ)
+		cr_assert_eq(y[i], 'h', "Growing a huge mapping lost byte %zu.", i);
+	cr_assert_eq(y[size - 1], 'h', "Growing a huge mapping lost its last byte.");
+	sf_free(y);
+	cr_assert_eq(sf_current_payload, 0, "Freed huge mapping still accounted.");
+
+	// A mapping that starts out smaller than a huge page moves onto a boundary
+	// when it grows past one. It is placed right below a reservation that is then
+	// released, so extending it in place, unaligned, would also succeed. (The
+	// reservation is not a huge-page multiple, so the kernel does not align it.)
+	size_t small = 1 << 20, reserved = 4 * HUGE_PAGE_SZ + PAGE_SZ;
+	void *above = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	cr_assert_neq(above, MAP_FAILED, "Reserving address space failed.");
+	char *s = sf_malloc(small);
+	munmap(above, reserved);
+	cr_assert_not_null(s, "Sub-huge-page mapping failed.");
+	memset(s, 's', small);
+	char *t = sf_realloc(s, 3 << 20);
+	cr_assert_not_null(t, "Growing a mapping past a huge page failed.");
+	cr_assert_lt((uintptr_t)t % HUGE_PAGE_SZ, PAGE_SZ, "Mapping grown past a huge page is not aligned.");
+	for (size_t i = 0; i < small; i += PAGE_SZ)
+		cr_assert_eq(t[i], 's', "Growing past a huge page lost byte %zu.", i);
+	cr_assert_eq(t[small - 1], 's', "Growing past a huge page lost its last byte.");
+	sf_free(t);
+	cr_assert_eq(sf_current_payload, 0, "Freed grown mapping still accounted.");
+}
+#endif
+
+#ifdef DEFERRED_COALESCING
+/**
+ * Test: deferred_frees_coalesce_on_demand
+ *
+ * Freed neighbours stay separate free blocks until a request fits none of
+ * them; the search then merges them and uses the result instead of growing
+ * the heap.
+ */
+Test(sfmm_student_suite, deferred_frees_coalesce_on_demand, .timeout = TEST_TIMEOUT) {
+	char *a = sf_malloc(500);
+	char *b = sf_malloc(500);
+	size_t bsz = (((sf_block *)(a - 8))->header ^ sf_magic()) & ~0xffffffff0000000f;
+	char *c = sf_malloc(4048 - 2 * bsz - ALLOCATED_BLOCK_OVERHEAD);
+	cr_assert(a && b && c, "Allocation failed.");
+	assert_free_block_count(0, 0);
+
+	sf_free(a);
+	sf_free(b);
+	assert_free_block_count(bsz, 2);
+
+	char *x = sf_malloc(2 * bsz - ALLOCATED_BLOCK_OVERHEAD);
+	cr_assert_eq(x, a, "The merged neighbours were not reused.");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), PAGE_SZ, "The heap grew instead.");
+	assert_free_block_count(0, 0);
+}
+#endif
+
+#ifdef SLAB_ALLOCATOR
+/**
+ * Test: slab_packs_tiny_objects
+ *
+ * Tiny requests share a slab run with no per-object headers, are still
+ * counted in the payload totals, resize in place within their class, and
+ * leave the run when they grow past SLAB_MAX_SIZE.
+ */
+Test(sfmm_student_suite, slab_packs_tiny_objects, .timeout = TEST_TIMEOUT) {
+	char *p[8];
+	for (int i = 0; i < 8; i++) {
+		p[i] = sf_malloc(12);
+		cr_assert_not_null(p[i], "Tiny allocation failed.");
+		memset(p[i], 'a' + i, 12);
+	}
+	for (int i = 1; i < 8; i++)
+		cr_assert_eq(p[i] - p[i - 1], SLAB_SLOT_SIZE, "Tiny objects are not packed.");
+	cr_assert_eq(sf_current_payload, 8 * 12, "Slab payload not accounted.");
+	cr_assert_float_eq(sf_fragmentation(), sf_fragmentation_walk(), 1e-9,
+			   "Slab payload disagrees with the heap walk.");
+
+	char *q = sf_realloc(p[0], SLAB_SLOT_SIZE);
+	cr_assert_eq(q, p[0], "Resizing within a class moved the object.");
+	char *r = sf_realloc(p[1], SLAB_MAX_SIZE + 1);
+	cr_assert_not_null(r, "Growing a tiny object failed.");
+	cr_assert_neq(r, p[1], "Object larger than SLAB_MAX_SIZE stayed in its slot.");
+	for (int i = 0; i < 12; i++)
+		cr_assert_eq(r[i], 'b', "Growing a tiny object lost byte %d.", i);
+	p[1] = r;
+
+	for (int i = 0; i < 8; i++)
+		sf_free(p[i]);
+	cr_assert_eq(sf_current_payload, 0, "Freed slots still accounted.");
+}
+#endif
+
+// The cover size assumes FOOTER_ELISION is off, and THREAD_SAFE would carve x from a refill batch.
+#if defined(SLAB_ALLOCATOR) && !defined(THREAD_SAFE) && !defined(FOOTER_ELISION)
+/**
+ * Test: reset_forgets_slab_runs
+ *
+ * A run discarded by sf_reset() stays in heap memory. Here one block keeps the
+ * run's header and signature intact while a second block starts where the
+ * run's second slot was; freeing it must still be an ordinary free.
+ */
+Test(sfmm_student_suite, reset_forgets_slab_runs, .timeout = TEST_TIMEOUT) {
+	char *tiny = sf_malloc(8); // slot 0 of a new run
+	cr_assert_not_null(tiny, "Tiny allocation failed.");
+	char *heap_start = sf_mem_start();
+	sf_reset();
+
+	char *second_slot = tiny + SLAB_SLOT_SIZE;
+	size_t cover_size = (size_t)(second_slot - 8 - (heap_start + 40));
+	void *cover = sf_malloc(cover_size - ALLOCATED_BLOCK_OVERHEAD); // never written
+	void *x = sf_malloc(40);
+	cr_assert_not_null(cover, "Covering allocation failed.");
+	cr_assert_eq(x, second_slot, "Expected x to start at the old run's second slot.");
+
+	sf_free(x);
+	sf_free(cover);
+	cr_assert_eq(sf_current_payload, 0, "Payload still accounted after all frees.");
+	assert_quick_list_block_count(64, 1); // x went back as a heap block
+}
+#endif